@@ -0,0 +1,856 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** the benchmark of libnar (see make bench): synthetic corpora are generated
+** in a temporary directory, then for each corpus and each compression driver
+** an archive is built with libnar_append_file, listed, looked up and
+** extracted. Each step prints one line of tab separated values:
+**
+**   corpus driver operation items bytes archive_bytes seconds MB/s items/s
+**   syscalls/item
+**
+** bytes are the uncompressed bytes of the items (the archive ones for list)
+** and the syscalls are the ones issued on the archive (counted by a backend
+** wrapping libnar_fd_io). With -m the archive is kept in memory instead
+** (libnar_memory_io): no disk I/O is done on it, and the calls to the backend
+** are counted as syscalls. The corpora are generated from a fixed seed: two
+** runs are comparable.
+*/
+
+/* In order to use nftw and mkdtemp */
+#define _GNU_SOURCE
+#include "libnar.h"
+#include "nar.h"
+#include "default_reader.h"
+#include "zlib_readers.h"
+#if defined(HAVE_ZSTD)
+# include "zstd_readers.h"
+#endif
+#if defined(HAVE_LZ4)
+# include "lz4_readers.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <ftw.h>
+
+/* the buffer of the extracted contents */
+#define BENCH_BUFFER_SIZE (256 * 1024)
+
+/*
+** ---- DRIVERS
+*/
+
+static struct bench_driver {
+  char const* name;
+  nar_compression_type type;
+  get_computed_content callback;
+  void* (*init) (struct nar_options const* nar);
+  void  (*close)(void*  opaque);
+} bench_drivers[] = {
+  { "none", COMPRESSION_NONE
+  , default_reader, init_default_reader, close_default_reader },
+  { "deflate", COMPRESSION_DEFLATE
+  , zlib_reader, init_zlib_reader, close_zlib_reader },
+#if defined(HAVE_ZSTD)
+  { "zstd", COMPRESSION_ZSTD
+  , zstd_reader, init_zstd_reader, close_zstd_reader },
+#endif
+#if defined(HAVE_LZ4)
+  { "lz4", COMPRESSION_LZ4
+  , lz4_reader, init_lz4_reader, close_lz4_reader },
+#endif
+  { NULL, COMPRESSION_NONE, NULL, NULL, NULL }
+};
+
+/*
+** ---- CORPORA
+*/
+
+enum corpus_kind {
+  CORPUS_TEXT,   /* compressible */
+  CORPUS_RANDOM, /* incompressible */
+  CORPUS_MIXED   /* one file out of two of each */
+};
+
+static struct bench_corpus {
+  char const* name;
+  enum corpus_kind kind;
+  uint32_t files;
+  /* the file sizes: log-uniform in [min_size, max_size] */
+  uint64_t min_size;
+  uint64_t max_size;
+  /* the scale (-s) applies to the sizes rather than to the number of files */
+  int scale_size;
+} bench_corpora[] = {
+  { "tiny",   CORPUS_TEXT,   10000, 1,         4096,             0 },
+  { "huge",   CORPUS_MIXED,  2,     64 << 20,  64 << 20,         1 },
+  { "mixed",  CORPUS_MIXED,  500,   16,        1 << 20,          0 },
+  { "text",   CORPUS_TEXT,   64,    1 << 20,   1 << 20,          0 },
+  { "random", CORPUS_RANDOM, 64,    1 << 20,   1 << 20,          0 },
+  { NULL, CORPUS_TEXT, 0, 0, 0, 0 }
+};
+
+/* xorshift64*: the same corpora on each run */
+static uint64_t bench_random(uint64_t* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static char const* const bench_words[] = {
+  "archive ", "item ", "header ", "content ", "index ", "the ", "of ",
+  "a ", "file ", "compression ", "block ", "offset ", "length ", "nar ",
+  "read ", "write ", "stream\n", "buffer ", "and ", "to ", "is ", "\n"
+};
+
+static void fill_text(uint64_t* state, uint8_t* buf, uint64_t length)
+{
+  uint64_t i = 0;
+  char const* word;
+  size_t size;
+
+  while (i < length) {
+    word = bench_words[bench_random(state)
+                       % (sizeof(bench_words) / sizeof(bench_words[0]))];
+    size = strlen(word);
+    if (size > length - i) {
+      size = length - i;
+    }
+    memcpy(buf + i, word, size);
+    i += size;
+  }
+}
+
+static void fill_random(uint64_t* state, uint8_t* buf, uint64_t length)
+{
+  uint64_t i;
+  uint64_t r;
+
+  for (i = 0; i + 8 <= length; i += 8) {
+    r = bench_random(state);
+    memcpy(buf + i, &r, 8);
+  }
+  r = bench_random(state);
+  memcpy(buf + i, &r, length - i);
+}
+
+static uint32_t log2_floor(uint64_t value)
+{
+  uint32_t ret = 0;
+
+  while (value >>= 1) {
+    ret++;
+  }
+  return ret;
+}
+
+/* a size log-uniform in [min, max]: a power of 2, then a size in its range */
+static uint64_t corpus_size(uint64_t* state, struct bench_corpus const* bc,
+                            int scale)
+{
+  uint64_t min = bc->min_size, max = bc->max_size;
+  uint64_t size;
+  uint32_t lo, hi;
+
+  if (bc->scale_size) {
+    min = min * scale / 100;
+    max = max * scale / 100;
+  }
+  if (min < 1) {
+    min = 1;
+  }
+  if (max < min) {
+    max = min;
+  }
+
+  lo = log2_floor(min);
+  hi = log2_floor(max);
+  size = 1ULL << (lo + bench_random(state) % (hi - lo + 1));
+  size += bench_random(state) % size;
+  if (size < min) {
+    size = min;
+  } else if (size > max) {
+    size = max;
+  }
+  return size;
+}
+
+/* the path of the file i of the corpus, -1 if it is too long */
+static int corpus_path(char* path, size_t length, char const* dir,
+                       struct bench_corpus const* bc, uint32_t i)
+{
+  int ret = snprintf(path, length, "%s/%s/%05u", dir, bc->name, i);
+
+  if (ret < 0 || (size_t) ret >= length) {
+    ERROR("the path of %s is too long", dir);
+    return -1;
+  }
+  return 0;
+}
+
+/* the number of files of the corpus at the given scale */
+static uint32_t corpus_files(struct bench_corpus const* bc, int scale)
+{
+  uint64_t files = bc->files;
+
+  if (!bc->scale_size) {
+    files = files * scale / 100;
+  }
+  return (files > 0) ? files : 1;
+}
+
+static int write_corpus_file(char const* path, uint8_t const* buf,
+                             uint64_t length)
+{
+  ssize_t ret;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    ERROR("open(%s) errno(%d): %s", path, errno, strerror(errno));
+    return -1;
+  }
+
+  while (length > 0) {
+    ret = write(fd, buf, length);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1) {
+      ERROR("write(%s) errno(%d): %s", path, errno, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    buf += ret;
+    length -= ret;
+  }
+
+  return close(fd);
+}
+
+/*
+** generate the files of the corpus in dir/<name>/ and set bytes to their
+** total size
+*/
+static int generate_corpus(char const* dir, struct bench_corpus const* bc,
+                           int scale, uint64_t* bytes)
+{
+  uint64_t state = 0x6e61722d62656e63ULL;
+  uint32_t files = corpus_files(bc, scale);
+  char path[PATH_MAX];
+  uint8_t* buf = NULL;
+  uint64_t capacity = 0;
+  uint64_t size;
+  uint32_t i;
+  int text;
+
+  if (snprintf(path, sizeof(path), "%s/%s", dir, bc->name)
+      >= (int) sizeof(path)) {
+    ERROR("the path of %s is too long", dir);
+    return -1;
+  }
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    ERROR("mkdir(%s) errno(%d): %s", path, errno, strerror(errno));
+    return -1;
+  }
+
+  *bytes = 0;
+  for (i = 0; i < files; i++) {
+    size = corpus_size(&state, bc, scale);
+    if (size > capacity) {
+      uint8_t* tmp = realloc(buf, size);
+
+      if (tmp == NULL) {
+        ERROR("can't allocate %llu bytes", (unsigned long long int) size);
+        free(buf);
+        return -1;
+      }
+      buf = tmp;
+      capacity = size;
+    }
+
+    text = bc->kind == CORPUS_TEXT || (bc->kind == CORPUS_MIXED && i % 2 == 0);
+    if (text) {
+      fill_text(&state, buf, size);
+    } else {
+      fill_random(&state, buf, size);
+    }
+
+    if (corpus_path(path, sizeof(path), dir, bc, i) != 0
+        || write_corpus_file(path, buf, size) != 0) {
+      free(buf);
+      return -1;
+    }
+    *bytes += size;
+  }
+
+  free(buf);
+  return 0;
+}
+
+/*
+** ---- COUNTED I/O
+**
+** libnar_fd_io (or libnar_memory_io with -m), counting the syscalls issued on
+** the archive
+*/
+
+typedef struct {
+  /* the wrapped backend */
+  nar_io const* io;
+  void* opaque;
+  /* the archive file descriptor, -1 with -m */
+  int fd;
+  uint64_t syscalls;
+} bench_io_state;
+
+static int64_t counted_read(void* opaque, void* buf, uint64_t const size)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->read(s->opaque, buf, size);
+}
+
+static int64_t counted_pread(void* opaque, void* buf, uint64_t const size,
+                             uint64_t const offset)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->pread(s->opaque, buf, size, offset);
+}
+
+static int64_t counted_write(void* opaque, void const* buf,
+                             uint64_t const size)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->write(s->opaque, buf, size);
+}
+
+static int64_t counted_pwrite(void* opaque, void const* buf,
+                              uint64_t const size, uint64_t const offset)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->pwrite(s->opaque, buf, size, offset);
+}
+
+static int64_t counted_seek(void* opaque, int64_t const offset,
+                            int const whence)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->seek(s->opaque, offset, whence);
+}
+
+static int64_t counted_size(void* opaque)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->size(s->opaque);
+}
+
+static int counted_truncate(void* opaque, uint64_t const length)
+{
+  bench_io_state* s = opaque;
+
+  s->syscalls++;
+  return s->io->truncate(s->opaque, length);
+}
+
+static nar_io const bench_io = {
+  .read = counted_read,
+  .pread = counted_pread,
+  .write = counted_write,
+  .pwrite = counted_pwrite,
+  .seek = counted_seek,
+  .size = counted_size,
+  .truncate = counted_truncate
+};
+
+/*
+** ---- STEPS
+*/
+
+struct bench_context {
+  char const* dir;
+  char const* archive;
+  /* the archive in memory (-m) */
+  int memory;
+  nar_memory archive_memory;
+  int scale;
+  struct bench_corpus const* corpus;
+  struct bench_driver const* driver;
+  uint32_t files;
+  /* the uncompressed size of the corpus, and the size of its archive */
+  uint64_t bytes;
+  uint64_t archive_bytes;
+};
+
+struct bench_result {
+  uint64_t items;
+  uint64_t bytes;
+  uint64_t syscalls;
+  struct timespec start;
+  double seconds;
+};
+
+static void result_start(struct bench_result* r)
+{
+  memset(r, 0, sizeof(struct bench_result));
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+}
+
+static void result_stop(struct bench_result* r)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  r->seconds = (end.tv_sec - r->start.tv_sec)
+             + (end.tv_nsec - r->start.tv_nsec) / 1e9;
+}
+
+static void print_result(struct bench_context const* ctx, char const* step,
+                         struct bench_result const* r)
+{
+  double seconds = (r->seconds > 0) ? r->seconds : 1e-9;
+
+  printf("%s\t%s\t%s\t%llu\t%llu\t%llu\t%.6f\t%.2f\t%.2f\t%.2f\n",
+         ctx->corpus->name, ctx->driver->name, step,
+         (unsigned long long int) r->items,
+         (unsigned long long int) r->bytes,
+         (unsigned long long int) ctx->archive_bytes,
+         r->seconds, r->bytes / seconds / 1e6, r->items / seconds,
+         (r->items) ? (double) r->syscalls / r->items : 0.0);
+  fflush(stdout);
+}
+
+/*
+** open the archive (a new one if flags has O_TRUNC) on the counted backend
+*/
+static int open_bench_io(struct bench_context* ctx, bench_io_state* state,
+                         int const flags)
+{
+  state->syscalls = 0;
+  state->io = NULL;
+  state->fd = -1;
+
+  if (ctx->memory) {
+    if (flags & O_TRUNC) {
+      libnar_close_memory(&ctx->archive_memory);
+      libnar_init_memory(&ctx->archive_memory, NULL, 0);
+    }
+    ctx->archive_memory.position = 0;
+    state->io = &libnar_memory_io;
+    state->opaque = &ctx->archive_memory;
+    return 0;
+  }
+
+  state->fd = open(ctx->archive, flags, 0644);
+  if (state->fd == -1) {
+    ERROR("open(%s) errno(%d): %s", ctx->archive, errno, strerror(errno));
+    return -1;
+  }
+  state->io = &libnar_fd_io;
+  state->opaque = LIBNAR_FD_IO(state->fd);
+  return 0;
+}
+
+static void close_bench_io(bench_io_state* state)
+{
+  if (state->fd != -1) {
+    close(state->fd);
+  }
+}
+
+static int bench_append(struct bench_context* ctx, struct bench_result* r)
+{
+  struct nar_options opts;
+  bench_io_state state;
+  char path[PATH_MAX];
+  char name[16];
+  nar_writer nw;
+  void* opaque;
+  uint32_t i;
+  int ret = 0;
+
+  if (open_bench_io(ctx, &state, O_RDWR | O_CREAT | O_TRUNC) != 0) {
+    return -1;
+  }
+
+  memset(&opts, 0, sizeof(struct nar_options));
+  opts.compression_type = ctx->driver->type;
+  opts.compression_level = NAR_DEFAULT_LEVEL;
+
+  result_start(r);
+  /* as nar does: the items are appended with their checksum */
+  libnar_init_writer_io(&nw, &bench_io, &state);
+  libnar_set_checksum(&nw, 1);
+  ret = libnar_write_nar_header(&nw, CIPHER_NONE, ctx->driver->type);
+
+  for (i = 0; ret == 0 && i < ctx->files; i++) {
+    ret = corpus_path(path, sizeof(path), ctx->dir, ctx->corpus, i);
+    if (ret != 0) {
+      break;
+    }
+    snprintf(name, sizeof(name), "%05u", i);
+    opts.input = path;
+
+    opaque = ctx->driver->init(&opts);
+    if (opaque == NULL) {
+      ERROR("can't initialize the driver %s", ctx->driver->name);
+      ret = -1;
+      break;
+    }
+    ret = libnar_append_file(&nw,
+                             (ctx->driver->type != COMPRESSION_NONE)
+                             ? FILE_COMPRESSED : 0,
+                             name, strlen(name), NAR_UNKNOWN_LENGTH,
+                             ctx->driver->callback, opaque);
+    ctx->driver->close(opaque);
+  }
+
+  if (ret == 0) {
+    ret = libnar_write_index(&nw);
+  }
+  if (ret == 0) {
+    ret = libnar_write_nar_header(&nw, CIPHER_NONE, ctx->driver->type);
+  }
+  ctx->archive_bytes = nw.offset;
+  libnar_close_writer(&nw);
+  result_stop(r);
+
+  if (ret != 0) {
+    ERROR("append(%s) errno(%d): %s", path, -ret, strerror(-ret));
+  }
+
+  r->items = ctx->files;
+  r->bytes = ctx->bytes;
+  r->syscalls = state.syscalls;
+  close_bench_io(&state);
+  return ret;
+}
+
+/* a reader of the archive, through the read-ahead buffer as nar does */
+static int open_bench_reader(struct bench_context* ctx, nar_reader* nr,
+                             bench_io_state* state, nar_header* nh)
+{
+  if (open_bench_io(ctx, state, O_RDONLY) != 0) {
+    return -1;
+  }
+
+  libnar_init_reader_io(nr, &bench_io, state);
+  libnar_set_read_ahead(nr, READ_AHEAD_SIZE);
+  return libnar_read_nar_header(nr, nh);
+}
+
+static int bench_list(struct bench_context* ctx, struct bench_result* r)
+{
+  bench_io_state state;
+  char filename[256];
+  nar_header nh;
+  item_header ih;
+  nar_reader nr;
+  int ret;
+
+  result_start(r);
+  ret = open_bench_reader(ctx, &nr, &state, &nh);
+  if (state.io == NULL) {
+    return -1;
+  }
+
+  while (ret == 0 && libnar_read_item_header(&nr, &ih) == 0) {
+    if (!memcmp(&ih.magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
+      if (libnar_read_content1(&nr, &ih, filename, sizeof(filename)) < 0) {
+        ERROR("can't read the filename");
+        ret = -1;
+      }
+      r->items++;
+    }
+    libnar_jump_to_next_item_header(&nr, &ih);
+  }
+  libnar_close_reader(&nr);
+  result_stop(r);
+
+  if (ret == 0 && r->items != ctx->files) {
+    ERROR("%llu items listed, %u expected",
+          (unsigned long long int) r->items, ctx->files);
+    ret = -1;
+  }
+
+  r->bytes = ctx->archive_bytes;
+  r->syscalls = state.syscalls;
+  close_bench_io(&state);
+  return ret;
+}
+
+/*
+** look up each item of the archive with its INDEX, then read its content
+** (uncompressed) if extract is set
+*/
+static int bench_lookup(struct bench_context* ctx, struct bench_result* r,
+                        int extract)
+{
+  bench_io_state state;
+  char name[16];
+  nar_header nh;
+  item_header ih;
+  nar_reader nr;
+  uint8_t* buf;
+  uint32_t i;
+  int ret;
+
+  buf = malloc(BENCH_BUFFER_SIZE);
+  if (buf == NULL) {
+    ERROR("can't allocate the buffer");
+    return -1;
+  }
+
+  result_start(r);
+  ret = open_bench_reader(ctx, &nr, &state, &nh);
+  if (state.io == NULL) {
+    free(buf);
+    return -1;
+  }
+  if (ret == 0) {
+    ret = libnar_open_index(&nr, &nh);
+  }
+
+  for (i = 0; ret == 0 && i < ctx->files; i++) {
+    snprintf(name, sizeof(name), "%05u", i);
+    ret = libnar_lookup(&nr, name, strlen(name), &ih);
+    if (ret != 0) {
+      ERROR("can't find %s", name);
+      break;
+    }
+    r->items++;
+
+    while (extract
+           && (ret = libnar_read_content2_decoded(&nr, &ih, buf,
+                                                  BENCH_BUFFER_SIZE)) > 0) {
+      r->bytes += ret;
+    }
+    if (ret < 0) {
+      ERROR("extract(%s) errno(%d): %s", name, -ret, strerror(-ret));
+    }
+  }
+  libnar_close_index(&nr);
+  libnar_close_reader(&nr);
+  result_stop(r);
+
+  if (ret == 0 && extract && r->bytes != ctx->bytes) {
+    ERROR("%llu bytes extracted, %llu expected",
+          (unsigned long long int) r->bytes,
+          (unsigned long long int) ctx->bytes);
+    ret = -1;
+  }
+
+  r->syscalls = state.syscalls;
+  close_bench_io(&state);
+  free(buf);
+  return ret;
+}
+
+static int bench_driver(struct bench_context* ctx)
+{
+  struct bench_result r;
+
+  if (bench_append(ctx, &r) != 0) {
+    return -1;
+  }
+  print_result(ctx, "append", &r);
+
+  if (bench_list(ctx, &r) != 0) {
+    return -1;
+  }
+  print_result(ctx, "list", &r);
+
+  if (bench_lookup(ctx, &r, 0) != 0) {
+    return -1;
+  }
+  print_result(ctx, "lookup", &r);
+
+  if (bench_lookup(ctx, &r, 1) != 0) {
+    return -1;
+  }
+  print_result(ctx, "extract", &r);
+
+  return 0;
+}
+
+/*
+** ---- MAIN
+*/
+
+static int remove_entry(char const* path, struct stat const* st, int flag,
+                        struct FTW* ftw)
+{
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  return remove(path);
+}
+
+static void show_help_message(char const* program)
+{
+  printf("usage: %s [options]\n"
+         "\n"
+         "Options:\n"
+         "    -h                  show this help message\n"
+         "    -d <dir>            generate the corpora and the archives in <dir>\n"
+         "                        (default: a new directory in $TMPDIR, removed at\n"
+         "                        the end)\n"
+         "    -c <corpus>         only this corpus (tiny, huge, mixed, text or random)\n"
+         "    -t <driver>         only this compression driver (none, deflate, zstd\n"
+         "                        or lz4 when built in)\n"
+         "    -s <percent>        the scale of the corpora (default: 100)\n"
+         "    -m                  keep the archive in memory (libnar_memory_io)\n",
+         program);
+}
+
+int main(int argc, char * const* argv)
+{
+  struct bench_corpus const* bc;
+  struct bench_context ctx;
+  char const* corpus = NULL;
+  char const* driver = NULL;
+  char const* tmpdir;
+  char dir[PATH_MAX];
+  char archive[PATH_MAX];
+  int temporary = 1;
+  int ret = 0;
+  int c;
+  int i;
+
+  memset(&ctx, 0, sizeof(struct bench_context));
+  ctx.scale = 100;
+
+  while ((c = getopt(argc, argv, "hd:c:t:s:m")) != -1) {
+    switch (c) {
+    case 'd':
+      snprintf(dir, sizeof(dir), "%s", optarg);
+      temporary = 0;
+      break;
+    case 'c':
+      corpus = optarg;
+      break;
+    case 't':
+      driver = optarg;
+      break;
+    case 's':
+      ctx.scale = atoi(optarg);
+      if (ctx.scale <= 0) {
+        ERROR("invalid scale: %s", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      ctx.memory = 1;
+      break;
+    case 'h':
+      show_help_message(argv[0]);
+      return 0;
+    default:
+      show_help_message(argv[0]);
+      return 1;
+    }
+  }
+
+  if (temporary) {
+    tmpdir = getenv("TMPDIR");
+    snprintf(dir, sizeof(dir), "%s/nar-bench.XXXXXX",
+             (tmpdir != NULL) ? tmpdir : "/tmp");
+    if (mkdtemp(dir) == NULL) {
+      ERROR("mkdtemp(%s) errno(%d): %s", dir, errno, strerror(errno));
+      return 1;
+    }
+  } else if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    ERROR("mkdir(%s) errno(%d): %s", dir, errno, strerror(errno));
+    return 1;
+  }
+  if (snprintf(archive, sizeof(archive), "%s/bench.nar", dir)
+      >= (int) sizeof(archive)) {
+    ERROR("the path of %s is too long", dir);
+    return 1;
+  }
+  ctx.dir = dir;
+  ctx.archive = archive;
+
+  printf("corpus\tdriver\toperation\titems\tbytes\tarchive_bytes\tseconds"
+         "\tMB/s\titems/s\tsyscalls/item\n");
+
+  for (bc = bench_corpora; ret == 0 && bc->name != NULL; bc++) {
+    if (corpus != NULL && strcmp(corpus, bc->name)) {
+      continue;
+    }
+    ctx.corpus = bc;
+    ctx.files = corpus_files(bc, ctx.scale);
+    if (generate_corpus(dir, bc, ctx.scale, &ctx.bytes) != 0) {
+      ret = -1;
+      break;
+    }
+
+    for (i = 0; ret == 0 && bench_drivers[i].name != NULL; i++) {
+      if (driver != NULL && strcmp(driver, bench_drivers[i].name)) {
+        continue;
+      }
+      ctx.driver = &bench_drivers[i];
+      ret = bench_driver(&ctx);
+    }
+  }
+
+  if (ctx.memory) {
+    libnar_close_memory(&ctx.archive_memory);
+  }
+  unlink(archive);
+  if (temporary) {
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  return (ret == 0) ? 0 : 1;
+}
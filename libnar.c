@@ -31,13 +31,46 @@
 
 /* In order to use lseek64 (see man 3 lseek64) */
 #define _LARGEFILE64_SOURCE
+/* In order to use copy_file_range and splice (see man 2 copy_file_range) */
+#define _GNU_SOURCE
 #include "libnar.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+# if defined(__NR_io_uring_setup)
+#  define HAVE_IO_URING
+# endif
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+# include <immintrin.h>
+# include <cpuid.h>
+#endif
+#if defined(HAVE_ZSTD)
+# include <zstd.h>
+#endif
+#if defined(HAVE_LZ4)
+# include <lz4frame.h>
+#endif
+#if defined(HAVE_OPENSSL)
+# include <openssl/crypto.h>
+# include <openssl/evp.h>
+# include <openssl/hmac.h>
+# include <openssl/rand.h>
+#endif
 
 # if defined(DEBUG)
 #  include <stdio.h>
@@ -84,372 +117,5776 @@
 # endif
 #endif
 
-int libnar_init_writer(nar_writer* nar, int fd)
-{
-  if (nar == NULL) {
-    DPRINTF("nar_write* nar == NULL");
-    return -1;
-  }
+/*
+** ------------- I/O ---------------------------------------------------------
+*/
 
-  memset(nar, 0, sizeof(nar_writer));
+# define IO_FD(opaque) ((int)(intptr_t)(opaque))
 
-  nar->fd = fd;
+static int64_t fd_read(void* opaque, void* buf, uint64_t const size)
+{
+  ssize_t ret = read(IO_FD(opaque), buf, size);
 
-  return 0;
+  return (ret == -1) ? -errno : ret;
 }
 
-void libnar_close_writer(nar_writer* nar)
+static int64_t fd_pread(void* opaque, void* buf, uint64_t const size,
+                        uint64_t const offset)
 {
-  if (nar != NULL) {
-    memset(nar, 0, sizeof(nar_writer));
-  }
+  ssize_t ret = pread(IO_FD(opaque), buf, size, offset);
+
+  return (ret == -1) ? -errno : ret;
 }
 
-static int write_buffer(int fd, uint8_t const* buf, uint64_t const size)
+static int64_t fd_write(void* opaque, void const* buf, uint64_t const size)
 {
-  uint64_t offset;
-  int ret;
-
-  for (offset = 0; offset < size; offset += ret) {
-    ret = write(fd, &buf[offset], size - offset);
-    if (ret == -1) {
-      DPRINTF("write errno(%d): %s", errno, strerror(errno));
-      return -1;
-    }
-  }
+  ssize_t ret = write(IO_FD(opaque), buf, size);
 
-  return offset;
+  return (ret == -1) ? -errno : ret;
 }
 
-int libnar_write_nar_header(nar_writer* nar,
-                            uint64_t const cipher_type,
-                            uint64_t const compression_type)
+static int64_t fd_pwrite(void* opaque, void const* buf, uint64_t const size,
+                         uint64_t const offset)
 {
-  nar_header nh;
-  uint8_t* buf;
-  uint32_t length;
-  int ret;
+  ssize_t ret = pwrite(IO_FD(opaque), buf, size, offset);
 
-  if (nar == NULL) {
-    DPRINTF("nar_write* nar == NULL");
-    return -1;
-  }
+  return (ret == -1) ? -errno : ret;
+}
 
-  length = sizeof(nar_header);
+static int64_t fd_seek(void* opaque, int64_t const offset, int const whence)
+{
+  off64_t ret = lseek64(IO_FD(opaque), offset, whence);
 
-  memset(&nh, 0, length);
-  memcpy(&(nh.magic), NAR_HEADER_MAGIC, sizeof(uint64_t));
-  nh.version.major = NAR_HEADER_VERSION_MAJOR;
-  nh.version.minor = NAR_HEADER_VERSION_MINOR;
-  nh.cipher_type = cipher_type;
-  nh.compression_type = compression_type;
-  nh.signature_position = nar->signature_position;
-  nh.index_position = nar->index_position;
+  return (ret == -1) ? -errno : ret;
+}
 
-  if (-1 == lseek64(nar->fd, 0, SEEK_SET)) {
-    switch (errno) {
-    case ESPIPE:
-      /* The user is probably using a pipe or a socked or a FIFO,
-      ** then do not consider it as an error */
-      break;
-    default:
-      DPRINTF("lseek/ error: %s", strerror(errno));
-      return -errno;
-      break;
-    }
-  }
+static int64_t fd_size(void* opaque)
+{
+  struct stat st;
 
-  buf = (uint8_t*)&nh;
-  ret = write_buffer(nar->fd, buf, length);
-  if (ret == -1) {
-    DPRINTF("write errno(%d): %s", errno, strerror(errno));
+  if (-1 == fstat(IO_FD(opaque), &st)) {
     return -errno;
   }
 
-  return 0;
+  return st.st_size;
 }
 
-static int write_missing_0(int fd, uint64_t size)
+static int fd_truncate(void* opaque, uint64_t const length)
 {
-  uint8_t tmp[64];
-
-  memset(tmp, 0, sizeof(tmp));
-
-  return write_buffer(fd, tmp, size % sizeof(uint64_t));
+  return (-1 == ftruncate(IO_FD(opaque), length)) ? -errno : 0;
 }
 
+nar_io const libnar_fd_io = {
+  fd_read, fd_pread, fd_write, fd_pwrite, fd_seek, fd_size, fd_truncate
+};
 
-int libnar_append_file(nar_writer* nar, uint64_t const flags,
-                       char const* filepath, uint64_t const length_filepath,
-                       uint64_t const length_content,
-                       get_computed_content callback, void* opaque)
+int libnar_init_memory(nar_memory* memory, void const* data,
+                       uint64_t const length)
 {
-  item_header pfh;
-  uint8_t* buf;
-  uint32_t length;
-  uint32_t offset;
-  int ret;
-
-  if (nar == NULL || filepath == NULL) {
-    DPRINTF("nar(%p) filepath(%p)", nar, filepath);
+  if (memory == NULL || (data == NULL && length != 0)) {
+    DPRINTF("nar_memory(%p) data(%p)", memory, data);
     return -1;
   }
 
-  if (-1 == lseek64(nar->fd, 0, SEEK_END)) {
-    switch (errno) {
-    case ESPIPE:
-      /* The user is probably using a pipe or a socked or a FIFO,
-      ** then do not consider it as an error */
-      break;
-    default:
-      DPRINTF("lseek error: %s", strerror(errno));
-      return -errno;
-      break;
-    }
-  }
-
-  length = sizeof(item_header);
-  memset(&pfh, 0, length);
-  memcpy(&pfh.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
-  pfh.flags = flags;
-  pfh.length1 = length_filepath;
-  pfh.length2 = length_content;
-
-  buf = (uint8_t*)&pfh;
-  ret = write_buffer(nar->fd, buf, length);
-  if (ret == -1) {
-    DPRINTF("write errno(%d): %s", errno, strerror(errno));
-    return -errno;
-  }
+  memset(memory, 0, sizeof(nar_memory));
+  memory->data = (uint8_t*)data;
+  memory->length = length;
 
-  buf = (uint8_t*)filepath;
-  length = length_filepath;
-  ret = write_buffer(nar->fd, buf, length);
-  if (ret == -1) {
-    DPRINTF("write errno(%d): %s", errno, strerror(errno));
-    return -errno;
-  }
+  return 0;
+}
 
-  if (length % sizeof(uint64_t)) {
-    ret = write_missing_0(nar->fd, sizeof(uint64_t) - (length % sizeof(uint64_t)));
-    if (ret == -1) {
-      DPRINTF("write errno(%d): %s", errno, strerror(errno));
-      return -errno;
+void libnar_close_memory(nar_memory* memory)
+{
+  if (memory != NULL) {
+    if (memory->capacity) {
+      free(memory->data);
     }
+    memset(memory, 0, sizeof(nar_memory));
   }
+}
 
-  for (offset = 0;
-       offset != length_content;
-       offset += ret) {
-    uint8_t tmp[256];
-
-    ret = callback(opaque, tmp, sizeof(tmp));
-    if (ret == -1) {
-      DPRINTF("callback errno(%d): %s", errno, strerror(errno));
-      return -errno;
-    }
-    if (ret == 0) {
-      break;
-    }
+/*
+** make the buffer writable and large enough for length bytes, the bytes
+** after the end are zeros
+*/
+static int memory_reserve(nar_memory* memory, uint64_t const length)
+{
+  uint64_t capacity = (memory->capacity) ? memory->capacity : 4096;
+  uint8_t* data;
 
-    length = ret;
-    ret = write_buffer(nar->fd, tmp, length);
-    if (ret == -1) {
-      DPRINTF("write errno(%d): %s", errno, strerror(errno));
-      return -errno;
-    }
+  if (memory->capacity == 0 && memory->data != NULL) {
+    DPRINTF("the memory backend is read only");
+    return -EBADF;
   }
 
-  if (offset % sizeof(uint64_t)) {
-    ret = write_missing_0(nar->fd, sizeof(uint64_t) - (offset % sizeof(uint64_t)));
-    if (ret < 0) {
-      DPRINTF("write errno(%d): %s", errno, strerror(errno));
-      return ret;
+  if (length > memory->capacity) {
+    while (capacity < length) {
+      capacity *= 2;
     }
+    data = realloc(memory->data, capacity);
+    if (data == NULL) {
+      return -ENOMEM;
+    }
+    memset(&data[memory->capacity], 0, capacity - memory->capacity);
+    memory->data = data;
+    memory->capacity = capacity;
   }
 
   return 0;
 }
 
-int libnar_init_reader(nar_reader* nar, int fd)
+static int64_t memory_pread(void* opaque, void* buf, uint64_t const size,
+                            uint64_t const offset)
 {
-  if (nar == NULL) {
-    DPRINTF("nar(%p)", nar);
-    return -1;
-  }
+  nar_memory* memory = opaque;
+  uint64_t length;
 
-  memset(nar, 0, sizeof(nar_reader));
-  nar->fd = fd;
+  if (offset >= memory->length) {
+    return 0;
+  }
+  length = memory->length - offset;
+  length = (size > length) ? length : size;
+  memcpy(buf, &memory->data[offset], length);
 
-  return 0;
+  return length;
 }
 
-void libnar_close_reader(nar_reader* nar)
+static int64_t memory_read(void* opaque, void* buf, uint64_t const size)
 {
-  if (nar != NULL) {
-    memset(nar, 0, sizeof(nar_reader));
-  }
+  nar_memory* memory = opaque;
+  int64_t ret = memory_pread(opaque, buf, size, memory->position);
+
+  memory->position += ret;
+  return ret;
 }
 
-int libnar_read_nar_header(nar_reader* nar, nar_header* nh)
+static int64_t memory_pwrite(void* opaque, void const* buf, uint64_t const size,
+                             uint64_t const offset)
 {
-  uint8_t buf[64];
+  nar_memory* memory = opaque;
   int ret;
-  int i, l;
 
-  if (nar == NULL || nh == NULL || nar->fd == -1) {
-    DPRINTF("nar_reader(%p) nar_header(%p) fd(%d)",
-            nar, nh, (nar) ? nar->fd : -1);
-    return -1;
+  ret = memory_reserve(memory, offset + size);
+  if (ret != 0) {
+    return ret;
+  }
+  memcpy(&memory->data[offset], buf, size);
+  if (offset + size > memory->length) {
+    memory->length = offset + size;
   }
 
-  if (-1 == lseek64(nar->fd, 0, SEEK_SET)) {
-    switch (errno) {
-    case ESPIPE:
-      /* The user is probably using a pipe or a socked or a FIFO,
-      ** then do not consider it as an error */
-      break;
-    default:
-      DPRINTF("lseek errno(%d): %s", errno, strerror(errno));
-      return -errno;
-      break;
-    }
+  return size;
+}
+
+static int64_t memory_write(void* opaque, void const* buf, uint64_t const size)
+{
+  nar_memory* memory = opaque;
+  int64_t ret = memory_pwrite(opaque, buf, size, memory->position);
+
+  if (ret > 0) {
+    memory->position += ret;
   }
+  return ret;
+}
 
-  l = sizeof(buf);
-  for (i = 0; i < l; i+=ret) {
-    ret = read(nar->fd, &buf[i], l - i);
-    if (ret == -1) {
-      DPRINTF("read errno(%d): %s", errno, strerror(errno));
-      return -errno;
-    }
+static int64_t memory_seek(void* opaque, int64_t const offset, int const whence)
+{
+  nar_memory* memory = opaque;
+  int64_t position;
+
+  switch (whence) {
+  case SEEK_SET: position = offset; break;
+  case SEEK_CUR: position = memory->position + offset; break;
+  case SEEK_END: position = memory->length + offset; break;
+  default: return -EINVAL;
+  }
+  if (position < 0) {
+    return -EINVAL;
   }
+  memory->position = position;
 
-  memcpy(nh, buf, sizeof(nar_header));
-  nar->item_offset = 0;
-  nar->item_offset_content1 = 0;
-  nar->item_offset_content2 = 0;
+  return position;
+}
 
-  return 0;
+static int64_t memory_size(void* opaque)
+{
+  return ((nar_memory*)opaque)->length;
 }
 
-int libnar_read_item_header(nar_reader* nar, item_header* ih)
+static int memory_truncate(void* opaque, uint64_t const length)
 {
-  uint8_t buf[sizeof(item_header)];
+  nar_memory* memory = opaque;
   int ret;
-  int i, l;
 
-  if (nar == NULL || ih == NULL || nar->fd == -1) {
-    DPRINTF("nar_reader(%p) item_header(%p) fd(%d)",
-            nar, ih, (nar) ? nar->fd : -1);
-    return -1;
+  ret = memory_reserve(memory, length);
+  if (ret != 0) {
+    return ret;
   }
+  if (length < memory->length) {
+    memset(&memory->data[length], 0, memory->length - length);
+  }
+  memory->length = length;
 
-  nar->item_offset = 0;
-  nar->item_offset_content1 = 0;
-  nar->item_offset_content2 = 0;
+  return 0;
+}
 
-  l = sizeof(buf);
-  for (i = 0; i < l; i+=ret) {
-    ret = read(nar->fd, &buf[i], l - i);
-    if (ret == -1) {
-      DPRINTF("read errno(%d): %s", errno, strerror(errno));
-      return -errno;
-    }
+nar_io const libnar_memory_io = {
+  memory_read, memory_pread, memory_write, memory_pwrite,
+  memory_seek, memory_size, memory_truncate
+};
 
-    nar->item_offset += ret;
-    if (ret == 0) {
-      return -1;
-    }
-  }
+/*
+** the io_uring backend: the archive is read and written in blocks of
+** registered buffers. The sequential reads prefetch the next blocks, the
+** writes are queued and only waited for when the ring is full or when an
+** operation needs what has been written (pread, pwrite, size, truncate and
+** libnar_close_uring). Without io_uring the backend uses pread and pwrite.
+*/
+enum {
+  SLOT_FREE = 0,
+  SLOT_FILLING,  /* a write which is not queued yet */
+  SLOT_WRITING,
+  SLOT_READING,
+  SLOT_READY
+};
 
-  memcpy(ih, buf, sizeof(item_header));
+typedef struct {
+  uint8_t* buf;
+  uint64_t offset;
+  /* the bytes to read or to write, and the ones already done */
+  uint32_t length;
+  uint32_t done;
+  int state;
+  int res;
+  struct iovec iov;
+} uring_slot;
 
-  return 0;
-}
+typedef struct {
+  int fd;
+  /* -1 without io_uring */
+  int ring_fd;
+  int fixed;
 
-int libnar_read_content1(nar_reader* nar, item_header const* ih,
-                         char* buf, uint32_t const max)
+  uint64_t position;
+  uint64_t size;
+  /* the offset of the next block to prefetch */
+  uint64_t prefetch;
+  /* the first error of a queued write */
+  int error;
+
+  uint32_t depth;
+  uint32_t block_size;
+  uint8_t* buffers;
+  uring_slot* slots;
+  int filling;
+
+  uint32_t inflight;
+  uint32_t to_submit;
+#if defined(HAVE_IO_URING)
+  void* sq_map;
+  size_t sq_map_size;
+  void* cq_map;
+  size_t cq_map_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  struct io_uring_cqe* cqes;
+#endif
+} nar_uring;
+
+#if defined(HAVE_IO_URING)
+static int uring_setup(nar_uring* u)
 {
-  int ret = 0;
-  uint64_t i;
-  uint64_t length;
+  struct io_uring_params p;
+  struct iovec* iov;
+  uint8_t* sq;
+  uint8_t* cq;
+  uint32_t i;
+  int ret;
 
-  if (nar == NULL || ih == NULL || nar->fd == -1 || buf == NULL) {
-    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
-            nar, ih, (nar) ? nar->fd : -1, buf);
-    return -1;
+  memset(&p, 0, sizeof(struct io_uring_params));
+  u->ring_fd = syscall(__NR_io_uring_setup, u->depth, &p);
+  if (u->ring_fd == -1) {
+    DPRINTF("io_uring_setup errno(%d): %s", errno, strerror(errno));
+    return -errno;
   }
 
-  if (!ih->length1) {
-    return 0;
-  }
+  u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
 
-  length = ih->length1 - nar->item_offset_content1;
+  u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+  u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+  if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED
+      || u->sqes == MAP_FAILED) {
+    DPRINTF("mmap errno(%d): %s", errno, strerror(errno));
+    return -errno;
+  }
 
-  length = (max > length) ? length : max;
-  for (i = 0; i < length; i+=ret) {
-    ret = read(nar->fd, &buf[i], length - i);
-    if (ret == -1) {
-      DPRINTF("read errno(%d): %s", errno, strerror(errno));
-      return -errno;
-    }
+  sq = u->sq_map;
+  cq = u->cq_map;
+  u->sq_tail = (uint32_t*)&sq[p.sq_off.tail];
+  u->sq_mask = (uint32_t*)&sq[p.sq_off.ring_mask];
+  u->sq_array = (uint32_t*)&sq[p.sq_off.array];
+  u->cq_head = (uint32_t*)&cq[p.cq_off.head];
+  u->cq_tail = (uint32_t*)&cq[p.cq_off.tail];
+  u->cq_mask = (uint32_t*)&cq[p.cq_off.ring_mask];
+  u->cqes = (struct io_uring_cqe*)&cq[p.cq_off.cqes];
 
-    nar->item_offset += ret;
-    nar->item_offset_content1 += ret;
-    if (ret == 0) {
-      break;
-    }
+  /* the fixed buffers are pinned: without enough locked memory
+  ** (RLIMIT_MEMLOCK), the vectored operations are used */
+  iov = malloc(u->depth * sizeof(struct iovec));
+  if (iov == NULL) {
+    return -ENOMEM;
   }
+  for (i = 0; i < u->depth; i++) {
+    iov[i].iov_base = u->slots[i].buf;
+    iov[i].iov_len = u->block_size;
+  }
+  ret = syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS,
+                iov, u->depth);
+  u->fixed = (ret == 0);
+  if (ret != 0) {
+    DPRINTF("io_uring_register errno(%d): %s", errno, strerror(errno));
+  }
+  free(iov);
 
-  return i;
+  return 0;
 }
 
-int libnar_read_content2(nar_reader* nar, item_header const* ih,
-                         char* buf, uint32_t const max)
+static void uring_teardown(nar_uring* u)
 {
-  int ret = 0;
-  uint64_t i;
-  uint64_t length;
-
-  if (nar == NULL || ih == NULL || nar->fd == -1 || buf == NULL) {
-    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
-            nar, ih, (nar) ? nar->fd : -1, buf);
-    return -1;
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_size);
   }
-
-  if (ROUNDUP64(ih->length1) > nar->item_offset_content1) {
-    lseek64(nar->fd,
-            ROUNDUP64(ih->length1) - nar->item_offset_content1,
-            SEEK_CUR);
-    nar->item_offset_content1 = ROUNDUP64(ih->length1);
+  if (u->cq_map != NULL && u->cq_map != MAP_FAILED) {
+    munmap(u->cq_map, u->cq_map_size);
   }
+  if (u->sq_map != NULL && u->sq_map != MAP_FAILED) {
+    munmap(u->sq_map, u->sq_map_size);
+  }
+  if (u->ring_fd != -1) {
+    close(u->ring_fd);
+  }
+  u->sqes = u->cq_map = u->sq_map = NULL;
+  u->ring_fd = -1;
+}
 
-  length = ih->length2 - nar->item_offset_content2;
+/*
+** queue the read or the write of what is left of the slot
+*/
+static void uring_queue(nar_uring* u, uint32_t const i)
+{
+  uring_slot* s = &u->slots[i];
+  int const write = (s->state == SLOT_WRITING);
+  uint32_t tail = *u->sq_tail;
+  uint32_t index = tail & *u->sq_mask;
+  struct io_uring_sqe* sqe = &u->sqes[index];
 
-  length = (max > length) ? length : max;
-  for (i = 0; i < length; i+=ret) {
-    ret = read(nar->fd, &buf[i], length - i);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = u->fd;
+  sqe->off = s->offset + s->done;
+  sqe->user_data = i;
+  if (u->fixed) {
+    sqe->opcode = (write) ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->addr = (uintptr_t)&s->buf[s->done];
+    sqe->len = s->length - s->done;
+    sqe->buf_index = i;
+  } else {
+    s->iov.iov_base = &s->buf[s->done];
+    s->iov.iov_len = s->length - s->done;
+    sqe->opcode = (write) ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uintptr_t)&s->iov;
+    sqe->len = 1;
+  }
+
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+  u->inflight++;
+}
+
+/*
+** submit what is queued and handle the completions, waiting for one at
+** least if wait is set
+*/
+static int uring_enter(nar_uring* u, int const wait)
+{
+  uint32_t head, tail;
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, u->ring_fd, u->to_submit,
+                  (wait) ? 1 : 0, (wait) ? IORING_ENTER_GETEVENTS : 0,
+                  NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) {
+    DPRINTF("io_uring_enter errno(%d): %s", errno, strerror(errno));
+    return -errno;
+  }
+  u->to_submit -= ret;
+
+  head = *u->cq_head;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+    uring_slot* s = &u->slots[cqe->user_data];
+
+    u->inflight--;
+    if (s->state == SLOT_READING) {
+      /* a short read is handled by uring_read */
+      s->res = (cqe->res < 0) ? cqe->res : 0;
+      s->done += (cqe->res > 0) ? cqe->res : 0;
+      s->state = SLOT_READY;
+    } else if (cqe->res <= 0) {
+      if (u->error == 0) {
+        u->error = (cqe->res < 0) ? cqe->res : -EIO;
+      }
+      s->state = SLOT_FREE;
+    } else {
+      s->done += cqe->res;
+      if (s->done < s->length) {
+        uring_queue(u, cqe->user_data);
+      } else {
+        s->state = SLOT_FREE;
+      }
+    }
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+#else
+static int uring_setup(nar_uring* u)
+{
+  (void) u;
+  return -ENOSYS;
+}
+
+static void uring_teardown(nar_uring* u)
+{
+  u->ring_fd = -1;
+}
+
+static void uring_queue(nar_uring* u, uint32_t const i)
+{
+  (void) u;
+  (void) i;
+}
+
+static int uring_enter(nar_uring* u, int const wait)
+{
+  (void) u;
+  (void) wait;
+  return -ENOSYS;
+}
+#endif
+
+/*
+** queue the write of the slot being filled
+*/
+static void uring_submit_filling(nar_uring* u)
+{
+  if (u->filling != -1) {
+    u->slots[u->filling].state = SLOT_WRITING;
+    uring_queue(u, u->filling);
+    u->filling = -1;
+  }
+}
+
+/*
+** wait for all the queued operations. Returns the first error of the writes.
+*/
+static int uring_flush(nar_uring* u)
+{
+  int ret;
+
+  if (u->ring_fd == -1) {
+    return 0;
+  }
+
+  uring_submit_filling(u);
+  while (u->inflight != 0) {
+    ret = uring_enter(u, 1);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  return u->error;
+}
+
+/*
+** forget the prefetched blocks (before a write)
+*/
+static int uring_drop_reads(nar_uring* u)
+{
+  uint32_t i;
+  int ret;
+
+  for (i = 0; i < u->depth; i++) {
+    while (u->slots[i].state == SLOT_READING) {
+      ret = uring_enter(u, 1);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    if (u->slots[i].state == SLOT_READY) {
+      u->slots[i].state = SLOT_FREE;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** queue the reads of the next blocks in the free slots
+*/
+static int uring_prefetch(nar_uring* u)
+{
+  uint32_t i;
+
+  for (i = 0; i < u->depth && u->prefetch < u->size; i++) {
+    uring_slot* s = &u->slots[i];
+
+    if (s->state == SLOT_FREE) {
+      s->offset = u->prefetch;
+      s->length = (u->size - u->prefetch > u->block_size)
+                ? u->block_size : u->size - u->prefetch;
+      s->done = 0;
+      s->state = SLOT_READING;
+      uring_queue(u, i);
+      u->prefetch += s->length;
+    }
+  }
+
+  return (u->to_submit) ? uring_enter(u, 0) : 0;
+}
+
+/*
+** the slot of the prefetched block holding position, -1 if none
+*/
+static int uring_find(nar_uring* u, uint64_t const position)
+{
+  uint32_t i;
+
+  for (i = 0; i < u->depth; i++) {
+    uring_slot* s = &u->slots[i];
+
+    if ((s->state == SLOT_READING || s->state == SLOT_READY)
+        && position >= s->offset && position < s->offset + s->length) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int64_t uring_read(void* opaque, void* buf, uint64_t const size)
+{
+  nar_uring* u = opaque;
+  uint8_t* out = buf;
+  uint64_t copied = 0;
+  ssize_t ret;
+  int i;
+
+  if (u->ring_fd == -1) {
+    ret = pread(u->fd, buf, size, u->position);
+    if (ret == -1) {
+      return -errno;
+    }
+    u->position += ret;
+    return ret;
+  }
+
+  ret = uring_flush(u);
+  if (ret != 0) {
+    return ret;
+  }
+
+  while (copied < size) {
+    uring_slot* s;
+    uint64_t n;
+
+    i = uring_find(u, u->position);
+    if (i == -1) {
+      if (u->position >= u->size) {
+        break;
+      }
+      /* not prefetched: restart the prefetch from here */
+      ret = uring_drop_reads(u);
+      if (ret == 0) {
+        u->prefetch = u->position;
+        ret = uring_prefetch(u);
+      }
+      if (ret != 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    s = &u->slots[i];
+    while (s->state == SLOT_READING) {
+      ret = uring_enter(u, 1);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    if (s->res < 0) {
+      s->state = SLOT_FREE;
+      return (copied) ? (int64_t)copied : s->res;
+    }
+
+    if (u->position >= s->offset + s->done) {
+      /* a short read: the end of the file or read the rest again */
+      if (s->done == 0) {
+        s->state = SLOT_FREE;
+        u->size = s->offset;
+        break;
+      }
+      s->length -= s->done;
+      s->offset += s->done;
+      s->done = 0;
+      s->state = SLOT_READING;
+      uring_queue(u, i);
+      continue;
+    }
+
+    n = s->offset + s->done - u->position;
+    n = (n > size - copied) ? size - copied : n;
+    memcpy(&out[copied], &s->buf[u->position - s->offset], n);
+    copied += n;
+    u->position += n;
+
+    if (u->position == s->offset + s->length) {
+      /* the block is consumed: prefetch the next one */
+      s->state = SLOT_FREE;
+      ret = uring_prefetch(u);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+  }
+
+  return copied;
+}
+
+static int64_t uring_pread(void* opaque, void* buf, uint64_t const size,
+                           uint64_t const offset)
+{
+  nar_uring* u = opaque;
+  ssize_t ret;
+  int i;
+
+  ret = uring_flush(u);
+  if (ret != 0) {
+    return ret;
+  }
+
+  /* from a prefetched block if it holds the whole range */
+  i = uring_find(u, offset);
+  if (i != -1 && u->slots[i].state == SLOT_READY && u->slots[i].res == 0
+      && offset + size <= u->slots[i].offset + u->slots[i].done) {
+    memcpy(buf, &u->slots[i].buf[offset - u->slots[i].offset], size);
+    return size;
+  }
+
+  ret = pread(u->fd, buf, size, offset);
+
+  return (ret == -1) ? -errno : ret;
+}
+
+static int64_t uring_write(void* opaque, void const* buf, uint64_t const size)
+{
+  nar_uring* u = opaque;
+  uint8_t const* in = buf;
+  uint64_t written = 0;
+  ssize_t ret;
+  uint32_t i;
+
+  if (u->ring_fd == -1) {
+    ret = pwrite(u->fd, buf, size, u->position);
     if (ret == -1) {
-      DPRINTF("read errno(%d): %s", errno, strerror(errno));
       return -errno;
     }
+    u->position += ret;
+    u->size = (u->position > u->size) ? u->position : u->size;
+    return ret;
+  }
+
+  if (u->error != 0) {
+    return u->error;
+  }
+  ret = uring_drop_reads(u);
+  if (ret != 0) {
+    return ret;
+  }
+
+  while (written < size) {
+    uring_slot* s;
+    uint64_t n;
+
+    if (u->filling != -1) {
+      s = &u->slots[u->filling];
+      if (s->offset + s->length != u->position) {
+        /* not contiguous */
+        uring_submit_filling(u);
+      }
+    }
+
+    while (u->filling == -1) {
+      for (i = 0; i < u->depth; i++) {
+        if (u->slots[i].state == SLOT_FREE) {
+          s = &u->slots[i];
+          s->offset = u->position;
+          s->length = s->done = 0;
+          s->state = SLOT_FILLING;
+          u->filling = i;
+          break;
+        }
+      }
+      if (u->filling != -1) {
+        break;
+      }
+      /* all the buffers are being written */
+      ret = uring_enter(u, 1);
+      if (ret == 0) {
+        ret = u->error;
+      }
+      if (ret != 0) {
+        return ret;
+      }
+    }
+
+    s = &u->slots[u->filling];
+    n = u->block_size - s->length;
+    n = (n > size - written) ? size - written : n;
+    memcpy(&s->buf[s->length], &in[written], n);
+    s->length += n;
+    written += n;
+    u->position += n;
+
+    if (s->length == u->block_size) {
+      uring_submit_filling(u);
+    }
+  }
+
+  u->size = (u->position > u->size) ? u->position : u->size;
+  if (u->to_submit) {
+    ret = uring_enter(u, 0);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  return written;
+}
+
+static int64_t uring_pwrite(void* opaque, void const* buf, uint64_t const size,
+                            uint64_t const offset)
+{
+  nar_uring* u = opaque;
+  ssize_t ret;
+
+  /* the range may be in a queued write */
+  ret = uring_flush(u);
+  if (ret == 0) {
+    ret = uring_drop_reads(u);
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = pwrite(u->fd, buf, size, offset);
+  if (ret == -1) {
+    return -errno;
+  }
+  if (offset + ret > u->size) {
+    u->size = offset + ret;
+  }
+
+  return ret;
+}
+
+static int64_t uring_size(void* opaque)
+{
+  nar_uring* u = opaque;
+  struct stat st;
+  int ret;
+
+  ret = uring_flush(u);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (-1 == fstat(u->fd, &st)) {
+    return -errno;
+  }
+  u->size = st.st_size;
+
+  return u->size;
+}
+
+static int64_t uring_seek(void* opaque, int64_t const offset, int const whence)
+{
+  nar_uring* u = opaque;
+  int64_t position;
+
+  switch (whence) {
+  case SEEK_SET: position = offset; break;
+  case SEEK_CUR: position = u->position + offset; break;
+  case SEEK_END:
+    position = uring_size(opaque);
+    if (position < 0) {
+      return position;
+    }
+    position += offset;
+    break;
+  default: return -EINVAL;
+  }
+  if (position < 0) {
+    return -EINVAL;
+  }
+  u->position = position;
+
+  return position;
+}
+
+static int uring_truncate(void* opaque, uint64_t const length)
+{
+  nar_uring* u = opaque;
+  int ret;
+
+  ret = uring_flush(u);
+  if (ret == 0) {
+    ret = uring_drop_reads(u);
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (-1 == ftruncate(u->fd, length)) {
+    return -errno;
+  }
+  u->size = length;
+
+  return 0;
+}
+
+nar_io const libnar_uring_io = {
+  uring_read, uring_pread, uring_write, uring_pwrite,
+  uring_seek, uring_size, uring_truncate
+};
+
+void* libnar_open_uring(int fd, uint32_t depth, uint32_t block_size)
+{
+  nar_uring* u;
+  struct stat st;
+  uint32_t i;
+
+  if (fd == -1 || -1 == fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    DPRINTF("fd(%d) is not a regular file", fd);
+    return NULL;
+  }
+
+  depth = (depth) ? depth : LIBNAR_URING_DEPTH;
+  block_size = (block_size) ? block_size : LIBNAR_URING_BLOCK_SIZE;
+
+  u = calloc(1, sizeof(nar_uring));
+  if (u == NULL) {
+    return NULL;
+  }
+  u->fd = fd;
+  u->ring_fd = -1;
+  u->filling = -1;
+  u->size = st.st_size;
+  u->depth = depth;
+  u->block_size = block_size;
+
+  u->slots = calloc(depth, sizeof(uring_slot));
+  if (u->slots == NULL
+      || posix_memalign((void**)&u->buffers, 4096,
+                        (size_t)depth * block_size) != 0) {
+    DPRINTF("can't allocate %u buffers of %u bytes", depth, block_size);
+    free(u->slots);
+    free(u);
+    return NULL;
+  }
+  for (i = 0; i < depth; i++) {
+    u->slots[i].buf = &u->buffers[(size_t)i * block_size];
+  }
+
+  if (uring_setup(u) != 0) {
+    /* the synchronous fallback */
+    uring_teardown(u);
+  }
+
+  return u;
+}
+
+int libnar_close_uring(void* uring)
+{
+  nar_uring* u = uring;
+  int ret;
+
+  if (u == NULL) {
+    return 0;
+  }
+
+  ret = uring_flush(u);
+  if (ret == 0) {
+    ret = uring_drop_reads(u);
+  }
+  uring_teardown(u);
+  free(u->buffers);
+  free(u->slots);
+  free(u);
+
+  return ret;
+}
+
+int libnar_uring_is_async(void const* uring)
+{
+  return uring != NULL && ((nar_uring const*)uring)->ring_fd != -1;
+}
+
+/*
+** ------------- STATS -------------------------------------------------------
+*/
+
+static uint64_t stats_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* count a read call of ret bytes (stats may be NULL) */
+static void stats_read(nar_stats* stats, int64_t const ret)
+{
+  if (stats != NULL) {
+    stats->syscalls++;
+    stats->bytes_read += (ret > 0) ? ret : 0;
+  }
+}
+
+/* count a write call of ret bytes (stats may be NULL) */
+static void stats_write(nar_stats* stats, int64_t const ret)
+{
+  if (stats != NULL) {
+    stats->syscalls++;
+    stats->bytes_written += (ret > 0) ? ret : 0;
+  }
+}
+
+static void stats_seek(nar_stats* stats)
+{
+  if (stats != NULL) {
+    stats->syscalls++;
+    stats->seeks++;
+  }
+}
+
+/*
+** the counters of the calls on a nar_archive and of the libnar_pextract_*
+** calls: they share no state, each thread counts its own reads
+*/
+static __thread nar_stats thread_stats;
+
+static void stats_add(nar_stats* stats, nar_stats const* from)
+{
+  stats->bytes_read += from->bytes_read;
+  stats->bytes_written += from->bytes_written;
+  stats->syscalls += from->syscalls;
+  stats->seeks += from->seeks;
+  stats->padding += from->padding;
+  stats->callback_time += from->callback_time;
+  stats->write_time += from->write_time;
+  stats->compression_in += from->compression_in;
+  stats->compression_out += from->compression_out;
+}
+
+int libnar_get_stats(nar_reader const* reader, nar_writer const* writer,
+                     nar_stats* stats)
+{
+  if (stats == NULL) {
+    DPRINTF("stats(%p)", stats);
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(nar_stats));
+  if (reader != NULL) {
+    stats_add(stats, &reader->stats);
+  }
+  if (writer != NULL) {
+    stats_add(stats, &writer->stats);
+  }
+
+  return 0;
+}
+
+int libnar_add_thread_stats(nar_stats* stats)
+{
+  if (stats == NULL) {
+    DPRINTF("stats(%p)", stats);
+    return -1;
+  }
+
+  stats_add(stats, &thread_stats);
+
+  return 0;
+}
+
+/*
+** read all the buffer at offset (counted in stats, if not NULL): 0, -1 at the
+** end of the archive or -errno
+*/
+static int read_at(nar_io const* io, void* opaque, nar_stats* stats,
+                   void* buf, uint64_t const size, uint64_t const offset)
+{
+  uint8_t* ptr = buf;
+  uint64_t i;
+  int64_t ret;
+
+  for (i = 0; i < size; i += ret) {
+    ret = io->pread(opaque, &ptr[i], size - i, offset + i);
+    stats_read(stats, ret);
+    if (ret < 0) {
+      DPRINTF("pread errno(%d): %s", (int) -ret, strerror(-ret));
+      return ret;
+    }
+    if (ret == 0) {
+      DPRINTF("pread: unexpected end of file at 0x%016llx",
+              (unsigned long long int) (offset + i));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** write all the buffer (counted in stats, if not NULL): 0 or -errno
+*/
+static int write_all(nar_io const* io, void* opaque, nar_stats* stats,
+                     void const* buf, uint64_t const size)
+{
+  uint8_t const* ptr = buf;
+  uint64_t i;
+  int64_t ret;
+
+  for (i = 0; i < size; i += ret) {
+    ret = io->write(opaque, &ptr[i], size - i);
+    stats_write(stats, ret);
+    if (ret < 0) {
+      DPRINTF("write errno(%d): %s", (int) -ret, strerror(-ret));
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** ------------- INDEX -------------------------------------------------------
+*/
+
+static uint64_t item_length(item_header const* ih)
+{
+  return sizeof(item_header)
+       + (ROUNDUP64(ih->length1)) + (ROUNDUP64(ih->length2))
+       + (IS_CHECKSUM(ih->flags) ? sizeof(item_checksum) : 0);
+}
+
+/* FNV-1a */
+static uint64_t index_hash(char const* filepath, uint64_t const length)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint64_t i;
+
+  for (i = 0; i < length; i++) {
+    hash ^= (uint8_t)filepath[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static void index_reset(nar_index* index)
+{
+  free(index->entries);
+  free(index->strings);
+  free(index->slots);
+  memset(index, 0, sizeof(nar_index));
+}
+
+/*
+** returns the slot of the given filepath: either the slot of the entry with
+** the same filepath or the empty slot where to store it.
+*/
+static uint64_t* index_slot(nar_index const* index,
+                            char const* filepath, uint64_t const length)
+{
+  uint64_t mask = index->slots_length - 1;
+  uint64_t i;
+
+  for (i = index_hash(filepath, length) & mask;
+       index->slots[i] != 0;
+       i = (i + 1) & mask) {
+    nar_index_entry const* entry = &index->entries[index->slots[i] - 1];
+
+    if (entry->length1 == length
+        && !memcmp(&index->strings[entry->filepath], filepath, length)) {
+      break;
+    }
+  }
+
+  return &index->slots[i];
+}
+
+static int index_rehash(nar_index* index, uint64_t const slots_length)
+{
+  uint64_t i;
+
+  free(index->slots);
+  index->slots = calloc(slots_length, sizeof(uint64_t));
+  if (index->slots == NULL) {
+    DPRINTF("calloc(%llu) failed", (unsigned long long int) slots_length);
+    index->slots_length = 0;
+    return -ENOMEM;
+  }
+  index->slots_length = slots_length;
+
+  for (i = 0; i < index->length; i++) {
+    nar_index_entry const* entry = &index->entries[i];
+
+    *index_slot(index, &index->strings[entry->filepath], entry->length1) = i + 1;
+  }
+
+  return 0;
+}
+
+static int index_append(nar_index* index, uint64_t const offset,
+                        item_header const* ih, char const* filepath)
+{
+  nar_index_entry* entry;
+  int ret;
+
+  if (index->length == index->capacity) {
+    uint64_t capacity = (index->capacity) ? index->capacity * 2 : 64;
+
+    entry = realloc(index->entries, capacity * sizeof(nar_index_entry));
+    if (entry == NULL) {
+      DPRINTF("realloc(%llu) failed", (unsigned long long int) capacity);
+      return -ENOMEM;
+    }
+    index->entries = entry;
+    index->capacity = capacity;
+  }
+
+  if (index->strings == NULL
+      || index->strings_length + ih->length1 > index->strings_capacity) {
+    uint64_t capacity = (index->strings_capacity) ? index->strings_capacity : 4096;
+    char* strings;
+
+    while (capacity < index->strings_length + ih->length1) {
+      capacity *= 2;
+    }
+
+    strings = realloc(index->strings, capacity);
+    if (strings == NULL) {
+      DPRINTF("realloc(%llu) failed", (unsigned long long int) capacity);
+      return -ENOMEM;
+    }
+    index->strings = strings;
+    index->strings_capacity = capacity;
+  }
+
+  if ((index->length + 1) * 2 > index->slots_length) {
+    ret = index_rehash(index, (index->slots_length) ? index->slots_length * 2 : 128);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  entry = &index->entries[index->length];
+  entry->offset = offset;
+  entry->flags = ih->flags;
+  entry->length1 = ih->length1;
+  entry->length2 = ih->length2;
+  entry->filepath = index->strings_length;
+
+  memcpy(&index->strings[index->strings_length], filepath, ih->length1);
+  index->strings_length += ih->length1;
+  index->length++;
+
+  /* if the filepath is already in the index, the last appended item wins */
+  *index_slot(index, filepath, ih->length1) = index->length;
+
+  return 0;
+}
+
+static nar_index_entry const* index_find(nar_index const* index,
+                                         char const* filepath,
+                                         uint64_t const length)
+{
+  uint64_t slot;
+
+  if (index->slots_length == 0) {
+    return NULL;
+  }
+
+  slot = *index_slot(index, filepath, length);
+
+  return (slot) ? &index->entries[slot - 1] : NULL;
+}
+
+/*
+** load the INDEX item at the given position. *end is set to the end of the
+** INDEX item.
+*/
+static int index_load(nar_io const* io, void* opaque, nar_stats* stats,
+                      uint64_t const position,
+                      nar_index* index, uint64_t* end)
+{
+  item_header ih;
+  uint8_t* buf;
+  uint64_t count;
+  uint64_t i, offset;
+  int ret;
+
+  ret = read_at(io, opaque, stats, &ih, sizeof(item_header), position);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (memcmp(&ih.magic, INDEX_HEADER_MAGIC, sizeof(uint64_t))
+      || ih.length1 != sizeof(uint64_t)) {
+    DPRINTF("no INDEX item at 0x%016llx", (unsigned long long int) position);
+    return -1;
+  }
+
+  ret = read_at(io, opaque, stats, &count, sizeof(uint64_t),
+                position + sizeof(item_header));
+  if (ret != 0) {
+    return ret;
+  }
+
+  buf = malloc(ih.length2);
+  if (buf == NULL && ih.length2) {
+    DPRINTF("malloc(%llu) failed", (unsigned long long int) ih.length2);
+    return -ENOMEM;
+  }
+
+  ret = read_at(io, opaque, stats, buf, ih.length2,
+                position + sizeof(item_header) + ROUNDUP64(ih.length1));
+
+  for (i = 0, offset = 0; ret == 0 && i < count; i++) {
+    index_entry_header ieh;
+    item_header entry;
+
+    if (offset + sizeof(index_entry_header) > ih.length2) {
+      DPRINTF("corrupted INDEX item at 0x%016llx", (unsigned long long int) position);
+      ret = -1;
+      break;
+    }
+    memcpy(&ieh, &buf[offset], sizeof(index_entry_header));
+    offset += sizeof(index_entry_header);
+
+    if (offset + ieh.length1 > ih.length2) {
+      DPRINTF("corrupted INDEX item at 0x%016llx", (unsigned long long int) position);
+      ret = -1;
+      break;
+    }
+
+    entry.flags = ieh.flags;
+    entry.length1 = ieh.length1;
+    entry.length2 = ieh.length2;
+    ret = index_append(index, ieh.offset, &entry, (char const*)&buf[offset]);
+    offset += ROUNDUP64(ieh.length1);
+  }
+
+  free(buf);
+  *end = position + item_length(&ih);
+
+  return ret;
+}
+
+/*
+** add all the FILE items between the offsets position and end in the index
+*/
+static int index_scan(nar_io const* io, void* opaque, nar_stats* stats,
+                      uint64_t position, uint64_t const end, nar_index* index)
+{
+  item_header ih;
+  char* filepath = NULL;
+  uint64_t length = 0;
+  int ret = 0;
+
+  while (ret == 0 && position + sizeof(item_header) <= end) {
+    ret = read_at(io, opaque, stats, &ih, sizeof(item_header), position);
+    if (ret != 0) {
+      break;
+    }
+
+    if (!memcmp(&ih.magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
+      if (ih.length1 > length) {
+        char* tmp = realloc(filepath, ih.length1);
+
+        if (tmp == NULL) {
+          DPRINTF("realloc(%llu) failed", (unsigned long long int) ih.length1);
+          ret = -ENOMEM;
+          break;
+        }
+        filepath = tmp;
+        length = ih.length1;
+      }
+
+      ret = read_at(io, opaque, stats, filepath, ih.length1,
+                    position + sizeof(item_header));
+      if (ret == 0) {
+        ret = index_append(index, position, &ih, filepath);
+      }
+    }
+
+    position += item_length(&ih);
+  }
+
+  free(filepath);
+
+  return ret;
+}
+
+/*
+** ------------- DEDUP -------------------------------------------------------
+*/
+
+/*
+** XXH64 (https://github.com/Cyan4973/xxHash), streaming
+*/
+# define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+# define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+# define XXH_PRIME64_3 0x165667B19E3779F9ULL
+# define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+# define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+  uint64_t total;
+  uint64_t v[4];
+  uint8_t mem[32];
+  uint32_t memsize;
+} xxh64_state;
+
+static uint64_t xxh64_rotl(uint64_t const x, int const r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t const input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = xxh64_rotl(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t const v)
+{
+  acc ^= xxh64_round(0, v);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64_read64(uint8_t const* p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static void xxh64_init(xxh64_state* s)
+{
+  memset(s, 0, sizeof(xxh64_state));
+  s->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+  s->v[1] = XXH_PRIME64_2;
+  s->v[2] = 0;
+  s->v[3] = -XXH_PRIME64_1;
+}
+
+static void xxh64_stripe(xxh64_state* s, uint8_t const* p)
+{
+  s->v[0] = xxh64_round(s->v[0], xxh64_read64(p));
+  s->v[1] = xxh64_round(s->v[1], xxh64_read64(p + 8));
+  s->v[2] = xxh64_round(s->v[2], xxh64_read64(p + 16));
+  s->v[3] = xxh64_round(s->v[3], xxh64_read64(p + 24));
+}
+
+static void xxh64_update(xxh64_state* s, uint8_t const* p, uint64_t length)
+{
+  uint32_t n;
+
+  s->total += length;
+
+  if (s->memsize != 0) {
+    n = 32 - s->memsize;
+    n = (length < n) ? length : n;
+    memcpy(&s->mem[s->memsize], p, n);
+    s->memsize += n;
+    p += n;
+    length -= n;
+    if (s->memsize < 32) {
+      return;
+    }
+    xxh64_stripe(s, s->mem);
+    s->memsize = 0;
+  }
+
+  for (; length >= 32; p += 32, length -= 32) {
+    xxh64_stripe(s, p);
+  }
+
+  memcpy(s->mem, p, length);
+  s->memsize = length;
+}
+
+static uint64_t xxh64_digest(xxh64_state const* s)
+{
+  uint8_t const* p = s->mem;
+  uint8_t const* end = &s->mem[s->memsize];
+  uint64_t h;
+  uint32_t k;
+
+  if (s->total >= 32) {
+    h = xxh64_rotl(s->v[0], 1) + xxh64_rotl(s->v[1], 7)
+      + xxh64_rotl(s->v[2], 12) + xxh64_rotl(s->v[3], 18);
+    h = xxh64_merge(h, s->v[0]);
+    h = xxh64_merge(h, s->v[1]);
+    h = xxh64_merge(h, s->v[2]);
+    h = xxh64_merge(h, s->v[3]);
+  } else {
+    h = s->v[2] + XXH_PRIME64_5;
+  }
+  h += s->total;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, xxh64_read64(p));
+    h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    memcpy(&k, p, sizeof(uint32_t));
+    h ^= (uint64_t)k * XXH_PRIME64_1;
+    h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/* the flags which change how a content is read */
+# define DEDUP_FLAGS (FILE_COMPRESSED | FILE_BLOCKS)
+
+/* the size of the halves compared when the write buffer is smaller */
+# define DEDUP_COMPARE_SIZE 4096
+
+typedef struct {
+  uint64_t hash;
+  uint64_t flags;
+  uint64_t length2;
+  /* the item header and the content2 of the item */
+  uint64_t offset;
+  uint64_t content2;
+} dedup_entry;
+
+/*
+** the appended items by content hash: an open addressing hash table of
+** entry index + 1 (0 means empty slot), as the nar_index
+*/
+typedef struct {
+  dedup_entry* entries;
+  uint64_t length;
+  uint64_t capacity;
+
+  uint64_t* slots;
+  uint64_t  slots_length;
+} nar_dedup;
+
+static void dedup_reset(nar_dedup* dedup)
+{
+  free(dedup->entries);
+  free(dedup->slots);
+  memset(dedup, 0, sizeof(nar_dedup));
+}
+
+static void dedup_insert_slot(nar_dedup* dedup, uint64_t const i)
+{
+  uint64_t mask = dedup->slots_length - 1;
+  uint64_t slot = dedup->entries[i].hash & mask;
+
+  while (dedup->slots[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  dedup->slots[slot] = i + 1;
+}
+
+static int dedup_append(nar_dedup* dedup, uint64_t const hash,
+                        uint64_t const offset, item_header const* ih)
+{
+  dedup_entry* entry;
+  uint64_t i;
+
+  if (dedup->length == dedup->capacity) {
+    uint64_t capacity = (dedup->capacity) ? dedup->capacity * 2 : 64;
+
+    entry = realloc(dedup->entries, capacity * sizeof(dedup_entry));
+    if (entry == NULL) {
+      DPRINTF("realloc(%llu) failed", (unsigned long long int) capacity);
+      return -ENOMEM;
+    }
+    dedup->entries = entry;
+    dedup->capacity = capacity;
+  }
+
+  if ((dedup->length + 1) * 2 > dedup->slots_length) {
+    uint64_t slots_length = (dedup->slots_length) ? dedup->slots_length * 2 : 128;
+    uint64_t* slots = calloc(slots_length, sizeof(uint64_t));
+
+    if (slots == NULL) {
+      DPRINTF("calloc(%llu) failed", (unsigned long long int) slots_length);
+      return -ENOMEM;
+    }
+    free(dedup->slots);
+    dedup->slots = slots;
+    dedup->slots_length = slots_length;
+    for (i = 0; i < dedup->length; i++) {
+      dedup_insert_slot(dedup, i);
+    }
+  }
+
+  entry = &dedup->entries[dedup->length];
+  entry->hash = hash;
+  entry->flags = ih->flags & DEDUP_FLAGS;
+  entry->length2 = ih->length2;
+  entry->offset = offset;
+  entry->content2 = offset + sizeof(item_header) + ROUNDUP64(ih->length1);
+  dedup_insert_slot(dedup, dedup->length++);
+
+  return 0;
+}
+
+/*
+** ------------- CHECKSUM ----------------------------------------------------
+*/
+
+/*
+** CRC32C (Castagnoli, reflected): with the SSE4.2 (x86-64) or the CRC32
+** (ARMv8) instructions if available, else slicing-by-8. The crc of a stream
+** is chained: crc32c(crc32c(0, a), b) == crc32c(0, a | b).
+*/
+# define CRC32C_POLYNOMIAL 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_soft(uint32_t crc, uint8_t const* p, uint64_t length)
+{
+  uint64_t v;
+
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; length >= 8; p += 8, length -= 8) {
+    v = xxh64_read64(p) ^ crc;
+    crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff]
+        ^ crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff]
+        ^ crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff]
+        ^ crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+  }
+#else
+  (void) v;
+#endif
+  for (; length > 0; p++, length--) {
+    crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, uint8_t const* p, uint64_t length)
+{
+  uint64_t c = ~crc;
+
+  for (; length >= 8; p += 8, length -= 8) {
+    c = __builtin_ia32_crc32di(c, xxh64_read64(p));
+  }
+  crc = c;
+  for (; length > 0; p++, length--) {
+    crc = __builtin_ia32_crc32qi(crc, *p);
+  }
+
+  return ~crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hard(uint32_t crc, uint8_t const* p, uint64_t length)
+{
+  crc = ~crc;
+  for (; length >= 8; p += 8, length -= 8) {
+    crc = __builtin_aarch64_crc32cx(crc, xxh64_read64(p));
+  }
+  for (; length > 0; p++, length--) {
+    crc = __builtin_aarch64_crc32cb(crc, *p);
+  }
+
+  return ~crc;
+}
+#endif
+
+static uint32_t (*crc32c)(uint32_t crc, uint8_t const* p, uint64_t length)
+  = crc32c_soft;
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+  uint32_t crc;
+  int i;
+  int j;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++) {
+      crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff]
+                         ^ (crc32c_table[j - 1][i] >> 8);
+    }
+  }
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c = crc32c_hard;
+  }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c = crc32c_hard;
+#endif
+}
+
+/*
+** ------------- SIGN --------------------------------------------------------
+*/
+
+/*
+** SHA-256 (FIPS 180-4): with the SHA extensions (x86-64) if available
+*/
+static uint32_t const sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t total;
+  uint8_t mem[64];
+  uint32_t memsize;
+} sha256_state;
+
+static uint32_t sha256_rotr(uint32_t const x, int const r)
+{
+  return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_soft(uint32_t* h, uint8_t const* p, uint64_t blocks)
+{
+  uint32_t w[64];
+  uint32_t s[8];
+  uint32_t t1, t2;
+  int i;
+
+  for (; blocks > 0; blocks--, p += 64) {
+    for (i = 0; i < 16; i++) {
+      w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16)
+           | ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+    }
+    for (; i < 64; i++) {
+      w[i] = w[i - 16] + w[i - 7]
+           + (sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18)
+              ^ (w[i - 15] >> 3))
+           + (sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19)
+              ^ (w[i - 2] >> 10));
+    }
+
+    memcpy(s, h, sizeof(s));
+    for (i = 0; i < 64; i++) {
+      t1 = s[7] + (sha256_rotr(s[4], 6) ^ sha256_rotr(s[4], 11)
+                   ^ sha256_rotr(s[4], 25))
+         + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+      t2 = (sha256_rotr(s[0], 2) ^ sha256_rotr(s[0], 13) ^ sha256_rotr(s[0], 22))
+         + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+      memmove(&s[1], &s[0], 7 * sizeof(uint32_t));
+      s[4] += t1;
+      s[0] = t1 + t2;
+    }
+    for (i = 0; i < 8; i++) {
+      h[i] += s[i];
+    }
+  }
+}
+
+#if defined(__x86_64__)
+/*
+** the 4 rounds i (of 16) with the message words w[i % 4], computing the
+** next message words on the way
+*/
+# define SHA256_ROUNDS(i)                                                 \
+  do {                                                                    \
+    m = _mm_add_epi32(w[(i) % 4],                                         \
+                      _mm_loadu_si128((__m128i const*)&sha256_k[4 * (i)])); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, m);                          \
+    if ((i) >= 3 && (i) < 15) {                                           \
+      t = _mm_alignr_epi8(w[(i) % 4], w[((i) + 3) % 4], 4);               \
+      w[((i) + 1) % 4] = _mm_add_epi32(w[((i) + 1) % 4], t);              \
+      w[((i) + 1) % 4] = _mm_sha256msg2_epu32(w[((i) + 1) % 4], w[(i) % 4]); \
+    }                                                                     \
+    m = _mm_shuffle_epi32(m, 0x0E);                                       \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, m);                          \
+    if ((i) >= 1 && (i) < 13) {                                           \
+      w[((i) + 3) % 4] = _mm_sha256msg1_epu32(w[((i) + 3) % 4], w[(i) % 4]); \
+    }                                                                     \
+  } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_hard(uint32_t* h, uint8_t const* p, uint64_t blocks)
+{
+  __m128i const mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+  __m128i abef, cdgh, abef_save, cdgh_save;
+  __m128i w[4];
+  __m128i m, t;
+  int i;
+
+  /* h (ABCD EFGH) as the instructions expect it (ABEF CDGH) */
+  t = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)&h[0]), 0xB1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)&h[4]), 0x1B);
+  abef = _mm_alignr_epi8(t, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, t, 0xF0);
+
+  for (; blocks > 0; blocks--, p += 64) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    for (i = 0; i < 4; i++) {
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)&p[16 * i]), mask);
+    }
+    SHA256_ROUNDS(0);  SHA256_ROUNDS(1);  SHA256_ROUNDS(2);  SHA256_ROUNDS(3);
+    SHA256_ROUNDS(4);  SHA256_ROUNDS(5);  SHA256_ROUNDS(6);  SHA256_ROUNDS(7);
+    SHA256_ROUNDS(8);  SHA256_ROUNDS(9);  SHA256_ROUNDS(10); SHA256_ROUNDS(11);
+    SHA256_ROUNDS(12); SHA256_ROUNDS(13); SHA256_ROUNDS(14); SHA256_ROUNDS(15);
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  t = _mm_shuffle_epi32(abef, 0x1B);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+  _mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(t, cdgh, 0xF0));
+  _mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t* h, uint8_t const* p, uint64_t blocks)
+  = sha256_soft;
+
+__attribute__((constructor))
+static void sha256_dispatch(void)
+{
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+      && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+      && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+    sha256_blocks = sha256_hard;
+  }
+#endif
+}
+
+static void sha256_init(sha256_state* s)
+{
+  static uint32_t const h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memset(s, 0, sizeof(sha256_state));
+  memcpy(s->h, h, sizeof(h));
+}
+
+static void sha256_update(sha256_state* s, uint8_t const* p, uint64_t length)
+{
+  uint32_t n;
+
+  s->total += length;
+
+  if (s->memsize != 0) {
+    n = 64 - s->memsize;
+    n = (length < n) ? length : n;
+    memcpy(&s->mem[s->memsize], p, n);
+    s->memsize += n;
+    p += n;
+    length -= n;
+    if (s->memsize < 64) {
+      return;
+    }
+    sha256_blocks(s->h, s->mem, 1);
+    s->memsize = 0;
+  }
+
+  if (length >= 64) {
+    sha256_blocks(s->h, p, length / 64);
+    p += length & ~63ULL;
+    length &= 63;
+  }
+
+  memcpy(s->mem, p, length);
+  s->memsize = length;
+}
+
+static void sha256_digest(sha256_state* s, uint8_t* digest)
+{
+  uint64_t bits = s->total * 8;
+  uint8_t end[72];
+  uint32_t n;
+  int i;
+
+  /* 0x80, zeros then the length in bits (big endian) up to a whole block */
+  n = (s->memsize < 56) ? 56 - s->memsize : 120 - s->memsize;
+  memset(end, 0, sizeof(end));
+  end[0] = 0x80;
+  for (i = 0; i < 8; i++) {
+    end[n + i] = bits >> (56 - 8 * i);
+  }
+  sha256_update(s, end, n + 8);
+
+  for (i = 0; i < 8; i++) {
+    digest[4 * i] = s->h[i] >> 24;
+    digest[4 * i + 1] = s->h[i] >> 16;
+    digest[4 * i + 2] = s->h[i] >> 8;
+    digest[4 * i + 3] = s->h[i];
+  }
+}
+
+/*
+** the digest of an item: s holds its content1 and its content2
+*/
+static void item_digest(sha256_state* s, item_header const* ih, uint8_t* digest)
+{
+  sha256_update(s, (uint8_t const*)ih, sizeof(item_header));
+  sha256_digest(s, digest);
+}
+
+/*
+** the hash tree: the leaves and the roots of its perfect subtrees
+** (frontier[i] is the root of 2^i leaves if the bit i of length is set)
+*/
+# define TREE_LEVELS 64
+
+typedef struct {
+  sign_leaf* leaves;
+  uint64_t length;
+  uint64_t capacity;
+  uint8_t frontier[TREE_LEVELS][NAR_DIGEST_SIZE];
+
+  /* loaded from a SIGN item */
+  uint8_t root[NAR_DIGEST_SIZE];
+  uint8_t* signature;
+  uint32_t signature_length;
+} nar_tree;
+
+static void tree_node(uint8_t const* left, uint8_t const* right, uint8_t* node)
+{
+  uint8_t const prefix = 0x01;
+  sha256_state s;
+
+  sha256_init(&s);
+  sha256_update(&s, &prefix, 1);
+  sha256_update(&s, left, NAR_DIGEST_SIZE);
+  sha256_update(&s, right, NAR_DIGEST_SIZE);
+  sha256_digest(&s, node);
+}
+
+/*
+** add the leaf of digest to the frontier of length leaves
+*/
+static void frontier_push(uint8_t (*frontier)[NAR_DIGEST_SIZE],
+                          uint64_t const length, uint8_t const* digest)
+{
+  uint8_t const prefix = 0x00;
+  uint8_t node[NAR_DIGEST_SIZE];
+  sha256_state s;
+  int level;
+
+  sha256_init(&s);
+  sha256_update(&s, &prefix, 1);
+  sha256_update(&s, digest, NAR_DIGEST_SIZE);
+  sha256_digest(&s, node);
+
+  /* as a binary counter: merge the perfect subtrees of the same size */
+  for (level = 0; (length >> level) & 1; level++) {
+    tree_node(frontier[level], node, node);
+  }
+  memcpy(frontier[level], node, NAR_DIGEST_SIZE);
+}
+
+static void frontier_root(uint8_t (*frontier)[NAR_DIGEST_SIZE],
+                          uint64_t const length, uint8_t* root)
+{
+  int found = 0;
+  int level;
+
+  memset(root, 0, NAR_DIGEST_SIZE);
+  for (level = 0; level < TREE_LEVELS; level++) {
+    if ((length >> level) & 1) {
+      if (found) {
+        tree_node(frontier[level], root, root);
+      } else {
+        memcpy(root, frontier[level], NAR_DIGEST_SIZE);
+        found = 1;
+      }
+    }
+  }
+}
+
+static void tree_reset(nar_tree* tree)
+{
+  free(tree->leaves);
+  free(tree->signature);
+  memset(tree, 0, sizeof(nar_tree));
+}
+
+static int tree_push(nar_tree* tree, uint64_t const offset,
+                     uint8_t const* digest)
+{
+  sign_leaf* leaves;
+
+  if (tree->length == tree->capacity) {
+    uint64_t capacity = (tree->capacity) ? tree->capacity * 2 : 64;
+
+    leaves = realloc(tree->leaves, capacity * sizeof(sign_leaf));
+    if (leaves == NULL) {
+      DPRINTF("realloc(%llu) failed", (unsigned long long int) capacity);
+      return -ENOMEM;
+    }
+    tree->leaves = leaves;
+    tree->capacity = capacity;
+  }
+
+  frontier_push(tree->frontier, tree->length, digest);
+  tree->leaves[tree->length].offset = offset;
+  memcpy(tree->leaves[tree->length].digest, digest, NAR_DIGEST_SIZE);
+  tree->length++;
+
+  return 0;
+}
+
+/*
+** load the SIGN item at the given position. *end is set to the end of the
+** SIGN item.
+*/
+static int tree_load(nar_io const* io, void* opaque, nar_stats* stats,
+                     uint64_t const position,
+                     nar_tree* tree, uint64_t* end)
+{
+  uint8_t root[NAR_DIGEST_SIZE];
+  sign_header sh;
+  item_header ih;
+  uint64_t offset;
+  int level;
+  int ret;
+
+  ret = read_at(io, opaque, stats, &ih, sizeof(item_header), position);
+  if (ret == 0) {
+    ret = read_at(io, opaque, stats, &sh, sizeof(sign_header),
+                  position + sizeof(item_header));
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (memcmp(&ih.magic, SIGNATURE_HEADER_MAGIC, sizeof(uint64_t))
+      || ih.length1 != sizeof(sign_header)
+                       + __builtin_popcountll(sh.leaves) * NAR_DIGEST_SIZE
+      || sh.signature_length > NAR_SIGNATURE_MAX_LENGTH
+      || sh.leaves > ih.length2 / sizeof(sign_leaf)
+      || ih.length2 != sh.leaves * sizeof(sign_leaf) + sh.signature_length) {
+    DPRINTF("no SIGN item at 0x%016llx", (unsigned long long int) position);
+    return -1;
+  }
+
+  memset(tree, 0, sizeof(nar_tree));
+  tree->leaves = malloc(sh.leaves * sizeof(sign_leaf));
+  tree->signature = malloc(sh.signature_length);
+  if ((tree->leaves == NULL && sh.leaves)
+      || (tree->signature == NULL && sh.signature_length)) {
+    tree_reset(tree);
+    return -ENOMEM;
+  }
+  tree->capacity = sh.leaves;
+  tree->length = sh.leaves;
+  memcpy(tree->root, sh.root, NAR_DIGEST_SIZE);
+  tree->signature_length = sh.signature_length;
+
+  offset = position + sizeof(item_header) + sizeof(sign_header);
+  for (level = TREE_LEVELS - 1; ret == 0 && level >= 0; level--) {
+    if ((sh.leaves >> level) & 1) {
+      ret = read_at(io, opaque, stats, tree->frontier[level], NAR_DIGEST_SIZE,
+                    offset);
+      offset += NAR_DIGEST_SIZE;
+    }
+  }
+
+  offset = position + sizeof(item_header) + ROUNDUP64(ih.length1);
+  if (ret == 0) {
+    ret = read_at(io, opaque, stats, tree->leaves,
+                  sh.leaves * sizeof(sign_leaf), offset);
+  }
+  if (ret == 0) {
+    ret = read_at(io, opaque, stats, tree->signature, sh.signature_length,
+                  offset + sh.leaves * sizeof(sign_leaf));
+  }
+
+  /* the frontier is the one of the root */
+  frontier_root(tree->frontier, tree->length, root);
+  if (ret == 0 && memcmp(root, tree->root, NAR_DIGEST_SIZE)) {
+    DPRINTF("corrupted SIGN item at 0x%016llx", (unsigned long long int) position);
+    ret = -EBADMSG;
+  }
+
+  if (ret != 0) {
+    tree_reset(tree);
+    return ret;
+  }
+  *end = position + item_length(&ih);
+
+  return 0;
+}
+
+/*
+** ------------- CIPHER ------------------------------------------------------
+*/
+
+#if !defined(ENOKEY)
+# define ENOKEY EACCES
+#endif
+
+/*
+** the key given by libnar_open_key
+*/
+typedef struct {
+  uint64_t cipher_type;
+  uint8_t key[NAR_KEY_SIZE];
+} nar_key;
+
+/*
+** the cipher state of an item (see CIPHERS): its layout, the last chunk
+** decrypted and, when it is appended, the content to encrypt
+*/
+typedef struct {
+  void* ctx;
+  nar_key const* key;
+  uint64_t item_position;
+
+  /* the chunks: chunks - 1 of chunk_size bytes, then one of last bytes */
+  uint32_t chunk_size;
+  uint32_t last;
+  uint64_t chunks;
+  uint64_t length;
+  uint64_t length2;
+  /* the position of the first chunk (positional reads) */
+  uint64_t content2;
+
+  /* the next chunk (streams) and the chunk in data (positional reads) */
+  uint64_t next;
+  uint64_t chunk;
+  uint8_t* data;
+  uint32_t data_capacity;
+  uint32_t data_offset;
+  uint32_t data_length;
+  uint8_t tag[NAR_CIPHER_TAG_SIZE];
+
+  /* the content of the item appended */
+  get_computed_content callback;
+  void* opaque;
+  uint64_t remaining;
+  int ended;
+} nar_cipher;
+
+void* libnar_open_key(uint64_t const cipher_type,
+                      uint8_t const* key, uint32_t const length)
+{
+  nar_key* k;
+
+  if (key == NULL || length != NAR_KEY_SIZE) {
+    DPRINTF("key(%p) length(%u)", key, length);
+    return NULL;
+  }
+
+  switch (cipher_type) {
+#if defined(HAVE_OPENSSL)
+  case CIPHER_AES_256_GCM:
+    break;
+#endif
+  default:
+    DPRINTF("cipher type not supported %llu",
+            (unsigned long long int) cipher_type);
+    return NULL;
+  }
+
+  k = malloc(sizeof(nar_key));
+  if (k == NULL) {
+    return NULL;
+  }
+  k->cipher_type = cipher_type;
+  memcpy(k->key, key, NAR_KEY_SIZE);
+
+  return k;
+}
+
+void libnar_close_key(void* key)
+{
+  if (key != NULL) {
+#if defined(HAVE_OPENSSL)
+    OPENSSL_cleanse(key, sizeof(nar_key));
+#else
+    memset(key, 0, sizeof(nar_key));
+#endif
+    free(key);
+  }
+}
+
+static nar_cipher* cipher_open(void)
+{
+  nar_cipher* c;
+
+  c = calloc(1, sizeof(nar_cipher));
+  if (c != NULL) {
+    c->chunk = UINT64_MAX;
+  }
+
+  return c;
+}
+
+static void cipher_close(nar_cipher* c)
+{
+  if (c != NULL) {
+#if defined(HAVE_OPENSSL)
+    EVP_CIPHER_CTX_free(c->ctx);
+#endif
+    free(c->data);
+    free(c);
+  }
+}
+
+#if defined(HAVE_OPENSSL)
+/*
+** set the key of the item (derived from the salt) to encrypt or decrypt
+*/
+static int cipher_derive(nar_cipher* c, cipher_header const* ch,
+                         int const encrypt)
+{
+  uint8_t key[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  int ret = -1;
+
+  if (c->ctx == NULL) {
+    c->ctx = EVP_CIPHER_CTX_new();
+    if (c->ctx == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  if (HMAC(EVP_sha256(), c->key->key, NAR_KEY_SIZE,
+           ch->salt, sizeof(ch->salt), key, &length) != NULL
+      && 1 == EVP_CipherInit_ex(c->ctx, EVP_aes_256_gcm(), NULL,
+                                key, NULL, encrypt)) {
+    ret = 0;
+  } else {
+    DPRINTF("can't derive the key of the item");
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+
+  return ret;
+}
+
+/*
+** encrypt (or decrypt, as set by cipher_derive) the chunk i of length bytes
+** from in to out (in place if in == out). The tag is written (or checked).
+*/
+static int cipher_chunk(nar_cipher* c, uint64_t const i,
+                        uint8_t const* in, uint8_t* out, uint32_t const length,
+                        uint8_t* tag)
+{
+  uint8_t nonce[12];
+  int encrypt;
+  int n;
+  int j;
+
+  for (j = 0; j < 8; j++) {
+    nonce[j] = i >> (56 - 8 * j);
+  }
+  memset(&nonce[8], 0, 4);
+  nonce[11] = (length < c->chunk_size) ? 1 : 0;
+
+  encrypt = EVP_CIPHER_CTX_encrypting(c->ctx);
+  if (1 != EVP_CipherInit_ex(c->ctx, NULL, NULL, NULL, nonce, -1)
+      || (!encrypt
+          && 1 != EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_SET_TAG,
+                                      NAR_CIPHER_TAG_SIZE, tag))
+      || (length > 0
+          && 1 != EVP_CipherUpdate(c->ctx, out, &n, in, length))
+      || 1 != EVP_CipherFinal_ex(c->ctx, &out[length], &n)
+      || (encrypt
+          && 1 != EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_GET_TAG,
+                                      NAR_CIPHER_TAG_SIZE, tag))) {
+    DPRINTF("the chunk %llu %s", (unsigned long long int) i,
+            (encrypt) ? "can't be encrypted" : "is corrupted");
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int cipher_salt(uint8_t* salt, uint32_t const length)
+{
+  return (1 == RAND_bytes(salt, length)) ? 0 : -1;
+}
+#else
+static int cipher_derive(nar_cipher* c, cipher_header const* ch,
+                         int const encrypt)
+{
+  (void) c;
+  (void) ch;
+  (void) encrypt;
+  return -1;
+}
+
+static int cipher_chunk(nar_cipher* c, uint64_t const i,
+                        uint8_t const* in, uint8_t* out, uint32_t const length,
+                        uint8_t* tag)
+{
+  (void) c;
+  (void) i;
+  (void) in;
+  (void) out;
+  (void) length;
+  (void) tag;
+  return -1;
+}
+
+static int cipher_salt(uint8_t* salt, uint32_t const length)
+{
+  (void) salt;
+  (void) length;
+  return -1;
+}
+#endif
+
+/*
+** the length of the content2 of an item of length bytes encrypted
+*/
+static uint64_t cipher_length(uint64_t const length, uint32_t const chunk_size)
+{
+  return sizeof(cipher_header) + length
+       + (length / chunk_size + 1) * NAR_CIPHER_TAG_SIZE;
+}
+
+/*
+** the plaintext length of the chunk i
+*/
+static uint32_t cipher_chunk_length(nar_cipher const* c, uint64_t const i)
+{
+  return (i + 1 < c->chunks) ? c->chunk_size : c->last;
+}
+
+/*
+** start the item of the given cipher_header and content2 length: check its
+** layout, allocate the chunk buffer and derive its key
+*/
+static int cipher_begin(nar_cipher* c, cipher_header const* ch,
+                        uint64_t const length2, int const encrypt)
+{
+  uint8_t* data;
+  uint64_t n;
+
+  c->chunk = UINT64_MAX;
+  c->next = 0;
+  c->data_offset = c->data_length = 0;
+
+  if (ch->chunk_size < NAR_CIPHER_TAG_SIZE
+      || ch->chunk_size > NAR_CIPHER_MAX_CHUNK_SIZE) {
+    DPRINTF("corrupted cipher header: chunk_size(%u)", ch->chunk_size);
+    return -1;
+  }
+  c->chunk_size = ch->chunk_size;
+
+  if (!encrypt) {
+    if (length2 < sizeof(cipher_header) + NAR_CIPHER_TAG_SIZE) {
+      DPRINTF("the encrypted item is too short");
+      return -1;
+    }
+    n = length2 - sizeof(cipher_header);
+    c->chunks = n / (c->chunk_size + NAR_CIPHER_TAG_SIZE) + 1;
+    c->last = n % (c->chunk_size + NAR_CIPHER_TAG_SIZE);
+    if (c->last < NAR_CIPHER_TAG_SIZE) {
+      DPRINTF("the encrypted item is truncated");
+      return -EBADMSG;
+    }
+    c->last -= NAR_CIPHER_TAG_SIZE;
+    c->length = (c->chunks - 1) * c->chunk_size + c->last;
+    c->length2 = length2;
+  }
+
+  if (c->data_capacity < c->chunk_size + NAR_CIPHER_TAG_SIZE) {
+    data = realloc(c->data, c->chunk_size + NAR_CIPHER_TAG_SIZE);
+    if (data == NULL) {
+      return -ENOMEM;
+    }
+    c->data = data;
+    c->data_capacity = c->chunk_size + NAR_CIPHER_TAG_SIZE;
+  }
+
+  return cipher_derive(c, ch, encrypt);
+}
+
+/*
+** the get_computed_content of an encrypted item: the cipher_header then the
+** chunks of the content given by c->callback. A whole chunk which fits in buf
+** is read and encrypted in place, in buf.
+*/
+static int cipher_write(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  nar_cipher* c = opaque;
+  uint32_t have = 0;
+  uint32_t length;
+  uint8_t* chunk;
+  int ret;
+
+  while (have < max) {
+    if (c->data_offset < c->data_length) {
+      length = c->data_length - c->data_offset;
+      length = (length > max - have) ? max - have : length;
+      memcpy(&buf[have], &c->data[c->data_offset], length);
+      c->data_offset += length;
+      have += length;
+      continue;
+    }
+    if (c->ended) {
+      break;
+    }
+
+    chunk = (max - have >= c->chunk_size + NAR_CIPHER_TAG_SIZE)
+          ? &buf[have] : c->data;
+    for (length = 0; length < c->chunk_size && c->remaining > 0;
+         length += ret) {
+      ret = c->callback(c->opaque, &chunk[length],
+                        (c->remaining < c->chunk_size - length)
+                        ? c->remaining : c->chunk_size - length);
+      if (ret < 0) {
+        return -1;
+      }
+      if (ret == 0) {
+        break;
+      }
+      c->remaining -= ret;
+    }
+
+    /* a chunk shorter than chunk_size is the last one */
+    if (cipher_chunk(c, c->next++, chunk, chunk, length, &chunk[length]) != 0) {
+      errno = EIO;
+      return -1;
+    }
+    c->ended = (length < c->chunk_size);
+
+    if (chunk == c->data) {
+      c->data_offset = 0;
+      c->data_length = length + NAR_CIPHER_TAG_SIZE;
+    } else {
+      have += length + NAR_CIPHER_TAG_SIZE;
+    }
+  }
+
+  return have;
+}
+
+/*
+** ------------- WRITER ------------------------------------------------------
+*/
+
+int libnar_init_writer(nar_writer* nar, int fd)
+{
+  if (nar == NULL) {
+    DPRINTF("nar_write* nar == NULL");
+    return -1;
+  }
+
+  memset(nar, 0, sizeof(nar_writer));
+
+  nar->fd = fd;
+  nar->io = &libnar_fd_io;
+  nar->io_opaque = LIBNAR_FD_IO(fd);
+
+  return 0;
+}
+
+int libnar_init_writer_io(nar_writer* nar, nar_io const* io, void* opaque)
+{
+  if (nar == NULL || io == NULL) {
+    DPRINTF("nar_writer(%p) io(%p)", nar, io);
+    return -1;
+  }
+
+  memset(nar, 0, sizeof(nar_writer));
+
+  nar->fd = -1;
+  nar->io = io;
+  nar->io_opaque = opaque;
+
+  return 0;
+}
+
+void libnar_close_writer(nar_writer* nar)
+{
+  if (nar != NULL) {
+    free(nar->buffer);
+    index_reset(&nar->index);
+    if (nar->dedup != NULL) {
+      dedup_reset(nar->dedup);
+      free(nar->dedup);
+    }
+    if (nar->tree != NULL) {
+      tree_reset(nar->tree);
+      free(nar->tree);
+    }
+    cipher_close(nar->cipher);
+    memset(nar, 0, sizeof(nar_writer));
+  }
+}
+
+static int write_buffer(int fd, uint8_t const* buf, uint64_t const size)
+{
+  uint64_t offset;
+  int ret;
+
+  for (offset = 0; offset < size; offset += ret) {
+    ret = write(fd, &buf[offset], size - offset);
+    if (ret == -1) {
+      DPRINTF("write errno(%d): %s", errno, strerror(errno));
+      return -1;
+    }
+  }
+
+  return offset;
+}
+
+int libnar_write_nar_header(nar_writer* nar,
+                            uint64_t const cipher_type,
+                            uint64_t const compression_type)
+{
+  nar_header nh;
+  uint8_t* buf;
+  uint32_t length;
+  int64_t ret;
+
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_write* nar == NULL");
+    return -1;
+  }
+
+  length = sizeof(nar_header);
+
+  memset(&nh, 0, length);
+  memcpy(&(nh.magic), NAR_HEADER_MAGIC, sizeof(uint64_t));
+  nh.version.major = NAR_HEADER_VERSION_MAJOR;
+  nh.version.minor = NAR_HEADER_VERSION_MINOR;
+  nh.cipher_type = cipher_type;
+  nh.compression_type = compression_type;
+  nh.signature_position = nar->signature_position;
+  nh.index_position = nar->index_position;
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, 0, SEEK_SET);
+  if (ret < 0) {
+    switch (-ret) {
+    case ESPIPE:
+      /* The user is probably using a pipe or a socked or a FIFO,
+      ** then do not consider it as an error */
+      break;
+    default:
+      DPRINTF("lseek/ error: %s", strerror(-ret));
+      return ret;
+      break;
+    }
+  }
+
+  buf = (uint8_t*)&nh;
+  ret = write_all(nar->io, nar->io_opaque, &nar->stats, buf, length);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (nar->offset < length) {
+    nar->offset = length;
+  }
+  nar->cipher_type = cipher_type;
+
+  return 0;
+}
+
+/* the zeros used to align the contents to 64bits */
+static uint8_t const padding[sizeof(uint64_t)];
+
+/*
+** write all the given io vectors (iov is modified on partial writes): one
+** writev syscall with the file descriptor backend. Returns 0 or -errno.
+*/
+static int writev_all(nar_writer* nar, struct iovec* iov, int iovcnt)
+{
+  ssize_t ret;
+  int i;
+
+  if (nar->io != &libnar_fd_io) {
+    for (i = 0; i < iovcnt; i++) {
+      ret = write_all(nar->io, nar->io_opaque, &nar->stats, iov[i].iov_base,
+                      iov[i].iov_len);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    return 0;
+  }
+
+  while (iovcnt > 0) {
+    ret = writev(IO_FD(nar->io_opaque), iov, iovcnt);
+    stats_write(&nar->stats, ret);
+    if (ret == -1) {
+      DPRINTF("writev errno(%d): %s", errno, strerror(errno));
+      return -errno;
+    }
+
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** writev_all, timed in the stats of the writer
+*/
+static int write_vector(nar_writer* nar, struct iovec* iov, int iovcnt)
+{
+  uint64_t start = stats_clock();
+  int ret;
+
+  ret = writev_all(nar, iov, iovcnt);
+  nar->stats.write_time += stats_clock() - start;
+
+  return ret;
+}
+
+int libnar_set_write_buffer(nar_writer* nar, uint32_t const size)
+{
+  uint8_t* buffer;
+
+  if (nar == NULL || size == 0) {
+    DPRINTF("nar_writer(%p) size(%u)", nar, size);
+    return -1;
+  }
+
+  buffer = malloc(size);
+  if (buffer == NULL) {
+    DPRINTF("malloc(%u) failed", size);
+    return -ENOMEM;
+  }
+
+  free(nar->buffer);
+  nar->buffer = buffer;
+  nar->buffer_size = size;
+
+  return 0;
+}
+
+/*
+** get the position where the next item will be appended
+*/
+static int writer_position(nar_writer* nar, uint64_t* position)
+{
+  int64_t ret;
+
+  *position = nar->offset;
+  if (nar->session) {
+    /* the file offset is kept at the end of the archive */
+    return 0;
+  }
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, 0, SEEK_END);
+  if (ret < 0) {
+    switch (-ret) {
+    case ESPIPE:
+      /* The user is probably using a pipe or a socked or a FIFO,
+      ** then do not consider it as an error */
+      ret = nar->offset;
+      break;
+    default:
+      DPRINTF("lseek error: %s", strerror(-ret));
+      return ret;
+      break;
+    }
+  }
+
+  *position = ret;
+
+  return 0;
+}
+
+/*
+** drop what a failed append of the session wrote after the last item: the
+** next items (and the SIGN and INDEX items) are written at nar->offset
+*/
+static int writer_rollback(nar_writer* nar)
+{
+  int64_t ret;
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, nar->offset, SEEK_SET);
+  if (ret < 0) {
+    DPRINTF("lseek errno(%d): %s", (int) -ret, strerror(-ret));
+    return ret;
+  }
+
+  nar->stats.syscalls++;
+  ret = nar->io->truncate(nar->io_opaque, nar->offset);
+  if (ret != 0) {
+    DPRINTF("ftruncate errno(%d): %s", (int) -ret, strerror(-ret));
+  }
+
+  return ret;
+}
+
+/*
+** write the item header, the filepath and its padding in one syscall
+*/
+static int write_item_header(nar_writer* nar, item_header* ih,
+                             char const* filepath)
+{
+  struct iovec iov[3];
+
+  iov[0].iov_base = ih;
+  iov[0].iov_len = sizeof(item_header);
+  iov[1].iov_base = (void*)filepath;
+  iov[1].iov_len = ih->length1;
+  iov[2].iov_base = (void*)padding;
+  iov[2].iov_len = ROUNDUP64(ih->length1) - ih->length1;
+  nar->stats.padding += iov[2].iov_len;
+
+  return write_vector(nar, iov, 3);
+}
+
+int libnar_set_dedup(nar_writer* nar, int const enable)
+{
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_writer(%p)", nar);
+    return -1;
+  }
+
+  if (!enable) {
+    if (nar->dedup != NULL) {
+      dedup_reset(nar->dedup);
+      free(nar->dedup);
+      nar->dedup = NULL;
+    }
+    return 0;
+  }
+
+  if (nar->dedup == NULL) {
+    nar->dedup = calloc(1, sizeof(nar_dedup));
+    if (nar->dedup == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+int libnar_set_checksum(nar_writer* nar, int const enable)
+{
+  if (nar == NULL) {
+    DPRINTF("nar_writer* nar == NULL");
+    return -1;
+  }
+
+  nar->checksum = (enable != 0);
+
+  return 0;
+}
+
+int libnar_set_writer_key(nar_writer* nar, void const* key)
+{
+  nar_key const* k = key;
+
+  if (nar == NULL) {
+    DPRINTF("nar_writer(%p)", nar);
+    return -1;
+  }
+
+  if (k != NULL && k->cipher_type != nar->cipher_type) {
+    DPRINTF("the key is not one of the cipher type %llu of the archive",
+            (unsigned long long int) nar->cipher_type);
+    return -EINVAL;
+  }
+
+  if (k != NULL && nar->cipher == NULL) {
+    nar->cipher = cipher_open();
+    if (nar->cipher == NULL) {
+      return -ENOMEM;
+    }
+  }
+  nar->key = k;
+
+  return 0;
+}
+
+/*
+** read back [position, position + length[ of the archive to hash it (if hash
+** is not NULL), to update the crc (if crc is not NULL) and the digest (if sha
+** is not NULL)
+*/
+static int read_back(nar_writer* nar, uint64_t const position,
+                     uint64_t const length, xxh64_state* hash, uint32_t* crc,
+                     sha256_state* sha)
+{
+  uint64_t offset;
+  uint64_t n;
+  int ret;
+
+  for (offset = 0; offset < length; offset += n) {
+    n = (length - offset > nar->buffer_size) ? nar->buffer_size : length - offset;
+    ret = read_at(nar->io, nar->io_opaque, &nar->stats, nar->buffer, n,
+                  position + offset);
+    if (ret != 0) {
+      return ret;
+    }
+    if (hash != NULL) {
+      xxh64_update(hash, nar->buffer, n);
+    }
+    if (crc != NULL) {
+      *crc = crc32c(*crc, nar->buffer, n);
+    }
+    if (sha != NULL) {
+      sha256_update(sha, nar->buffer, n);
+    }
+  }
+
+  return 0;
+}
+
+/*
+** the digest of the item at position, read back (see SIGN)
+*/
+static int read_back_digest(nar_writer* nar, uint64_t const position,
+                            item_header const* ih, char const* filepath,
+                            uint8_t* digest)
+{
+  sha256_state s;
+  int ret;
+
+  sha256_init(&s);
+  sha256_update(&s, (uint8_t const*)filepath, ih->length1);
+  ret = read_back(nar, position + sizeof(item_header) + ROUNDUP64(ih->length1),
+                  ih->length2, NULL, NULL, &s);
+  if (ret == 0) {
+    item_digest(&s, ih, digest);
+  }
+
+  return ret;
+}
+
+/*
+** add to the tree the items of the index it does not have yet (the items
+** appended without maintaining it). If it does not match the index, it is
+** rebuilt from all the items.
+*/
+static int tree_sync(nar_writer* nar)
+{
+  nar_tree* tree = nar->tree;
+  uint8_t digest[NAR_DIGEST_SIZE];
+  item_header ih;
+  uint64_t i = tree->length;
+  int ret;
+
+  if (i > nar->index.length
+      || (i > 0 && tree->leaves[i - 1].offset != nar->index.entries[i - 1].offset)) {
+    DPRINTF("the SIGN item does not match the index: it is rebuilt");
+    tree_reset(tree);
+    i = 0;
+  }
+
+  if (i < nar->index.length && nar->buffer == NULL) {
+    ret = libnar_set_write_buffer(nar, LIBNAR_WRITE_BUFFER_SIZE);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  memcpy(&ih.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
+  for (; i < nar->index.length; i++) {
+    nar_index_entry const* entry = &nar->index.entries[i];
+
+    ih.flags = entry->flags;
+    ih.length1 = entry->length1;
+    ih.length2 = entry->length2;
+    ret = read_back_digest(nar, entry->offset, &ih,
+                           &nar->index.strings[entry->filepath], digest);
+    if (ret == 0) {
+      ret = tree_push(tree, entry->offset, digest);
+    }
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+int libnar_set_sign(nar_writer* nar, int const enable,
+                    sign_root sign, void* opaque)
+{
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_writer(%p)", nar);
+    return -1;
+  }
+
+  if (!enable) {
+    if (nar->tree != NULL) {
+      tree_reset(nar->tree);
+      free(nar->tree);
+      nar->tree = NULL;
+    }
+    nar->sign = NULL;
+    nar->sign_opaque = NULL;
+    return 0;
+  }
+
+  if (nar->tree == NULL) {
+    nar->tree = calloc(1, sizeof(nar_tree));
+    if (nar->tree == NULL) {
+      return -ENOMEM;
+    }
+  }
+  nar->sign = sign;
+  nar->sign_opaque = opaque;
+
+  return tree_sync(nar);
+}
+
+/*
+** compare [a, a + length[ and [b, b + length[ of the archive. Returns 1 if
+** they are equal, 0 if not or -errno.
+*/
+static int dedup_compare(nar_writer* nar, uint64_t const a, uint64_t const b,
+                         uint64_t const length)
+{
+  uint8_t scratch[2 * DEDUP_COMPARE_SIZE];
+  uint8_t* buf = nar->buffer;
+  uint32_t half = nar->buffer_size / 2;
+  uint64_t offset;
+  uint64_t n;
+  int ret;
+
+  /* libnar_set_write_buffer may have left a buffer of a few bytes */
+  if (half < DEDUP_COMPARE_SIZE) {
+    buf = scratch;
+    half = DEDUP_COMPARE_SIZE;
+  }
+
+  for (offset = 0; offset < length; offset += n) {
+    n = (length - offset > half) ? half : length - offset;
+    ret = read_at(nar->io, nar->io_opaque, &nar->stats, buf, n, a + offset);
+    if (ret == 0) {
+      ret = read_at(nar->io, nar->io_opaque, &nar->stats, &buf[half], n,
+                    b + offset);
+    }
+    if (ret != 0) {
+      return ret;
+    }
+    if (memcmp(buf, &buf[half], n)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+** look for an earlier item with the content of the item just appended at
+** position. Returns its offset, 0 if none or -errno.
+*/
+static int64_t dedup_find(nar_writer* nar, uint64_t const hash,
+                          uint64_t const position, item_header const* ih)
+{
+  nar_dedup* dedup = nar->dedup;
+  uint64_t mask = dedup->slots_length - 1;
+  uint64_t content2;
+  uint64_t slot;
+  int ret;
+
+  if (dedup->slots_length == 0) {
+    return 0;
+  }
+
+  content2 = position + sizeof(item_header) + ROUNDUP64(ih->length1);
+  for (slot = hash & mask; dedup->slots[slot] != 0; slot = (slot + 1) & mask) {
+    dedup_entry const* entry = &dedup->entries[dedup->slots[slot] - 1];
+
+    if (entry->hash != hash || entry->length2 != ih->length2
+        || entry->flags != (ih->flags & DEDUP_FLAGS)) {
+      continue;
+    }
+
+    ret = dedup_compare(nar, entry->content2, content2, ih->length2);
+    if (ret != 0) {
+      return (ret < 0) ? ret : (int64_t) entry->offset;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** replace the item just appended at position with a reference to an earlier
+** item of the same content (see libnar_set_dedup), ih is then the header of
+** the reference. If hashed is set, hash is the one of its content2. Returns
+** 1 if it is replaced, 0 if not or -errno.
+*/
+static int dedup_item(nar_writer* nar, uint64_t const position,
+                      item_header* ih, char const* filepath,
+                      int const hashed, uint64_t hash)
+{
+  item_reference reference;
+  item_checksum checksum;
+  item_header rh;
+  xxh64_state s;
+  int64_t ret;
+
+  if (nar->dedup == NULL || IS_ENCRYPTED(ih->flags) || IS_REFERENCE(ih->flags)
+      || ih->length2 <= sizeof(item_reference)) {
+    return 0;
+  }
+
+  if (!hashed) {
+    xxh64_init(&s);
+    ret = read_back(nar, position + sizeof(item_header) + ROUNDUP64(ih->length1),
+                    ih->length2, &s, NULL, NULL);
+    if (ret != 0) {
+      return ret;
+    }
+    hash = xxh64_digest(&s);
+  }
+
+  ret = dedup_find(nar, hash, position, ih);
+  if (ret <= 0) {
+    return (ret == 0) ? dedup_append(nar->dedup, hash, position, ih) : ret;
+  }
+  reference.offset = ret;
+
+  /* the reference is written over the item */
+  memset(&rh, 0, sizeof(item_header));
+  memcpy(&rh.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
+  rh.flags = (ih->flags & (FILE_EXECUTABLE | FILE_CHECKSUM)) | FILE_REFERENCE;
+  rh.length1 = ih->length1;
+  rh.length2 = sizeof(item_reference);
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, position, SEEK_SET);
+  if (ret < 0) {
+    DPRINTF("lseek errno(%d): %s", (int) -ret, strerror(-ret));
+    return ret;
+  }
+  ret = write_item_header(nar, &rh, filepath);
+  if (ret == 0) {
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, &reference,
+                    sizeof(item_reference));
+  }
+  if (ret == 0 && IS_CHECKSUM(rh.flags)) {
+    memset(&checksum, 0, sizeof(item_checksum));
+    checksum.crc32c = crc32c(crc32c(0, (uint8_t const*)filepath, rh.length1),
+                             (uint8_t const*)&reference, sizeof(item_reference));
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, &checksum,
+                    sizeof(item_checksum));
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  nar->offset = position + item_length(&rh);
+  nar->stats.syscalls++;
+  ret = nar->io->truncate(nar->io_opaque, nar->offset);
+  if (ret != 0) {
+    DPRINTF("ftruncate errno(%d): %s", (int) -ret, strerror(-ret));
+    return ret;
+  }
+  *ih = rh;
+
+  return 1;
+}
+
+/*
+** the item just appended at position is complete: deduplicate it (see
+** dedup_item), add its digest to the tree and index it. If the tree is
+** maintained, sha holds its content1 and its content2.
+*/
+static int append_done(nar_writer* nar, uint64_t const position,
+                       item_header const* ih, char const* filepath,
+                       int const hashed, uint64_t hash, sha256_state* sha)
+{
+  uint8_t digest[NAR_DIGEST_SIZE];
+  item_header fh = *ih;
+  int ret;
+
+  ret = dedup_item(nar, position, &fh, filepath, hashed, hash);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (nar->tree != NULL) {
+    if (ret == 1) {
+      /* the digest is the one of the reference */
+      ret = read_back_digest(nar, position, &fh, filepath, digest);
+    } else {
+      item_digest(sha, &fh, digest);
+    }
+    if (ret == 0) {
+      ret = tree_push(nar->tree, position, digest);
+    }
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  return index_append(&nar->index, position, &fh, filepath);
+}
+
+/*
+** stream the content of callback encrypted (see cipher_write): callback,
+** opaque and length are replaced by the ones of the encrypted content
+*/
+static int encrypt_begin(nar_writer* nar, get_computed_content* callback,
+                         void** opaque, uint64_t* length)
+{
+  nar_cipher* c = nar->cipher;
+  cipher_header ch;
+  int ret;
+
+  memset(&ch, 0, sizeof(cipher_header));
+  ch.chunk_size = NAR_CIPHER_CHUNK_SIZE;
+  c->key = nar->key;
+  if (cipher_salt(ch.salt, sizeof(ch.salt)) != 0) {
+    DPRINTF("can't draw the salt of the item");
+    return -1;
+  }
+  ret = cipher_begin(c, &ch, 0, 1);
+  if (ret != 0) {
+    return ret;
+  }
+
+  /* the cipher_header comes first */
+  memcpy(c->data, &ch, sizeof(cipher_header));
+  c->data_length = sizeof(cipher_header);
+  c->callback = *callback;
+  c->opaque = *opaque;
+  c->remaining = *length;
+  c->ended = 0;
+
+  *callback = cipher_write;
+  *opaque = c;
+  if (*length != NAR_UNKNOWN_LENGTH) {
+    *length = cipher_length(*length, ch.chunk_size);
+  }
+
+  return 0;
+}
+
+static int append_file(nar_writer* nar, uint64_t flags,
+                       char const* filepath, uint64_t const length_filepath,
+                       uint64_t length_content,
+                       get_computed_content callback, void* opaque)
+{
+  item_header pfh;
+  item_checksum checksum;
+  struct iovec iov[6];
+  xxh64_state hash;
+  sha256_state sha;
+  uint64_t length;
+  uint64_t offset;
+  uint64_t position;
+  uint64_t start;
+  uint64_t max;
+  int ret;
+  int end = 0;
+  int n;
+
+  if (nar == NULL || filepath == NULL || nar->io == NULL) {
+    DPRINTF("nar(%p) filepath(%p)", nar, filepath);
+    return -1;
+  }
+
+  if (nar->buffer == NULL) {
+    ret = libnar_set_write_buffer(nar, LIBNAR_WRITE_BUFFER_SIZE);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  ret = writer_position(nar, &position);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (nar->key != NULL) {
+    ret = encrypt_begin(nar, &callback, &opaque, &length_content);
+    if (ret != 0) {
+      return ret;
+    }
+    flags |= FILE_ENCRYPTED;
+  }
+
+  memset(&pfh, 0, sizeof(item_header));
+  memcpy(&pfh.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
+  pfh.flags = (nar->checksum) ? flags | FILE_CHECKSUM : flags;
+  pfh.length1 = length_filepath;
+  pfh.length2 = length_content;
+
+  memset(&checksum, 0, sizeof(item_checksum));
+  if (IS_CHECKSUM(pfh.flags)) {
+    checksum.crc32c = crc32c(0, (uint8_t const*)filepath, length_filepath);
+  }
+  sha256_init(&sha);
+  if (nar->tree != NULL) {
+    sha256_update(&sha, (uint8_t const*)filepath, length_filepath);
+  }
+
+  /* the item header is written with the first chunk (even if empty) */
+  offset = 0;
+  xxh64_init(&hash);
+  do {
+    /* fill the buffer as much as possible before writing it */
+    for (length = 0;
+         length < nar->buffer_size && offset + length != length_content;
+         length += ret) {
+      max = nar->buffer_size - length;
+      if (length_content - offset - length < max) {
+        max = length_content - offset - length;
+      }
+      start = stats_clock();
+      ret = callback(opaque, &nar->buffer[length], max);
+      nar->stats.callback_time += stats_clock() - start;
+      if (ret < 0) {
+        /* the callback may not set errno: it is still an error */
+        DPRINTF("callback errno(%d): %s", errno, strerror(errno));
+        return (errno) ? -errno : -1;
+      }
+      if (ret == 0) {
+        end = 1;
+        break;
+      }
+    }
+
+    if (nar->dedup != NULL) {
+      xxh64_update(&hash, nar->buffer, length);
+    }
+    if (IS_CHECKSUM(pfh.flags)) {
+      checksum.crc32c = crc32c(checksum.crc32c, nar->buffer, length);
+    }
+    if (nar->tree != NULL) {
+      sha256_update(&sha, nar->buffer, length);
+    }
+
+    n = 0;
+    if (offset == 0) {
+      /* the whole content is in the buffer: its length is known */
+      if (end || offset + length == length_content) {
+        pfh.length2 = length;
+      }
+      iov[n].iov_base = &pfh;
+      iov[n++].iov_len = sizeof(item_header);
+      iov[n].iov_base = (void*)filepath;
+      iov[n++].iov_len = pfh.length1;
+      iov[n].iov_base = (void*)padding;
+      iov[n++].iov_len = ROUNDUP64(pfh.length1) - pfh.length1;
+      nar->stats.padding += ROUNDUP64(pfh.length1) - pfh.length1;
+    }
+    iov[n].iov_base = nar->buffer;
+    iov[n++].iov_len = length;
+    if (end || offset + length == length_content) {
+      /* the last chunk: add the padding (and the checksum) */
+      iov[n].iov_base = (void*)padding;
+      iov[n++].iov_len = ROUNDUP64(offset + length) - (offset + length);
+      nar->stats.padding += ROUNDUP64(offset + length) - (offset + length);
+      if (IS_CHECKSUM(pfh.flags)) {
+        iov[n].iov_base = &checksum;
+        iov[n++].iov_len = sizeof(item_checksum);
+      }
+    }
+    ret = write_vector(nar, iov, n);
+    if (ret != 0) {
+      return ret;
+    }
+    offset += length;
+  } while (!end && offset != length_content);
+
+  if (pfh.length2 != offset) {
+    /* the length was unknown (or wrong): patch the item header */
+    pfh.length2 = offset;
+    ret = nar->io->pwrite(nar->io_opaque, &pfh.length2, sizeof(uint64_t),
+                          position + offsetof(item_header, length2));
+    stats_write(&nar->stats, ret);
+    if (ret != sizeof(uint64_t)) {
+      DPRINTF("can't patch the length of %.*s: errno(%d): %s",
+              (int) length_filepath, filepath, -ret, strerror(-ret));
+      return (ret < 0) ? ret : -1;
+    }
+  }
+
+  nar->offset = position + item_length(&pfh);
+  if (IS_COMPRESSED(pfh.flags)) {
+    nar->stats.compression_out += pfh.length2;
+  }
+
+  return append_done(nar, position, &pfh, filepath, 1, xxh64_digest(&hash),
+                     &sha);
+}
+
+/*
+** copy length bytes from src_fd (from *src_offset, or from its current offset
+** if src_offset is NULL) to the current offset of dst_fd. The copy is done
+** by the kernel when possible (copy_file_range between files, sendfile from
+** a file, splice from or to a pipe), else through the given buffer. The
+** syscalls are counted in stats (if not NULL), the bytes by the caller.
+**
+** @return the number of bytes copied (less than length if src_fd reached its
+** end) or -errno.
+*/
+static int64_t copy_fd(int src_fd, off64_t* src_offset, int dst_fd,
+                       uint64_t const length,
+                       uint8_t* buffer, uint32_t const size, nar_stats* stats)
+{
+  uint64_t offset = 0;
+  ssize_t ret;
+
+#if defined(__linux__)
+  enum { COPY_FILE_RANGE, SENDFILE, SPLICE, BUFFERED } mode;
+
+  for (mode = COPY_FILE_RANGE; mode != BUFFERED && offset < length; ) {
+    size_t count = (length - offset > 0x40000000) ? 0x40000000 : length - offset;
+
+    switch (mode) {
+    case COPY_FILE_RANGE:
+      ret = copy_file_range(src_fd, src_offset, dst_fd, NULL, count, 0);
+      break;
+    case SENDFILE:
+      ret = sendfile64(dst_fd, src_fd, src_offset, count);
+      break;
+    case SPLICE:
+    default:
+      ret = splice(src_fd, src_offset, dst_fd, NULL, count, SPLICE_F_MORE);
+      break;
+    }
+    if (stats != NULL) {
+      stats->syscalls++;
+    }
+
+    if (ret == -1) {
+      switch (errno) {
+      case EINTR:
+      case EAGAIN:
+        break;
+      case EXDEV:
+      case EINVAL:
+      case ENOSYS:
+      case EOPNOTSUPP:
+      case EBADF:
+      case ESPIPE:
+        /* not supported by these file descriptors: try the next method */
+        DPRINTF("copy mode %d errno(%d): %s", mode, errno, strerror(errno));
+        mode++;
+        break;
+      default:
+        DPRINTF("copy errno(%d): %s", errno, strerror(errno));
+        return -errno;
+      }
+      continue;
+    }
+    if (ret == 0) {
+      return offset;
+    }
+    offset += ret;
+  }
+#endif
+
+  while (offset < length) {
+    size_t count = (length - offset > size) ? size : length - offset;
+
+    if (src_offset != NULL) {
+      ret = pread(src_fd, buffer, count, *src_offset);
+    } else {
+      ret = read(src_fd, buffer, count);
+    }
+    if (stats != NULL) {
+      stats->syscalls += (ret > 0) ? 2 : 1;
+    }
+    if (ret == -1) {
+      DPRINTF("read errno(%d): %s", errno, strerror(errno));
+      return -errno;
+    }
+    if (ret == 0) {
+      break;
+    }
+    if (write_buffer(dst_fd, buffer, ret) == -1) {
+      return -errno;
+    }
+    if (src_offset != NULL) {
+      *src_offset += ret;
+    }
+    offset += ret;
+  }
+
+  return offset;
+}
+
+/*
+** copy length bytes from src_fd to a writer which is not a file descriptor
+*/
+static int64_t copy_to_writer(nar_writer* nar, int src_fd, uint64_t const length)
+{
+  uint64_t offset = 0;
+  ssize_t ret;
+
+  while (offset < length) {
+    size_t count = (length - offset > nar->buffer_size)
+                 ? nar->buffer_size : length - offset;
+
+    ret = read(src_fd, nar->buffer, count);
+    if (ret == -1) {
+      DPRINTF("read errno(%d): %s", errno, strerror(errno));
+      return -errno;
+    }
+    if (ret == 0) {
+      break;
+    }
+    /* a short read is copied as it is, the next one reads the rest */
+    count = ret;
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, nar->buffer, count);
+    if (ret != 0) {
+      return ret;
+    }
+    offset += count;
+  }
+
+  return offset;
+}
+
+/*
+** the get_computed_content of a file descriptor
+*/
+static int read_content(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  ssize_t ret;
+
+  do {
+    ret = read(*(int*)opaque, buf, max);
+  } while (ret == -1 && errno == EINTR);
+
+  return ret;
+}
+
+static int append_file_fd(nar_writer* nar, uint64_t const flags,
+                          char const* filepath, uint64_t const length_filepath,
+                          int src_fd, uint64_t const length_content)
+{
+  item_header pfh;
+  item_checksum checksum;
+  sha256_state sha;
+  uint64_t position;
+  uint64_t start;
+  int64_t length;
+  uint32_t crc;
+  int ret;
+
+  if (nar == NULL || filepath == NULL || src_fd == -1 || nar->io == NULL) {
+    DPRINTF("nar(%p) filepath(%p) src_fd(%d)", nar, filepath, src_fd);
+    return -1;
+  }
+
+  if (nar->key != NULL) {
+    /* the content is encrypted while it is read */
+    return append_file(nar, flags, filepath, length_filepath,
+                       length_content, read_content, &src_fd);
+  }
+
+  if (nar->buffer == NULL) {
+    ret = libnar_set_write_buffer(nar, LIBNAR_WRITE_BUFFER_SIZE);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  ret = writer_position(nar, &position);
+  if (ret != 0) {
+    return ret;
+  }
+
+  memset(&pfh, 0, sizeof(item_header));
+  memcpy(&pfh.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
+  pfh.flags = (nar->checksum) ? flags | FILE_CHECKSUM : flags;
+  pfh.length1 = length_filepath;
+  pfh.length2 = length_content;
+
+  ret = write_item_header(nar, &pfh, filepath);
+  if (ret != 0) {
+    return ret;
+  }
+
+  start = stats_clock();
+  if (nar->io == &libnar_fd_io) {
+    length = copy_fd(src_fd, NULL, IO_FD(nar->io_opaque), length_content,
+                     nar->buffer, nar->buffer_size, &nar->stats);
+    nar->stats.bytes_written += (length > 0) ? length : 0;
+  } else {
+    length = copy_to_writer(nar, src_fd, length_content);
+  }
+  nar->stats.write_time += stats_clock() - start;
+  if (length < 0) {
+    return length;
+  }
+  if ((uint64_t)length != length_content) {
+    /* the file is shorter than said (it shrank): patch the item header */
+    DPRINTF("only %lld bytes on %llu were available",
+            (long long int) length, (unsigned long long int) length_content);
+    pfh.length2 = length;
+    ret = nar->io->pwrite(nar->io_opaque, &pfh.length2, sizeof(uint64_t),
+                          position + offsetof(item_header, length2));
+    stats_write(&nar->stats, ret);
+    if (ret != sizeof(uint64_t)) {
+      DPRINTF("can't patch the length of %.*s: errno(%d): %s",
+              (int) length_filepath, filepath, -ret, strerror(-ret));
+      return (ret < 0) ? ret : -1;
+    }
+  }
+
+  if (length % sizeof(uint64_t)) {
+    nar->stats.padding += sizeof(uint64_t) - (length % sizeof(uint64_t));
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, padding,
+                    sizeof(uint64_t) - (length % sizeof(uint64_t)));
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  sha256_init(&sha);
+  if (IS_CHECKSUM(pfh.flags) || nar->tree != NULL) {
+    /* the content was copied by the kernel: it is read back */
+    crc = crc32c(0, (uint8_t const*)filepath, length_filepath);
+    sha256_update(&sha, (uint8_t const*)filepath, length_filepath);
+    ret = read_back(nar, position + sizeof(item_header)
+                         + ROUNDUP64(length_filepath), length, NULL,
+                    IS_CHECKSUM(pfh.flags) ? &crc : NULL,
+                    (nar->tree != NULL) ? &sha : NULL);
+    if (ret == 0 && IS_CHECKSUM(pfh.flags)) {
+      memset(&checksum, 0, sizeof(item_checksum));
+      checksum.crc32c = crc;
+      ret = write_all(nar->io, nar->io_opaque, &nar->stats, &checksum,
+                      sizeof(item_checksum));
+    }
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  nar->offset = position + sizeof(item_header)
+              + ROUNDUP64(length_filepath) + ROUNDUP64(length)
+              + (IS_CHECKSUM(pfh.flags) ? sizeof(item_checksum) : 0);
+  if (IS_COMPRESSED(pfh.flags)) {
+    nar->stats.compression_out += length;
+  }
+
+  return append_done(nar, position, &pfh, filepath, 0, 0, &sha);
+}
+
+int libnar_append_file(nar_writer* nar, uint64_t flags,
+                       char const* filepath, uint64_t const length_filepath,
+                       uint64_t length_content,
+                       get_computed_content callback, void* opaque)
+{
+  int ret = append_file(nar, flags, filepath, length_filepath, length_content,
+                        callback, opaque);
+
+  if (ret != 0 && nar != NULL && nar->session) {
+    writer_rollback(nar);
+  }
+
+  return ret;
+}
+
+int libnar_append_file_fd(nar_writer* nar, uint64_t const flags,
+                          char const* filepath, uint64_t const length_filepath,
+                          int src_fd, uint64_t const length_content)
+{
+  int ret = append_file_fd(nar, flags, filepath, length_filepath, src_fd,
+                           length_content);
+
+  if (ret != 0 && nar != NULL && nar->session) {
+    writer_rollback(nar);
+  }
+
+  return ret;
+}
+
+int libnar_load_index(nar_writer* nar)
+{
+  nar_header nh;
+  int64_t end;
+  uint64_t position = sizeof(nar_header);
+  uint64_t sign_end = 0;
+  int ret;
+
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_writer(%p) fd(%d)", nar, (nar) ? nar->fd : -1);
+    return -1;
+  }
+
+  stats_seek(&nar->stats);
+  end = nar->io->seek(nar->io_opaque, 0, SEEK_END);
+  if (end < 0) {
+    DPRINTF("lseek errno(%d): %s", (int) -end, strerror(-end));
+    return end;
+  }
+
+  ret = read_at(nar->io, nar->io_opaque, &nar->stats,
+                &nh, sizeof(nar_header), 0);
+  if (ret != 0) {
+    return ret;
+  }
+
+  index_reset(&nar->index);
+  if (nh.index_position != 0) {
+    ret = index_load(nar->io, nar->io_opaque, &nar->stats, nh.index_position,
+                     &nar->index, &position);
+    if (ret != 0) {
+      /* the INDEX is missing or corrupted: rebuild it from the items */
+      DPRINTF("can't load the INDEX: scan all the items");
+      index_reset(&nar->index);
+      nh.index_position = 0;
+      position = sizeof(nar_header);
+    }
+  }
+
+  ret = index_scan(nar->io, nar->io_opaque, &nar->stats, position, end,
+                   &nar->index);
+  if (ret != 0) {
+    index_reset(&nar->index);
+    return ret;
+  }
+
+  if (nh.signature_position != 0) {
+    /* the SIGN item is maintained from now on */
+    if (nar->tree == NULL) {
+      nar->tree = calloc(1, sizeof(nar_tree));
+      if (nar->tree == NULL) {
+        return -ENOMEM;
+      }
+    }
+    tree_reset(nar->tree);
+    ret = tree_load(nar->io, nar->io_opaque, &nar->stats, nh.signature_position,
+                    nar->tree, &sign_end);
+    if (ret != 0) {
+      DPRINTF("can't load the SIGN item: it is dropped");
+      free(nar->tree);
+      nar->tree = NULL;
+      nh.signature_position = 0;
+    }
+  } else if (nar->tree != NULL) {
+    tree_reset(nar->tree);
+  }
+
+  if (nh.index_position != 0 && position == (uint64_t)end) {
+    /* the INDEX is the last item: libnar_write_index will replace it */
+    nar->stats.syscalls++;
+    ret = nar->io->truncate(nar->io_opaque, nh.index_position);
+    if (ret != 0) {
+      DPRINTF("ftruncate errno(%d): %s", -ret, strerror(-ret));
+      return ret;
+    }
+    end = nh.index_position;
+  }
+
+  if (nh.signature_position != 0 && sign_end == (uint64_t)end) {
+    /* and so is the SIGN item just before it (see libnar_write_sign) */
+    nar->stats.syscalls++;
+    ret = nar->io->truncate(nar->io_opaque, nh.signature_position);
+    if (ret != 0) {
+      DPRINTF("ftruncate errno(%d): %s", -ret, strerror(-ret));
+      return ret;
+    }
+    end = nh.signature_position;
+  }
+
+  if (nar->tree != NULL) {
+    ret = tree_sync(nar);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  nar->signature_position = nh.signature_position;
+  nar->index_position = nh.index_position;
+  nar->offset = end;
+
+  return 0;
+}
+
+int libnar_write_sign(nar_writer* nar)
+{
+  uint8_t content1[sizeof(sign_header) + TREE_LEVELS * NAR_DIGEST_SIZE];
+  uint8_t signature[NAR_SIGNATURE_MAX_LENGTH];
+  nar_tree* tree;
+  sign_header sh;
+  item_header ih;
+  uint64_t position;
+  uint32_t length;
+  int level;
+  int ret;
+
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_writer* nar == NULL");
+    return -1;
+  }
+
+  tree = nar->tree;
+  if (tree == NULL) {
+    return 0;
+  }
+
+  ret = writer_position(nar, &position);
+  if (ret != 0) {
+    return ret;
+  }
+
+  memset(&sh, 0, sizeof(sign_header));
+  sh.leaves = tree->length;
+  frontier_root(tree->frontier, tree->length, sh.root);
+  if (nar->sign != NULL) {
+    length = sizeof(signature);
+    if (nar->sign(nar->sign_opaque, sh.root, signature, &length)
+        || length > sizeof(signature)) {
+      DPRINTF("can't sign the root");
+      return -1;
+    }
+    sh.signature_length = length;
+  }
+
+  memset(&ih, 0, sizeof(item_header));
+  memcpy(&ih.magic, SIGNATURE_HEADER_MAGIC, sizeof(uint64_t));
+  ih.length1 = sizeof(sign_header);
+  memcpy(content1, &sh, sizeof(sign_header));
+  for (level = TREE_LEVELS - 1; level >= 0; level--) {
+    if ((tree->length >> level) & 1) {
+      memcpy(&content1[ih.length1], tree->frontier[level], NAR_DIGEST_SIZE);
+      ih.length1 += NAR_DIGEST_SIZE;
+    }
+  }
+  ih.length2 = tree->length * sizeof(sign_leaf) + sh.signature_length;
+
+  ret = write_item_header(nar, &ih, (char const*)content1);
+  if (ret == 0) {
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, tree->leaves,
+                    tree->length * sizeof(sign_leaf));
+  }
+  if (ret == 0) {
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, signature,
+                    sh.signature_length);
+  }
+  if (ret == 0) {
+    ret = write_all(nar->io, nar->io_opaque, &nar->stats, padding,
+                    ROUNDUP64(ih.length2) - ih.length2);
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  nar->signature_position = position;
+  nar->offset = position + item_length(&ih);
+
+  return 0;
+}
+
+int libnar_write_index(nar_writer* nar)
+{
+  item_header ih;
+  uint8_t* buf;
+  uint64_t i, length, offset;
+  uint64_t position;
+  int ret;
+
+  if (nar == NULL || nar->io == NULL) {
+    DPRINTF("nar_writer* nar == NULL");
+    return -1;
+  }
+
+  ret = writer_position(nar, &position);
+  if (ret != 0) {
+    return ret;
+  }
+
+  memset(&ih, 0, sizeof(item_header));
+  memcpy(&ih.magic, INDEX_HEADER_MAGIC, sizeof(uint64_t));
+  ih.length1 = sizeof(uint64_t);
+  for (i = 0; i < nar->index.length; i++) {
+    ih.length2 += sizeof(index_entry_header)
+                + ROUNDUP64(nar->index.entries[i].length1);
+  }
+
+  length = item_length(&ih);
+  buf = calloc(1, length);
+  if (buf == NULL) {
+    DPRINTF("calloc(%llu) failed", (unsigned long long int) length);
+    return -ENOMEM;
+  }
+
+  memcpy(buf, &ih, sizeof(item_header));
+  offset = sizeof(item_header);
+  memcpy(&buf[offset], &nar->index.length, sizeof(uint64_t));
+  offset += ROUNDUP64(ih.length1);
+
+  for (i = 0; i < nar->index.length; i++) {
+    nar_index_entry const* entry = &nar->index.entries[i];
+    index_entry_header ieh;
+
+    ieh.offset = entry->offset;
+    ieh.flags = entry->flags;
+    ieh.length1 = entry->length1;
+    ieh.length2 = entry->length2;
+    memcpy(&buf[offset], &ieh, sizeof(index_entry_header));
+    offset += sizeof(index_entry_header);
+    memcpy(&buf[offset], &nar->index.strings[entry->filepath], entry->length1);
+    offset += ROUNDUP64(entry->length1);
+  }
+
+  ret = write_all(nar->io, nar->io_opaque, &nar->stats, buf, length);
+  free(buf);
+  if (ret != 0) {
+    return ret;
+  }
+
+  nar->index_position = position;
+  nar->offset = position + length;
+
+  return 0;
+}
+
+int libnar_begin_append(nar_writer* nar, nar_header* nh)
+{
+  nar_header tmp;
+  int64_t offset;
+  int ret;
+
+  if (nar == NULL) {
+    DPRINTF("nar_writer* nar == NULL");
+    return -1;
+  }
+
+  if (nh == NULL) {
+    nh = &tmp;
+  }
+
+  ret = libnar_load_index(nar);
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = read_at(nar->io, nar->io_opaque, &nar->stats, nh, sizeof(nar_header),
+                0);
+  if (ret != 0) {
+    return ret;
+  }
+
+  /* the only seek of the session */
+  stats_seek(&nar->stats);
+  offset = nar->io->seek(nar->io_opaque, nar->offset, SEEK_SET);
+  if (offset < 0) {
+    DPRINTF("lseek errno(%d): %s", (int) -offset, strerror(-offset));
+    return offset;
+  }
+
+  nar->cipher_type = nh->cipher_type;
+  nar->compression_type = nh->compression_type;
+  nar->session = 1;
+
+  return 0;
+}
+
+int libnar_end_append(nar_writer* nar)
+{
+  int ret;
+
+  if (nar == NULL || !nar->session) {
+    DPRINTF("nar_writer(%p) session(%d)", nar, (nar) ? nar->session : 0);
+    return -1;
+  }
+
+  ret = libnar_write_sign(nar);
+  if (ret == 0) {
+    ret = libnar_write_index(nar);
+  }
+  nar->session = 0;
+  if (ret != 0) {
+    return ret;
+  }
+
+  return libnar_write_nar_header(nar, nar->cipher_type, nar->compression_type);
+}
+
+/*
+** ------------- DECODER -----------------------------------------------------
+*/
+
+# define DECODER_BUFFER_SIZE (64 * 1024)
+
+/*
+** the decoder state of a reader: allocated once and reset for each item
+*/
+typedef struct {
+  uint64_t compression_type;
+  z_stream strm;
+#if defined(HAVE_ZSTD)
+  ZSTD_DCtx* zstd;
+#endif
+#if defined(HAVE_LZ4)
+  LZ4F_dctx* lz4;
+#endif
+
+  uint64_t item_position;
+  int ended;
+
+  /* FILE_BLOCKS: a block_header comes before each stream */
+  int blocks;
+  int next_block;
+
+  /* the stats of the reader (compression_in/out), NULL if none */
+  nar_stats* stats;
+
+  /* what is not decoded yet: in[in_offset, in_length[ */
+  uint32_t in_offset;
+  uint32_t in_length;
+  uint8_t in[DECODER_BUFFER_SIZE];
+} nar_decoder;
+
+static void decoder_close(nar_decoder* d)
+{
+  if (d != NULL) {
+    switch (d->compression_type) {
+    case COMPRESSION_DEFLATE:
+      inflateEnd(&d->strm);
+      break;
+#if defined(HAVE_ZSTD)
+    case COMPRESSION_ZSTD:
+      ZSTD_freeDCtx(d->zstd);
+      break;
+#endif
+#if defined(HAVE_LZ4)
+    case COMPRESSION_LZ4:
+      LZ4F_freeDecompressionContext(d->lz4);
+      break;
+#endif
+    default:
+      break;
+    }
+    free(d);
+  }
+}
+
+static nar_decoder* decoder_open(uint64_t const compression_type)
+{
+  nar_decoder* d;
+  int ret = -1;
+
+  d = calloc(1, sizeof(nar_decoder));
+  if (d == NULL) {
+    return NULL;
+  }
+  d->compression_type = compression_type;
+
+  switch (compression_type) {
+  case COMPRESSION_DEFLATE:
+    ret = (inflateInit(&d->strm) == Z_OK) ? 0 : -1;
+    break;
+#if defined(HAVE_ZSTD)
+  case COMPRESSION_ZSTD:
+    d->zstd = ZSTD_createDCtx();
+    if (d->zstd != NULL) {
+      /* the items compressed with a long window too */
+      ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+
+      if (!ZSTD_isError(bounds.error)) {
+        ZSTD_DCtx_setParameter(d->zstd, ZSTD_d_windowLogMax,
+                               bounds.upperBound);
+      }
+      ret = 0;
+    }
+    break;
+#endif
+#if defined(HAVE_LZ4)
+  case COMPRESSION_LZ4:
+    ret = (LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION)))
+        ? -1 : 0;
+    break;
+#endif
+  default:
+    DPRINTF("compression type not supported %llu",
+            (unsigned long long int) compression_type);
+    free(d);
+    return NULL;
+  }
+
+  if (ret != 0) {
+    DPRINTF("can't create the decoder %llu",
+            (unsigned long long int) compression_type);
+    d->compression_type = COMPRESSION_NONE;
+    decoder_close(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+/*
+** the decoder of the archive may fill its buffer from a reader or from
+** positional reads (see positional_input)
+*/
+typedef int (*decoder_input)(void* opaque, uint8_t* buf, uint32_t const max);
+
+/*
+** start a new stream (of the same item)
+*/
+static void decoder_restart(nar_decoder* d)
+{
+  switch (d->compression_type) {
+  case COMPRESSION_DEFLATE:
+    inflateReset(&d->strm);
+    break;
+#if defined(HAVE_ZSTD)
+  case COMPRESSION_ZSTD:
+    ZSTD_DCtx_reset(d->zstd, ZSTD_reset_session_only);
+    break;
+#endif
+#if defined(HAVE_LZ4)
+  case COMPRESSION_LZ4:
+    LZ4F_resetDecompressionContext(d->lz4);
+    break;
+#endif
+  default:
+    break;
+  }
+  d->ended = 0;
+}
+
+static void decoder_reset(nar_decoder* d, uint64_t const item_position,
+                          uint64_t const flags)
+{
+  decoder_restart(d);
+  d->in_offset = 0;
+  d->in_length = 0;
+  d->item_position = item_position;
+  d->blocks = IS_BLOCKS(flags) ? 1 : 0;
+  d->next_block = d->blocks;
+}
+
+/*
+** decode what is in d->in into out. *length is set to the number of bytes
+** written in out. Returns 0, or -1 if the content is corrupted.
+*/
+static int decoder_decode(nar_decoder* d, uint8_t* out, uint64_t const size,
+                          uint64_t* length)
+{
+  uint8_t* in = &d->in[d->in_offset];
+  size_t available = d->in_length - d->in_offset;
+  int ret;
+
+  *length = 0;
+
+  switch (d->compression_type) {
+  case COMPRESSION_DEFLATE:
+    d->strm.next_in = in;
+    d->strm.avail_in = available;
+    d->strm.next_out = out;
+    d->strm.avail_out = (size > UINT32_MAX) ? UINT32_MAX : size;
+    ret = inflate(&d->strm, Z_NO_FLUSH);
+    d->in_offset += available - d->strm.avail_in;
+    *length = d->strm.next_out - out;
+    switch (ret) {
+    case Z_STREAM_END:
+      d->ended = 1;
+      /* fallthrough */
+    case Z_OK:
+    case Z_BUF_ERROR:
+      return 0;
+    default:
+      DPRINTF("inflate(%d): %s", ret, (d->strm.msg) ? d->strm.msg : "error");
+      return -1;
+    }
+#if defined(HAVE_ZSTD)
+  case COMPRESSION_ZSTD:
+    {
+      ZSTD_inBuffer input = { in, available, 0 };
+      ZSTD_outBuffer output = { out, size, 0 };
+      size_t hint;
+
+      hint = ZSTD_decompressStream(d->zstd, &output, &input);
+      if (ZSTD_isError(hint)) {
+        DPRINTF("zstd: %s", ZSTD_getErrorName(hint));
+        return -1;
+      }
+      d->in_offset += input.pos;
+      *length = output.pos;
+      /* the frame is complete and flushed */
+      d->ended = (hint == 0);
+      return 0;
+    }
+#endif
+#if defined(HAVE_LZ4)
+  case COMPRESSION_LZ4:
+    {
+      size_t in_size = available;
+      size_t out_size = size;
+      size_t hint;
+
+      hint = LZ4F_decompress(d->lz4, out, &out_size, in, &in_size, NULL);
+      if (LZ4F_isError(hint)) {
+        DPRINTF("lz4: %s", LZ4F_getErrorName(hint));
+        return -1;
+      }
+      d->in_offset += in_size;
+      *length = out_size;
+      d->ended = (hint == 0);
+      return 0;
+    }
+#endif
+  default:
+    return -1;
+  }
+}
+
+/*
+** make sure d->in holds at least needed bytes not decoded yet
+*/
+static int decoder_fill(nar_decoder* d, decoder_input input, void* opaque,
+                        uint32_t const needed)
+{
+  int ret;
+
+  while (d->in_length - d->in_offset < needed) {
+    if (d->in_offset > 0) {
+      memmove(d->in, &d->in[d->in_offset], d->in_length - d->in_offset);
+      d->in_length -= d->in_offset;
+      d->in_offset = 0;
+    }
+
+    ret = input(opaque, &d->in[d->in_length], sizeof(d->in) - d->in_length);
+    if (ret < 0) {
+      return ret;
+    }
+    if (ret == 0) {
+      DPRINTF("the compressed content ends before the stream");
+      return -1;
+    }
+    d->in_length += ret;
+  }
+
+  return 0;
+}
+
+/*
+** decode up to size bytes of the item in out, the compressed content is
+** given by input. Returns the number of bytes decoded (size unless the item
+** ends), -1 or -errno on error.
+*/
+static int decoder_read(nar_decoder* d, decoder_input input, void* opaque,
+                        uint8_t* out, uint32_t const size)
+{
+  block_header bh;
+  uint64_t have = 0;
+  uint64_t length;
+  uint32_t in;
+  int ret;
+
+  while (have < size && !d->ended) {
+    if (d->next_block) {
+      ret = decoder_fill(d, input, opaque, sizeof(block_header));
+      if (ret != 0) {
+        return ret;
+      }
+      memcpy(&bh, &d->in[d->in_offset], sizeof(block_header));
+      d->in_offset += sizeof(block_header);
+      if (bh.length == 0) {
+        /* the end of the blocks, the block table is not needed */
+        d->ended = 1;
+        break;
+      }
+      decoder_restart(d);
+      d->next_block = 0;
+      continue;
+    }
+
+    ret = decoder_fill(d, input, opaque, 1);
+    if (ret != 0) {
+      return ret;
+    }
+    in = d->in_offset;
+    if (decoder_decode(d, &out[have], size - have, &length) != 0) {
+      return -1;
+    }
+    if (d->stats != NULL) {
+      d->stats->compression_in += d->in_offset - in;
+      d->stats->compression_out += length;
+    }
+    have += length;
+
+    if (d->ended && d->blocks) {
+      d->ended = 0;
+      d->next_block = 1;
+    }
+  }
+
+  return have;
+}
+
+/*
+** a decoder_input of positional reads: [position, position + remaining[ of
+** the mapping if any, of the I/O backend otherwise. With a cipher, it is the
+** range of the decrypted content2 of its item (see cipher_attach).
+*/
+typedef struct {
+  nar_io const* io;
+  void* opaque;
+  uint8_t const* map;
+  uint64_t map_length;
+  nar_cipher* cipher;
+  /* the stats of the reader, NULL if none */
+  nar_stats* stats;
+
+  uint64_t position;
+  uint64_t remaining;
+} positional_input;
+
+/*
+** read length bytes at position, as they are stored
+*/
+static int positional_fetch(positional_input* pi, void* buf,
+                            uint32_t const length, uint64_t const position)
+{
+  if (pi->map != NULL) {
+    if (position > pi->map_length || length > pi->map_length - position) {
+      DPRINTF("0x%016llx is out of the mapping",
+              (unsigned long long int) position);
+      return -1;
+    }
+    memcpy(buf, &pi->map[position], length);
+    if (pi->stats != NULL) {
+      pi->stats->bytes_read += length;
+    }
+    return 0;
+  }
+
+  return read_at(pi->io, pi->opaque, pi->stats, buf, length, position);
+}
+
+/*
+** start the reads of the FILE_ENCRYPTED item at item_position: its cipher
+** state is kept in *cipher (for the next reads of the same item). *content2
+** and *length2 are then the range of the decrypted content2 for pi.
+*/
+static int cipher_attach(nar_cipher** cipher, nar_key const* key,
+                         positional_input* pi, uint64_t const item_position,
+                         uint64_t* content2, uint64_t* length2)
+{
+  cipher_header ch;
+  nar_cipher* c;
+  int ret;
+
+  if (key == NULL) {
+    DPRINTF("no key to decrypt the item at 0x%016llx",
+            (unsigned long long int) item_position);
+    return -ENOKEY;
+  }
+
+  if (*cipher == NULL) {
+    *cipher = cipher_open();
+    if (*cipher == NULL) {
+      return -ENOMEM;
+    }
+  }
+  c = *cipher;
+
+  if (c->item_position != item_position || c->key != key
+      || c->chunk_size == 0) {
+    c->item_position = 0;
+    c->key = key;
+    if (*length2 < sizeof(cipher_header)
+        || positional_fetch(pi, &ch, sizeof(cipher_header), *content2)) {
+      DPRINTF("can't read the cipher header");
+      return -1;
+    }
+    ret = cipher_begin(c, &ch, *length2, 0);
+    if (ret != 0) {
+      c->chunk_size = 0;
+      return ret;
+    }
+    c->content2 = *content2 + sizeof(cipher_header);
+    c->item_position = item_position;
+  }
+
+  pi->cipher = c;
+  *content2 = 0;
+  *length2 = c->length;
+
+  return 0;
+}
+
+/*
+** decrypt the chunk i in c->data: it is read in c->data and decrypted in
+** place (from the mapping straight to c->data)
+*/
+static int cipher_load(nar_cipher* c, positional_input* pi, uint64_t const i)
+{
+  uint32_t length = cipher_chunk_length(c, i);
+  uint64_t position = c->content2
+                    + i * (c->chunk_size + NAR_CIPHER_TAG_SIZE);
+  uint8_t const* in = c->data;
+  int ret;
+
+  c->chunk = UINT64_MAX;
+  if (pi->map != NULL) {
+    if (position > pi->map_length
+        || length + NAR_CIPHER_TAG_SIZE > pi->map_length - position) {
+      DPRINTF("0x%016llx is out of the mapping",
+              (unsigned long long int) position);
+      return -1;
+    }
+    in = &pi->map[position];
+    memcpy(c->tag, &in[length], NAR_CIPHER_TAG_SIZE);
+    if (pi->stats != NULL) {
+      pi->stats->bytes_read += length + NAR_CIPHER_TAG_SIZE;
+    }
+  } else {
+    ret = read_at(pi->io, pi->opaque, pi->stats, c->data,
+                  length + NAR_CIPHER_TAG_SIZE, position);
+    if (ret != 0) {
+      return ret;
+    }
+    memcpy(c->tag, &c->data[length], NAR_CIPHER_TAG_SIZE);
+  }
+
+  ret = cipher_chunk(c, i, in, c->data, length, c->tag);
+  if (ret != 0) {
+    return ret;
+  }
+  c->chunk = i;
+  c->data_length = length;
+
+  return 0;
+}
+
+/*
+** read [offset, offset + length[ of the decrypted content2: only the chunks
+** holding it are decrypted
+*/
+static int cipher_pread(nar_cipher* c, positional_input* pi, uint8_t* buf,
+                        uint32_t const length, uint64_t const offset)
+{
+  uint32_t have;
+  uint64_t in;
+  uint64_t i;
+  int ret;
+
+  for (have = 0; have < length; have += i) {
+    i = (offset + have) / c->chunk_size;
+    if (i >= c->chunks) {
+      DPRINTF("0x%016llx is out of the encrypted item",
+              (unsigned long long int) (offset + have));
+      return -1;
+    }
+    if (c->chunk != i) {
+      ret = cipher_load(c, pi, i);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+
+    in = offset + have - i * c->chunk_size;
+    if (in >= c->data_length) {
+      DPRINTF("0x%016llx is out of the encrypted item",
+              (unsigned long long int) (offset + have));
+      return -1;
+    }
+    i = c->data_length - in;
+    if (i > length - have) {
+      i = length - have;
+    }
+    memcpy(&buf[have], &c->data[in], i);
+  }
+
+  return 0;
+}
+
+static int positional_read(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  positional_input* pi = opaque;
+  uint32_t length;
+  int ret;
+
+  length = (pi->remaining > max) ? max : pi->remaining;
+  if (pi->cipher != NULL) {
+    ret = cipher_pread(pi->cipher, pi, buf, length, pi->position);
+  } else {
+    ret = positional_fetch(pi, buf, length, pi->position);
+  }
+  if (ret != 0) {
+    return ret;
+  }
+  pi->position += length;
+  pi->remaining -= length;
+
+  return length;
+}
+
+/*
+** read exactly size bytes at position
+*/
+static int positional_read_at(positional_input* pi, void* buf,
+                              uint32_t const size, uint64_t const position)
+{
+  pi->position = position;
+  pi->remaining = size;
+
+  return (positional_read(pi, buf, size) == (int) size) ? 0 : -1;
+}
+
+/*
+** read the FILE_REFERENCE item at position: *target is set to the offset of
+** its original item and th to the original item header
+*/
+static int reference_target(positional_input* pi, uint64_t const position,
+                            item_header const* ih,
+                            uint64_t* target, item_header* th)
+{
+  item_reference reference;
+
+  if (ih->length2 != sizeof(item_reference)
+      || positional_read_at(pi, &reference, sizeof(item_reference),
+                            position + sizeof(item_header)
+                            + ROUNDUP64(ih->length1))
+      || reference.offset >= position
+      || positional_read_at(pi, th, sizeof(item_header), reference.offset)
+      || memcmp(&th->magic, FILE_HEADER_MAGIC, sizeof(uint64_t))
+      || IS_REFERENCE(th->flags) || IS_ENCRYPTED(th->flags)) {
+    DPRINTF("can't resolve the reference at 0x%016llx",
+            (unsigned long long int) position);
+    return -1;
+  }
+
+  *target = reference.offset;
+  return 0;
+}
+
+/*
+** the original item of the current FILE_REFERENCE item of a reader: it is
+** read with positional reads, the reader stays after the reference
+*/
+typedef struct {
+  uint64_t item_position;
+  uint64_t position;
+  item_header header;
+  positional_input pi;
+  nar_decoder* decoder;
+} nar_reference;
+
+/*
+** the block table of a FILE_BLOCKS item and its last block decoded
+*/
+typedef struct {
+  uint64_t item_position;
+  uint64_t content2;
+  uint64_t length2;
+  uint64_t block_size;
+  uint64_t blocks;
+  uint64_t* offsets;
+  /* the uncompressed length of the item */
+  uint64_t length;
+
+  uint64_t block;
+  uint8_t* data;
+  uint32_t data_length;
+  uint32_t data_capacity;
+  nar_decoder* decoder;
+
+  /* the cipher state of the last FILE_ENCRYPTED item read */
+  nar_cipher* cipher;
+} nar_blocks;
+
+static void blocks_reset(nar_blocks* b)
+{
+  if (b != NULL) {
+    free(b->offsets);
+    free(b->data);
+    decoder_close(b->decoder);
+    cipher_close(b->cipher);
+    memset(b, 0, sizeof(nar_blocks));
+  }
+}
+
+/*
+** ------------- READER ------------------------------------------------------
+*/
+
+/*
+** read length bytes at the current position of the reader. Returns the number
+** of bytes read (less than length at the end of the archive) or -errno.
+*/
+static int64_t reader_read(nar_reader* nar, uint8_t* buf, uint64_t const length)
+{
+  uint64_t i, available;
+  int ret;
+
+  if (nar->map != NULL) {
+    i = (nar->position < nar->map_length) ? nar->map_length - nar->position : 0;
+    i = (length > i) ? i : length;
+    memcpy(buf, &nar->map[nar->position], i);
+    nar->position += i;
+    nar->stats.bytes_read += i;
+    return i;
+  }
+
+  for (i = 0; i < length; i += ret) {
+    if (nar->buffer != NULL) {
+      available = nar->buffer_length - nar->buffer_offset;
+
+      if (available == 0 && length - i < nar->buffer_size) {
+        /* refill the read-ahead buffer */
+        ret = nar->io->read(nar->io_opaque, nar->buffer, nar->buffer_size);
+        stats_read(&nar->stats, ret);
+        if (ret < 0) {
+          DPRINTF("read errno(%d): %s", -ret, strerror(-ret));
+          return ret;
+        }
+        if (ret == 0) {
+          break;
+        }
+        nar->buffer_offset = 0;
+        nar->buffer_length = ret;
+        available = ret;
+      }
+
+      if (available != 0) {
+        ret = (length - i > available) ? available : length - i;
+        memcpy(&buf[i], &nar->buffer[nar->buffer_offset], ret);
+        nar->buffer_offset += ret;
+        nar->position += ret;
+        continue;
+      }
+      /* what is left to read is bigger than the buffer: read it directly */
+    }
+
+    ret = nar->io->read(nar->io_opaque, &buf[i], length - i);
+    stats_read(&nar->stats, ret);
+    if (ret < 0) {
+      DPRINTF("read errno(%d): %s", -ret, strerror(-ret));
+      return ret;
+    }
+    if (ret == 0) {
+      break;
+    }
+    nar->position += ret;
+  }
+
+  return i;
+}
+
+/*
+** skip length bytes from the current position of the reader
+*/
+static int reader_skip(nar_reader* nar, uint64_t length)
+{
+  uint8_t tmp[256];
+  uint64_t i, available;
+  int64_t ret;
+
+  if (nar->map != NULL) {
+    nar->position += length;
+    return 0;
+  }
+
+  if (nar->buffer != NULL) {
+    available = nar->buffer_length - nar->buffer_offset;
+    if (length <= available) {
+      nar->buffer_offset += length;
+      nar->position += length;
+      return 0;
+    }
+
+    /* the file offset is already after the buffered bytes */
+    nar->buffer_offset = nar->buffer_length = 0;
+    nar->position += available;
+    length -= available;
+  }
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, length, SEEK_CUR);
+  if (ret >= 0) {
+    nar->position += length;
+    return 0;
+  }
+
+  if (ret != -ESPIPE) {
+    DPRINTF("lseek errno(%d): %s", (int) -ret, strerror(-ret));
+    return ret;
+  }
+
+  /* a pipe or a socket: we can only drop what we read (the read-ahead
+  ** buffer is empty at this point: use it if any) */
+  for (i = 0; i < length; i += ret) {
+    uint8_t* drop = (nar->buffer) ? nar->buffer : tmp;
+    uint64_t size = (nar->buffer) ? nar->buffer_size : sizeof(tmp);
+
+    ret = nar->io->read(nar->io_opaque, drop,
+                        (length - i > size) ? size : length - i);
+    stats_read(&nar->stats, ret);
+    if (ret < 0) {
+      DPRINTF("read errno(%d): %s", (int) -ret, strerror(-ret));
+      return ret;
+    }
+    if (ret == 0) {
+      return -1;
+    }
+    nar->position += ret;
+  }
+
+  return 0;
+}
+
+/*
+** set the position of the reader
+*/
+static int reader_seek(nar_reader* nar, uint64_t const position)
+{
+  int64_t ret;
+
+  if (nar->map != NULL) {
+    nar->position = position;
+    return 0;
+  }
+
+  if (nar->buffer != NULL) {
+    uint64_t begin = nar->position - nar->buffer_offset;
+
+    if (position >= begin && position <= begin + nar->buffer_length) {
+      /* still in the read-ahead buffer */
+      nar->buffer_offset = position - begin;
+      nar->position = position;
+      return 0;
+    }
+  }
+
+  stats_seek(&nar->stats);
+  ret = nar->io->seek(nar->io_opaque, position, SEEK_SET);
+  if (ret < 0) {
+    DPRINTF("lseek errno(%d): %s", (int) -ret, strerror(-ret));
+    return ret;
+  }
+
+  nar->buffer_offset = nar->buffer_length = 0;
+  nar->position = position;
+
+  return 0;
+}
+
+int libnar_init_reader(nar_reader* nar, int fd)
+{
+  if (nar == NULL) {
+    DPRINTF("nar(%p)", nar);
+    return -1;
+  }
+
+  memset(nar, 0, sizeof(nar_reader));
+  nar->fd = fd;
+  nar->io = &libnar_fd_io;
+  nar->io_opaque = LIBNAR_FD_IO(fd);
+
+  return 0;
+}
+
+int libnar_init_reader_io(nar_reader* nar, nar_io const* io, void* opaque)
+{
+  if (nar == NULL || io == NULL) {
+    DPRINTF("nar(%p) io(%p)", nar, io);
+    return -1;
+  }
+
+  memset(nar, 0, sizeof(nar_reader));
+  nar->fd = -1;
+  nar->io = io;
+  nar->io_opaque = opaque;
+
+  return 0;
+}
+
+int libnar_map_reader(nar_reader* nar)
+{
+  struct stat st;
+  void* map;
+
+  if (nar == NULL || nar->io == NULL || nar->io != &libnar_fd_io
+      || nar->map != NULL) {
+    DPRINTF("nar_reader(%p) fd(%d) map(%p)",
+            nar, (nar) ? nar->fd : -1, (nar) ? nar->map : NULL);
+    return -1;
+  }
+
+  if (-1 == fstat(nar->fd, &st)) {
+    DPRINTF("fstat errno(%d): %s", errno, strerror(errno));
+    return -errno;
+  }
+
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    DPRINTF("can't map the file descriptor %d", nar->fd);
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, nar->fd, 0);
+  if (map == MAP_FAILED) {
+    DPRINTF("mmap errno(%d): %s", errno, strerror(errno));
+    return -errno;
+  }
+
+  nar->map = map;
+  nar->map_length = st.st_size;
+
+  return 0;
+}
+
+int libnar_set_read_ahead(nar_reader* nar, uint32_t const size)
+{
+  uint8_t* buffer = NULL;
+
+  if (nar == NULL) {
+    DPRINTF("nar_reader* nar == NULL");
+    return -1;
+  }
+
+  if (nar->buffer_offset != nar->buffer_length) {
+    DPRINTF("the read-ahead buffer still contains unread data");
+    return -1;
+  }
+
+  if (size != 0) {
+    buffer = malloc(size);
+    if (buffer == NULL) {
+      DPRINTF("malloc(%u) failed", size);
+      return -ENOMEM;
+    }
+  }
+
+  free(nar->buffer);
+  nar->buffer = buffer;
+  nar->buffer_size = size;
+  nar->buffer_offset = nar->buffer_length = 0;
+
+  return 0;
+}
+
+int libnar_set_reader_key(nar_reader* nar, void const* key)
+{
+  if (nar == NULL) {
+    DPRINTF("nar_reader(%p)", nar);
+    return -1;
+  }
+
+  nar->key = key;
+
+  return 0;
+}
+
+void libnar_close_reader(nar_reader* nar)
+{
+  if (nar != NULL) {
+    if (nar->map != NULL) {
+      munmap((void*)nar->map, nar->map_length);
+    }
+    free(nar->buffer);
+    decoder_close(nar->decoder);
+    blocks_reset(nar->blocks);
+    free(nar->blocks);
+    if (nar->reference != NULL) {
+      decoder_close(((nar_reference*)nar->reference)->decoder);
+      free(nar->reference);
+    }
+    cipher_close(nar->cipher);
+    index_reset(&nar->index);
+    memset(nar, 0, sizeof(nar_reader));
+  }
+}
+
+int libnar_read_nar_header(nar_reader* nar, nar_header* nh)
+{
+  uint8_t buf[sizeof(nar_header)];
+  int64_t ret;
+
+  if (nar == NULL || nh == NULL || nar->io == NULL) {
+    DPRINTF("nar_reader(%p) nar_header(%p) fd(%d)",
+            nar, nh, (nar) ? nar->fd : -1);
+    return -1;
+  }
+
+  ret = reader_seek(nar, 0);
+  switch (ret) {
+  case 0:
+  case -ESPIPE:
+    /* The user is probably using a pipe or a socked or a FIFO,
+    ** then do not consider it as an error */
+    break;
+  default:
+    return ret;
+  }
+
+  ret = reader_read(nar, buf, sizeof(buf));
+  if (ret < 0) {
+    return ret;
+  }
+  if (ret != sizeof(buf)) {
+    DPRINTF("the archive is too small: %lld bytes", (long long int) ret);
+    return -1;
+  }
+
+  memcpy(nh, buf, sizeof(nar_header));
+  nar->compression_type = nh->compression_type;
+  nar->item_offset = 0;
+  nar->item_offset_content1 = 0;
+  nar->item_offset_content2 = 0;
+
+  return 0;
+}
+
+int libnar_read_item_header(nar_reader* nar, item_header* ih)
+{
+  uint8_t buf[sizeof(item_header)];
+  int64_t ret;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d)",
+            nar, ih, (nar) ? nar->fd : -1);
+    return -1;
+  }
+
+  nar->item_position = nar->position;
+  nar->item_offset = 0;
+  nar->item_offset_content1 = 0;
+  nar->item_offset_content2 = 0;
+
+  ret = reader_read(nar, buf, sizeof(buf));
+  if (ret < 0) {
+    return ret;
+  }
+
+  nar->item_offset += ret;
+  if (ret != sizeof(buf)) {
+    return -1;
+  }
+
+  memcpy(ih, buf, sizeof(item_header));
+
+  return 0;
+}
+
+int libnar_read_content1(nar_reader* nar, item_header const* ih,
+                         char* buf, uint32_t const max)
+{
+  int64_t ret;
+  uint64_t length;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL || buf == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
+            nar, ih, (nar) ? nar->fd : -1, buf);
+    return -1;
+  }
+
+  if (ih->length1 <= nar->item_offset_content1) {
+    return 0;
+  }
+
+  length = ih->length1 - nar->item_offset_content1;
+
+  length = (max > length) ? length : max;
+  ret = reader_read(nar, (uint8_t*)buf, length);
+  if (ret > 0) {
+    nar->item_offset += ret;
+    nar->item_offset_content1 += ret;
+  }
+
+  return ret;
+}
+
+/*
+** skip what is left of the content1 (and its padding)
+*/
+static int skip_content1(nar_reader* nar, item_header const* ih)
+{
+  int ret = 0;
+
+  if (ROUNDUP64(ih->length1) > nar->item_offset_content1) {
+    nar->stats.padding += ROUNDUP64(ih->length1)
+                        - ((nar->item_offset_content1 > ih->length1)
+                           ? nar->item_offset_content1 : ih->length1);
+    ret = reader_skip(nar, ROUNDUP64(ih->length1) - nar->item_offset_content1);
+    nar->item_offset += ROUNDUP64(ih->length1) - nar->item_offset_content1;
+    nar->item_offset_content1 = ROUNDUP64(ih->length1);
+  }
+
+  return ret;
+}
+
+int libnar_read_content2(nar_reader* nar, item_header const* ih,
+                         char* buf, uint32_t const max)
+{
+  int64_t ret;
+  uint64_t length;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL || buf == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
+            nar, ih, (nar) ? nar->fd : -1, buf);
+    return -1;
+  }
+
+  skip_content1(nar, ih);
+
+  if (ih->length2 <= nar->item_offset_content2) {
+    return 0;
+  }
+
+  length = ih->length2 - nar->item_offset_content2;
+
+  length = (max > length) ? length : max;
+  ret = reader_read(nar, (uint8_t*)buf, length);
+  if (ret > 0) {
+    nar->item_offset += ret;
+    nar->item_offset_content2 += ret;
+  }
+
+  return ret;
+}
+
+/*
+** the decoder_input of a reader: the content2 of its current item
+*/
+typedef struct {
+  nar_reader* nar;
+  item_header const* ih;
+} reader_input;
+
+static int reader_read_content2(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  reader_input* ri = opaque;
+
+  return libnar_read_content2(ri->nar, ri->ih, (char*)buf, max);
+}
+
+/*
+** read exactly length bytes from input
+*/
+static int input_read(decoder_input input, void* opaque,
+                      void* buf, uint32_t const length)
+{
+  uint32_t have;
+  int ret;
+
+  for (have = 0; have < length; have += ret) {
+    ret = input(opaque, (uint8_t*)buf + have, length - have);
+    if (ret < 0) {
+      return ret;
+    }
+    if (ret == 0) {
+      DPRINTF("the encrypted content ends before its last chunk");
+      return -EBADMSG;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** decrypt the next bytes of the content2 given by input (from its beginning:
+** its cipher_header first). A whole chunk which fits in buf is read and
+** decrypted in place, in buf, the others go through c->data.
+*/
+static int cipher_read(nar_cipher* c, decoder_input input, void* opaque,
+                       uint8_t* buf, uint32_t const max)
+{
+  cipher_header ch;
+  uint32_t have = 0;
+  uint32_t length;
+  uint8_t* chunk;
+  int ret;
+
+  if (c->chunk_size == 0) {
+    ret = input_read(input, opaque, &ch, sizeof(cipher_header));
+    if (ret == 0) {
+      ret = cipher_begin(c, &ch, c->length2, 0);
+    }
+    if (ret != 0) {
+      c->chunk_size = 0;
+      return ret;
+    }
+  }
+
+  while (have < max) {
+    if (c->data_offset < c->data_length) {
+      length = c->data_length - c->data_offset;
+      length = (length > max - have) ? max - have : length;
+      memcpy(&buf[have], &c->data[c->data_offset], length);
+      c->data_offset += length;
+      have += length;
+      continue;
+    }
+    if (c->next == c->chunks) {
+      break;
+    }
+
+    length = cipher_chunk_length(c, c->next);
+    chunk = (max - have >= length) ? &buf[have] : c->data;
+    ret = input_read(input, opaque, chunk, length);
+    if (ret == 0) {
+      ret = input_read(input, opaque, c->tag, NAR_CIPHER_TAG_SIZE);
+    }
+    if (ret == 0) {
+      ret = cipher_chunk(c, c->next, chunk, chunk, length, c->tag);
+    }
+    if (ret != 0) {
+      return ret;
+    }
+    c->next++;
+
+    if (chunk == c->data) {
+      c->data_offset = 0;
+      c->data_length = length;
+    } else {
+      have += length;
+    }
+  }
+
+  return have;
+}
+
+/*
+** the decoder_input of an encrypted content2: the one of input decrypted
+*/
+typedef struct {
+  nar_cipher* cipher;
+  decoder_input input;
+  void* opaque;
+} cipher_input;
+
+static int cipher_input_read(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  cipher_input* ci = opaque;
+
+  return cipher_read(ci->cipher, ci->input, ci->opaque, buf, max);
+}
+
+/*
+** the cipher state of the current FILE_ENCRYPTED item of a reader
+*/
+static int reader_cipher(nar_reader* nar, item_header const* ih,
+                         nar_cipher** cipher)
+{
+  nar_cipher* c = nar->cipher;
+
+  if (nar->key == NULL) {
+    DPRINTF("no key to decrypt the item at 0x%016llx",
+            (unsigned long long int) nar->item_position);
+    return -ENOKEY;
+  }
+
+  if (c == NULL) {
+    c = cipher_open();
+    if (c == NULL) {
+      return -ENOMEM;
+    }
+    nar->cipher = c;
+  }
+
+  /* a new item (or the same one read again) */
+  if (c->item_position != nar->item_position || nar->item_offset_content2 == 0) {
+    c->key = nar->key;
+    c->item_position = nar->item_position;
+    c->length2 = ih->length2;
+    c->chunk_size = 0;
+  }
+  *cipher = c;
+
+  return 0;
+}
+
+static int reader_reference(nar_reader* nar, item_header const* ih,
+                            nar_reference** reference)
+{
+  nar_reference* r = nar->reference;
+  int ret;
+
+  if (r == NULL) {
+    r = calloc(1, sizeof(nar_reference));
+    if (r == NULL) {
+      return -ENOMEM;
+    }
+    nar->reference = r;
+  }
+  *reference = r;
+
+  /* the same reference, not read again */
+  if (r->item_position == nar->item_position
+      && nar->item_offset_content2 == ih->length2) {
+    return 0;
+  }
+
+  r->item_position = 0;
+  memset(&r->pi, 0, sizeof(positional_input));
+  r->pi.io = nar->io;
+  r->pi.opaque = nar->io_opaque;
+  r->pi.map = nar->map;
+  r->pi.map_length = nar->map_length;
+  r->pi.stats = &nar->stats;
+  ret = reference_target(&r->pi, nar->item_position, ih,
+                         &r->position, &r->header);
+  if (ret != 0) {
+    return ret;
+  }
+
+  /* the item_reference is consumed */
+  ret = skip_content1(nar, ih);
+  if (ret == 0 && ih->length2 > nar->item_offset_content2) {
+    ret = reader_skip(nar, ih->length2 - nar->item_offset_content2);
+    nar->item_offset += ih->length2 - nar->item_offset_content2;
+    nar->item_offset_content2 = ih->length2;
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (IS_COMPRESSED(r->header.flags)
+      && nar->compression_type != COMPRESSION_NONE) {
+    if (r->decoder != NULL
+        && r->decoder->compression_type != nar->compression_type) {
+      decoder_close(r->decoder);
+      r->decoder = NULL;
+    }
+    if (r->decoder == NULL) {
+      r->decoder = decoder_open(nar->compression_type);
+      if (r->decoder == NULL) {
+        return -1;
+      }
+    }
+    decoder_reset(r->decoder, r->position, r->header.flags);
+  }
+
+  r->pi.position = r->position + sizeof(item_header)
+                 + ROUNDUP64(r->header.length1);
+  r->pi.remaining = r->header.length2;
+  r->item_position = nar->item_position;
+
+  return 0;
+}
+
+/*
+** read the uncompressed content of the original item of a reference
+*/
+static int reference_read(nar_reader* nar, nar_reference* r,
+                          uint8_t* buf, uint32_t const max)
+{
+  if (IS_COMPRESSED(r->header.flags)
+      && nar->compression_type != COMPRESSION_NONE) {
+    r->decoder->stats = &nar->stats;
+    return decoder_read(r->decoder, positional_read, &r->pi, buf, max);
+  }
+
+  return positional_read(&r->pi, buf, max);
+}
+
+int libnar_read_content2_decoded(nar_reader* nar, item_header const* ih,
+                                 uint8_t* buf, uint32_t const max)
+{
+  reader_input ri = { nar, ih };
+  cipher_input ci = { NULL, reader_read_content2, &ri };
+  nar_reference* r;
+  nar_decoder* d;
+  int ret;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL || buf == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
+            nar, ih, (nar) ? nar->fd : -1, buf);
+    return -1;
+  }
+
+  if (IS_REFERENCE(ih->flags)) {
+    ret = reader_reference(nar, ih, &r);
+    return (ret != 0) ? ret : reference_read(nar, r, buf, max);
+  }
+
+  if (IS_ENCRYPTED(ih->flags)) {
+    ret = reader_cipher(nar, ih, &ci.cipher);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  if (!IS_COMPRESSED(ih->flags) || nar->compression_type == COMPRESSION_NONE) {
+    if (ci.cipher != NULL) {
+      return cipher_read(ci.cipher, reader_read_content2, &ri, buf, max);
+    }
+    return libnar_read_content2(nar, ih, (char*)buf, max);
+  }
+
+  if (nar->decoder != NULL
+      && ((nar_decoder*)nar->decoder)->compression_type != nar->compression_type) {
+    decoder_close(nar->decoder);
+    nar->decoder = NULL;
+  }
+  if (nar->decoder == NULL) {
+    nar->decoder = decoder_open(nar->compression_type);
+    if (nar->decoder == NULL) {
+      return -1;
+    }
+  }
+  d = nar->decoder;
+  d->stats = &nar->stats;
+
+  /* a new item (or the same one read again) */
+  if (d->item_position != nar->item_position || nar->item_offset_content2 == 0) {
+    decoder_reset(d, nar->item_position, ih->flags);
+  }
+
+  if (ci.cipher != NULL) {
+    return decoder_read(d, cipher_input_read, &ci, buf, max);
+  }
+  return decoder_read(d, reader_read_content2, &ri, buf, max);
+}
+
+/*
+** load the block table of the item at item_position, whose content2 is
+** [content2, content2 + length2[ for pi
+*/
+static int blocks_load(nar_blocks* b, positional_input* pi,
+                       uint64_t const item_position,
+                       uint64_t const content2, uint64_t const length2)
+{
+  uint64_t* offsets;
+  block_trailer bt;
+  block_header bh;
+  uint64_t table;
+
+  b->item_position = 0;
+  b->block = UINT64_MAX;
+  b->content2 = content2;
+  b->length2 = length2;
+
+  if (length2 < sizeof(block_header) + sizeof(block_trailer)
+      || positional_read_at(pi, &bt, sizeof(block_trailer),
+                            content2 + length2 - sizeof(block_trailer))) {
+    DPRINTF("no block table");
+    return -1;
+  }
+
+  table = length2 - sizeof(block_header) - sizeof(block_trailer);
+  if (bt.block_size == 0 || bt.block_size > UINT32_MAX
+      || bt.blocks > table / (sizeof(uint64_t) + sizeof(block_header))) {
+    DPRINTF("corrupted block table: block_size(%llu) blocks(%llu)",
+            (unsigned long long int) bt.block_size,
+            (unsigned long long int) bt.blocks);
+    return -1;
+  }
+
+  offsets = realloc(b->offsets, (bt.blocks + 1) * sizeof(uint64_t));
+  if (offsets == NULL) {
+    return -ENOMEM;
+  }
+  b->offsets = offsets;
+  b->block_size = bt.block_size;
+  b->blocks = bt.blocks;
+  b->length = 0;
+
+  if (bt.blocks > 0) {
+    table = length2 - sizeof(block_trailer) - bt.blocks * sizeof(uint64_t);
+    if (positional_read_at(pi, offsets, bt.blocks * sizeof(uint64_t),
+                           b->content2 + table)
+        || offsets[bt.blocks - 1] > table - sizeof(block_header)
+        || positional_read_at(pi, &bh, sizeof(block_header),
+                              b->content2 + offsets[bt.blocks - 1])) {
+      DPRINTF("corrupted block table");
+      return -1;
+    }
+    b->length = (bt.blocks - 1) * bt.block_size + bh.size;
+  }
+
+  b->item_position = item_position;
+  return 0;
+}
+
+/*
+** decode the block i in b->data
+*/
+static int blocks_decode(nar_blocks* b, positional_input* pi,
+                         uint64_t const compression_type, uint64_t const i)
+{
+  block_header bh;
+  uint8_t* data;
+  int ret;
+
+  if (positional_read_at(pi, &bh, sizeof(block_header),
+                         b->content2 + b->offsets[i])
+      || bh.size > b->block_size
+      || (i + 1 < b->blocks && bh.size != b->block_size)
+      || b->offsets[i] + sizeof(block_header) + bh.length > b->length2) {
+    DPRINTF("corrupted block %llu", (unsigned long long int) i);
+    return -1;
+  }
+
+  if (b->data_capacity < b->block_size) {
+    data = realloc(b->data, b->block_size);
+    if (data == NULL) {
+      return -ENOMEM;
+    }
+    b->data = data;
+    b->data_capacity = b->block_size;
+  }
+
+  if (b->decoder != NULL && b->decoder->compression_type != compression_type) {
+    decoder_close(b->decoder);
+    b->decoder = NULL;
+  }
+  if (b->decoder == NULL) {
+    b->decoder = decoder_open(compression_type);
+    if (b->decoder == NULL) {
+      return -1;
+    }
+  }
+
+  /* a single stream */
+  decoder_reset(b->decoder, b->item_position, 0);
+  b->decoder->stats = pi->stats;
+  pi->position = b->content2 + b->offsets[i] + sizeof(block_header);
+  pi->remaining = bh.length;
+  ret = decoder_read(b->decoder, positional_read, pi, b->data, bh.size);
+  if (ret < 0) {
+    b->block = UINT64_MAX;
+    return ret;
+  }
+  if ((uint32_t) ret != bh.size) {
+    DPRINTF("the block %llu is too short", (unsigned long long int) i);
+    b->block = UINT64_MAX;
+    return -1;
+  }
+
+  b->block = i;
+  b->data_length = bh.size;
+  return 0;
+}
+
+/*
+** read [offset, offset + max[ of the uncompressed content2 of the item at
+** item_position with the positional input pi. b is the block table of a
+** FILE_BLOCKS item (and the cipher state of a FILE_ENCRYPTED one, decrypted
+** with key), kept by the caller for the next reads.
+*/
+static int pread_decoded(positional_input* pi, nar_blocks* b,
+                         uint64_t const compression_type, nar_key const* key,
+                         uint64_t const item_position, item_header const* ih,
+                         uint64_t const offset, uint8_t* buf, uint32_t const max)
+{
+  nar_decoder* d;
+  uint64_t content2;
+  uint64_t length2;
+  uint64_t have;
+  uint64_t in;
+  uint64_t i;
+  int ret;
+
+  content2 = item_position + sizeof(item_header) + ROUNDUP64(ih->length1);
+  length2 = ih->length2;
+
+  if (IS_ENCRYPTED(ih->flags)) {
+    ret = cipher_attach(&b->cipher, key, pi, item_position,
+                        &content2, &length2);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  if (!IS_COMPRESSED(ih->flags) || compression_type == COMPRESSION_NONE) {
+    if (offset >= length2) {
+      return 0;
+    }
+    pi->position = content2 + offset;
+    pi->remaining = length2 - offset;
+    return positional_read(pi, buf, max);
+  }
+
+  if (!IS_BLOCKS(ih->flags)) {
+    /* one stream: decode (in buf) what is before offset */
+    d = decoder_open(compression_type);
+    if (d == NULL) {
+      return -1;
+    }
+    decoder_reset(d, item_position, ih->flags);
+    d->stats = pi->stats;
+    pi->position = content2;
+    pi->remaining = length2;
+    for (have = 0, ret = 0; have < offset && max > 0; have += ret) {
+      ret = decoder_read(d, positional_read, pi, buf,
+                         (offset - have > max) ? max : offset - have);
+      if (ret <= 0) {
+        break;
+      }
+    }
+    if (have == offset && max > 0) {
+      ret = decoder_read(d, positional_read, pi, buf, max);
+    }
+    decoder_close(d);
+    return (have == offset || ret < 0) ? ret : 0;
+  }
+
+  if (b->item_position != item_position) {
+    ret = blocks_load(b, pi, item_position, content2, length2);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  for (have = 0; have < max && offset + have < b->length; have += i) {
+    i = (offset + have) / b->block_size;
+    if (b->block != i) {
+      ret = blocks_decode(b, pi, compression_type, i);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+
+    in = offset + have - i * b->block_size;
+    i = b->data_length - in;
+    if (i > max - have) {
+      i = max - have;
+    }
+    memcpy(&buf[have], &b->data[in], i);
+  }
+
+  return have;
+}
+
+int libnar_pread_item(nar_reader* nar, item_header const* ih,
+                      uint64_t const offset, uint8_t* buf, uint32_t const max)
+{
+  positional_input pi;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL || buf == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) buf(%p)",
+            nar, ih, (nar) ? nar->fd : -1, buf);
+    return -1;
+  }
+
+  if (nar->blocks == NULL) {
+    nar->blocks = calloc(1, sizeof(nar_blocks));
+    if (nar->blocks == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  memset(&pi, 0, sizeof(positional_input));
+  pi.io = nar->io;
+  pi.opaque = nar->io_opaque;
+  pi.map = nar->map;
+  pi.map_length = nar->map_length;
+  pi.stats = &nar->stats;
+
+  if (IS_REFERENCE(ih->flags)) {
+    item_header th;
+    uint64_t target;
+    int ret;
+
+    ret = reference_target(&pi, nar->item_position, ih, &target, &th);
+    if (ret != 0) {
+      return ret;
+    }
+    return pread_decoded(&pi, nar->blocks, nar->compression_type, nar->key,
+                         target, &th, offset, buf, max);
+  }
+
+  return pread_decoded(&pi, nar->blocks, nar->compression_type, nar->key,
+                       nar->item_position, ih, offset, buf, max);
+}
+
+/*
+** check the content [offset, offset + length[ of the current item is in the
+** mapping and returns a pointer to it.
+*/
+static uint8_t const* map_item(nar_reader* nar,
+                               uint64_t const offset, uint64_t const length)
+{
+  uint64_t position = nar->item_position + offset;
+
+  if (position > nar->map_length || length > nar->map_length - position) {
+    DPRINTF("item at 0x%016llx is out of the mapping",
+            (unsigned long long int) nar->item_position);
+    return NULL;
+  }
+
+  return &nar->map[position];
+}
+
+int libnar_map_content1(nar_reader* nar, item_header const* ih,
+                        uint8_t const** ptr, uint64_t* length)
+{
+  uint8_t const* content;
+
+  if (nar == NULL || ih == NULL || nar->map == NULL
+      || ptr == NULL || length == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) map(%p) ptr(%p) length(%p)",
+            nar, ih, (nar) ? nar->map : NULL, ptr, length);
+    return -1;
+  }
+
+  content = map_item(nar, sizeof(item_header), ih->length1);
+  if (content == NULL) {
+    return -1;
+  }
+
+  *ptr = content;
+  *length = ih->length1;
+
+  /* the content1 is consumed */
+  nar->position = nar->item_position + sizeof(item_header) + ih->length1;
+  nar->item_offset = sizeof(item_header) + ih->length1;
+  nar->item_offset_content1 = ih->length1;
+  nar->item_offset_content2 = 0;
+
+  return 0;
+}
+
+int libnar_map_content2(nar_reader* nar, item_header const* ih,
+                        uint8_t const** ptr, uint64_t* length)
+{
+  uint64_t offset;
+  uint8_t const* content;
+
+  if (nar == NULL || ih == NULL || nar->map == NULL
+      || ptr == NULL || length == NULL) {
+    DPRINTF("nar_reader(%p) item_header(%p) map(%p) ptr(%p) length(%p)",
+            nar, ih, (nar) ? nar->map : NULL, ptr, length);
+    return -1;
+  }
+
+  offset = sizeof(item_header) + ROUNDUP64(ih->length1);
+  content = map_item(nar, offset, ih->length2);
+  if (content == NULL) {
+    return -1;
+  }
+
+  *ptr = content;
+  *length = ih->length2;
+
+  /* the content1 and the content2 are consumed */
+  nar->position = nar->item_position + offset + ih->length2;
+  nar->item_offset = offset + ih->length2;
+  nar->item_offset_content1 = ROUNDUP64(ih->length1);
+  nar->item_offset_content2 = ih->length2;
+
+  return 0;
+}
+
+int libnar_extract_content2_to_fd(nar_reader* nar, item_header const* ih,
+                                  int out_fd)
+{
+  uint8_t tmp[16384];
+  uint64_t length;
+  uint64_t available;
+  off64_t offset;
+  int64_t ret;
+  int seekable;
+
+  if (nar == NULL || ih == NULL || nar->io == NULL || out_fd == -1) {
+    DPRINTF("nar_reader(%p) item_header(%p) fd(%d) out_fd(%d)",
+            nar, ih, (nar) ? nar->fd : -1, out_fd);
+    return -1;
+  }
+
+  if (IS_REFERENCE(ih->flags)) {
+    /* the uncompressed content of the original item */
+    nar_reference* r;
+
+    ret = reader_reference(nar, ih, &r);
+    while (ret == 0 && (ret = reference_read(nar, r, tmp, sizeof(tmp))) > 0) {
+      ret = (write_buffer(out_fd, tmp, ret) == -1) ? -errno : 0;
+    }
+    return ret;
+  }
+
+  ret = skip_content1(nar, ih);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (ih->length2 <= nar->item_offset_content2) {
+    return 0;
+  }
+  length = ih->length2 - nar->item_offset_content2;
+
+  /* first, what is already in the read-ahead buffer */
+  available = nar->buffer_length - nar->buffer_offset;
+  if (nar->map == NULL && available != 0) {
+    available = (available > length) ? length : available;
+    if (write_buffer(out_fd, &nar->buffer[nar->buffer_offset], available) == -1) {
+      return -errno;
+    }
+    nar->buffer_offset += available;
+    nar->position += available;
+    nar->item_offset += available;
+    nar->item_offset_content2 += available;
+    length -= available;
+  }
+
+  if (length == 0) {
+    return 0;
+  }
+
+  offset = nar->position;
+  seekable = (nar->map != NULL);
+  if (nar->map == NULL && nar->io == &libnar_fd_io) {
+    stats_seek(&nar->stats);
+    seekable = (-1 != lseek64(nar->fd, 0, SEEK_CUR));
+  }
+
+  if (nar->map == NULL && nar->io != &libnar_fd_io) {
+    /* another I/O backend: through the reader */
+    uint8_t* buf = (nar->buffer) ? nar->buffer : tmp;
+    uint64_t size = (nar->buffer) ? nar->buffer_size : sizeof(tmp);
+
+    for (ret = 0; (uint64_t)ret < length; ) {
+      int64_t n = reader_read(nar, buf, (length - ret > size) ? size : length - ret);
+
+      if (n <= 0) {
+        if (n < 0) {
+          return n;
+        }
+        break;
+      }
+      if (write_buffer(out_fd, buf, n) == -1) {
+        return -errno;
+      }
+      ret += n;
+    }
+  } else if (seekable) {
+    /* from the item offset in the archive: the file offset is not used */
+    ret = copy_fd(nar->fd, &offset, out_fd, length,
+                  (nar->buffer) ? nar->buffer : tmp,
+                  (nar->buffer) ? nar->buffer_size : sizeof(tmp), &nar->stats);
+    if (ret >= 0) {
+      int err = reader_seek(nar, offset);
+
+      if (err != 0) {
+        return err;
+      }
+    }
+  } else {
+    /* a pipe or a socket */
+    ret = copy_fd(nar->fd, NULL, out_fd, length,
+                  (nar->buffer) ? nar->buffer : tmp,
+                  (nar->buffer) ? nar->buffer_size : sizeof(tmp), &nar->stats);
+    if (ret > 0) {
+      nar->position += ret;
+    }
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (nar->map != NULL || nar->io == &libnar_fd_io) {
+    /* the other backends are counted by reader_read */
+    nar->stats.bytes_read += ret;
+  }
+  nar->item_offset += ret;
+  nar->item_offset_content2 += ret;
+  if ((uint64_t)ret != length) {
+    DPRINTF("unexpected end of the archive");
+    return -1;
+  }
+
+  return 0;
+}
+
+int libnar_pextract_content2_to_fd(int fd, uint64_t const offset,
+                                   item_header const* ih, int out_fd)
+{
+  uint8_t tmp[16384];
+  off64_t position;
+  int64_t ret;
+
+  if (fd == -1 || ih == NULL || out_fd == -1) {
+    DPRINTF("fd(%d) item_header(%p) out_fd(%d)", fd, ih, out_fd);
+    return -1;
+  }
+
+  position = offset + sizeof(item_header) + ROUNDUP64(ih->length1);
+  ret = copy_fd(fd, &position, out_fd, ih->length2, tmp, sizeof(tmp),
+                &thread_stats);
+  if (ret < 0) {
+    return ret;
+  }
+  thread_stats.bytes_read += ret;
+
+  if ((uint64_t)ret != ih->length2) {
+    DPRINTF("unexpected end of the archive");
+    return -1;
+  }
+
+  return 0;
+}
+
+int libnar_pextract_content2_decoded_to_fd(int fd, uint64_t const offset,
+                                           item_header const* ih,
+                                           uint64_t const compression_type,
+                                           void const* key, int out_fd)
+{
+  uint8_t out[65536];
+  positional_input pi;
+  nar_cipher* c = NULL;
+  nar_decoder* d = NULL;
+  uint64_t content2;
+  uint64_t length2;
+  int ret;
+
+  if (fd == -1 || ih == NULL || out_fd == -1) {
+    DPRINTF("fd(%d) item_header(%p) out_fd(%d)", fd, ih, out_fd);
+    return -1;
+  }
+
+  memset(&pi, 0, sizeof(positional_input));
+  pi.io = &libnar_fd_io;
+  pi.opaque = LIBNAR_FD_IO(fd);
+  pi.stats = &thread_stats;
+
+  if (IS_REFERENCE(ih->flags)) {
+    item_header th;
+    uint64_t target;
+
+    ret = reference_target(&pi, offset, ih, &target, &th);
+    if (ret != 0) {
+      return ret;
+    }
+    return libnar_pextract_content2_decoded_to_fd(fd, target, &th,
+                                                  compression_type, key,
+                                                  out_fd);
+  }
+
+  if (!IS_ENCRYPTED(ih->flags)
+      && (!IS_COMPRESSED(ih->flags) || compression_type == COMPRESSION_NONE)) {
+    return libnar_pextract_content2_to_fd(fd, offset, ih, out_fd);
+  }
+
+  content2 = offset + sizeof(item_header) + ROUNDUP64(ih->length1);
+  length2 = ih->length2;
+  if (IS_ENCRYPTED(ih->flags)) {
+    ret = cipher_attach(&c, key, &pi, offset, &content2, &length2);
+    if (ret != 0) {
+      cipher_close(c);
+      return ret;
+    }
+  }
 
-    nar->item_offset += ret;
-    nar->item_offset_content2 += ret;
-    if (ret == 0) {
-      break;
+  if (IS_COMPRESSED(ih->flags) && compression_type != COMPRESSION_NONE) {
+    d = decoder_open(compression_type);
+    if (d == NULL) {
+      cipher_close(c);
+      return -1;
     }
+    decoder_reset(d, offset, ih->flags);
+    d->stats = pi.stats;
   }
 
-  return i;
+  pi.position = content2;
+  pi.remaining = length2;
+  do {
+    if (d != NULL) {
+      ret = decoder_read(d, positional_read, &pi, out, sizeof(out));
+    } else {
+      ret = positional_read(&pi, out, sizeof(out));
+    }
+    if (ret > 0 && write_buffer(out_fd, out, ret) == -1) {
+      ret = -errno;
+    }
+  } while (ret > 0);
+
+  decoder_close(d);
+  cipher_close(c);
+  return ret;
 }
 
 int libnar_jump_to_next_item_header(nar_reader* nar, item_header const* ih)
 {
   uint64_t offset = 0;
+  int ret;
 
-  if (nar == NULL || nar->fd == -1) {
+  if (nar == NULL || nar->io == NULL) {
     DPRINTF("nar_reader(%p) fd(%d)",
             nar, (nar) ? nar->fd : -1);
     return -1;
@@ -459,23 +5896,574 @@ int libnar_jump_to_next_item_header(nar_reader* nar, item_header const* ih)
     return 0;
   }
 
-  offset = sizeof(item_header)
-         + (ROUNDUP64(ih->length1)) + (ROUNDUP64(ih->length2))
-         - nar->item_offset;
+  offset = item_length(ih) - nar->item_offset;
 
-  if (-1 == lseek64(nar->fd, offset, SEEK_CUR)) {
-    switch (errno) {
-    case ESPIPE:
-      /* in this case, we shouldn't want to jump, because if we drop the
-      ** packets received from the socked (or pipe...) we lost the information */
-      DPRINTF("TODO: lseek errno(%d): %s", errno, strerror(errno));
-      return -1;
-      break;
-    default:
-      DPRINTF("lsekk errno(%d): %s", errno, strerror(errno));
-      return -1;
-      break;
+  /* the paddings not skipped yet */
+  if (nar->item_offset_content1 < ROUNDUP64(ih->length1)) {
+    nar->stats.padding += ROUNDUP64(ih->length1) - ih->length1;
+  }
+  nar->stats.padding += ROUNDUP64(ih->length2) - ih->length2;
+
+  ret = reader_skip(nar, offset);
+  if (ret != 0) {
+    DPRINTF("can't jump to the next item header");
+    return -1;
+  }
+
+  return 0;
+}
+
+int libnar_open_index(nar_reader* nar, nar_header const* nh)
+{
+  int64_t size;
+  uint64_t end;
+  int ret;
+
+  if (nar == NULL || nh == NULL || nar->io == NULL) {
+    DPRINTF("nar_reader(%p) nar_header(%p) fd(%d)",
+            nar, nh, (nar) ? nar->fd : -1);
+    return -1;
+  }
+
+  index_reset(&nar->index);
+  if (nh->index_position == 0) {
+    return -1;
+  }
+
+  ret = index_load(nar->io, nar->io_opaque, &nar->stats, nh->index_position,
+                   &nar->index, &end);
+  if (ret == 0) {
+    nar->stats.syscalls++;
+    size = nar->io->size(nar->io_opaque);
+    if (size > 0 && (uint64_t) size > end) {
+      /* the items appended after the index */
+      ret = index_scan(nar->io, nar->io_opaque, &nar->stats, end, size,
+                       &nar->index);
+    }
+  }
+  if (ret != 0) {
+    index_reset(&nar->index);
+  }
+
+  return ret;
+}
+
+int libnar_lookup(nar_reader* nar,
+                  char const* filepath, uint64_t const length_filepath,
+                  item_header* ih)
+{
+  nar_index_entry const* entry;
+  int ret;
+
+  if (nar == NULL || filepath == NULL || ih == NULL || nar->io == NULL) {
+    DPRINTF("nar_reader(%p) filepath(%p) item_header(%p) fd(%d)",
+            nar, filepath, ih, (nar) ? nar->fd : -1);
+    return -1;
+  }
+
+  entry = index_find(&nar->index, filepath, length_filepath);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  ret = reader_seek(nar, entry->offset);
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = libnar_read_item_header(nar, ih);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (memcmp(&ih->magic, FILE_HEADER_MAGIC, sizeof(uint64_t))
+      || ih->length1 != length_filepath) {
+    DPRINTF("the index does not match the item at 0x%016llx",
+            (unsigned long long int) entry->offset);
+    return -1;
+  }
+
+  return 0;
+}
+
+void libnar_close_index(nar_reader* nar)
+{
+  if (nar != NULL) {
+    index_reset(&nar->index);
+  }
+}
+
+/*
+** ------------- ARCHIVE -----------------------------------------------------
+*/
+
+static void archive_input(nar_archive const* archive, positional_input* pi)
+{
+  memset(pi, 0, sizeof(positional_input));
+  pi->io = &libnar_fd_io;
+  pi->opaque = LIBNAR_FD_IO(archive->fd);
+  pi->map = archive->map;
+  pi->map_length = archive->length;
+  pi->stats = &thread_stats;
+}
+
+int libnar_open_archive(nar_archive* archive, int fd)
+{
+  struct stat st;
+  void* map;
+  uint64_t end;
+  int ret = -1;
+
+  if (archive == NULL || fd == -1) {
+    DPRINTF("nar_archive(%p) fd(%d)", archive, fd);
+    return -1;
+  }
+
+  memset(archive, 0, sizeof(nar_archive));
+  archive->fd = fd;
+
+  if (-1 == fstat(fd, &st)) {
+    DPRINTF("fstat errno(%d): %s", errno, strerror(errno));
+    return -errno;
+  }
+  if (!S_ISREG(st.st_mode) || (uint64_t) st.st_size < sizeof(nar_header)) {
+    DPRINTF("the file descriptor %d is not an archive", fd);
+    return -1;
+  }
+  archive->length = st.st_size;
+
+  ret = read_at(&libnar_fd_io, LIBNAR_FD_IO(fd), &thread_stats,
+                &archive->header, sizeof(nar_header), 0);
+  if (ret != 0) {
+    return ret;
+  }
+
+  map = mmap(NULL, archive->length, PROT_READ, MAP_SHARED, fd, 0);
+  if (map != MAP_FAILED) {
+    archive->map = map;
+  } else {
+    DPRINTF("mmap errno(%d): %s (pread is used)", errno, strerror(errno));
+  }
+
+  ret = -1;
+  if (archive->header.index_position != 0) {
+    ret = index_load(&libnar_fd_io, LIBNAR_FD_IO(fd), &thread_stats,
+                     archive->header.index_position, &archive->index, &end);
+    if (ret == 0 && archive->length > end) {
+      /* the items appended after the index */
+      ret = index_scan(&libnar_fd_io, LIBNAR_FD_IO(fd), &thread_stats,
+                       end, archive->length, &archive->index);
+    }
+  }
+  if (ret != 0) {
+    /* no index (or a corrupted one): list all the items */
+    index_reset(&archive->index);
+    ret = index_scan(&libnar_fd_io, LIBNAR_FD_IO(fd), &thread_stats,
+                     sizeof(nar_header), archive->length, &archive->index);
+  }
+
+  if (ret == 0 && archive->header.signature_position != 0) {
+    archive->tree = calloc(1, sizeof(nar_tree));
+    if (archive->tree == NULL) {
+      ret = -ENOMEM;
+    } else if (tree_load(&libnar_fd_io, LIBNAR_FD_IO(fd), &thread_stats,
+                         archive->header.signature_position,
+                         archive->tree, &end) != 0) {
+      /* reported by libnar_verify_tree */
+      DPRINTF("can't load the SIGN item");
+      free(archive->tree);
+      archive->tree = NULL;
+    }
+  }
+
+  if (ret != 0) {
+    libnar_close_archive(archive);
+  }
+
+  return ret;
+}
+
+void libnar_close_archive(nar_archive* archive)
+{
+  if (archive != NULL) {
+    if (archive->map != NULL) {
+      munmap((void*)archive->map, archive->length);
+    }
+    index_reset(&archive->index);
+    if (archive->tree != NULL) {
+      tree_reset(archive->tree);
+      free(archive->tree);
+    }
+    memset(archive, 0, sizeof(nar_archive));
+    archive->fd = -1;
+  }
+}
+
+int libnar_set_archive_key(nar_archive* archive, void const* key)
+{
+  if (archive == NULL) {
+    DPRINTF("nar_archive(%p)", archive);
+    return -1;
+  }
+
+  archive->key = key;
+
+  return 0;
+}
+
+int libnar_pread_item_header(nar_archive const* archive, uint64_t const offset,
+                             nar_item* item)
+{
+  positional_input pi;
+  int ret;
+
+  if (archive == NULL || item == NULL || archive->fd == -1) {
+    DPRINTF("nar_archive(%p) item(%p) fd(%d)",
+            archive, item, (archive) ? archive->fd : -1);
+    return -1;
+  }
+
+  archive_input(archive, &pi);
+  ret = positional_read_at(&pi, &item->header, sizeof(item_header), offset);
+  if (ret != 0) {
+    return ret;
+  }
+  item->offset = offset;
+
+  if (offset + item_length(&item->header) > archive->length) {
+    DPRINTF("the item at 0x%016llx is out of the archive",
+            (unsigned long long int) offset);
+    return -1;
+  }
+
+  return 0;
+}
+
+int libnar_archive_lookup(nar_archive const* archive,
+                          char const* filepath, uint64_t const length_filepath,
+                          nar_item* item)
+{
+  nar_index_entry const* entry;
+  int ret;
+
+  if (archive == NULL || filepath == NULL || item == NULL) {
+    DPRINTF("nar_archive(%p) filepath(%p) item(%p)", archive, filepath, item);
+    return -1;
+  }
+
+  entry = index_find(&archive->index, filepath, length_filepath);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  ret = libnar_pread_item_header(archive, entry->offset, item);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (memcmp(&item->header.magic, FILE_HEADER_MAGIC, sizeof(uint64_t))
+      || item->header.length1 != length_filepath) {
+    DPRINTF("the index does not match the item at 0x%016llx",
+            (unsigned long long int) entry->offset);
+    return -1;
+  }
+
+  return 0;
+}
+
+int libnar_pread_content1(nar_archive const* archive, nar_item const* item,
+                          uint64_t const offset, char* buf, uint32_t const max)
+{
+  positional_input pi;
+
+  if (archive == NULL || item == NULL || buf == NULL || archive->fd == -1) {
+    DPRINTF("nar_archive(%p) item(%p) buf(%p)", archive, item, buf);
+    return -1;
+  }
+
+  if (offset >= item->header.length1) {
+    return 0;
+  }
+
+  archive_input(archive, &pi);
+  pi.position = item->offset + sizeof(item_header) + offset;
+  pi.remaining = item->header.length1 - offset;
+
+  return positional_read(&pi, (uint8_t*)buf, max);
+}
+
+int libnar_pread_content2(nar_archive const* archive, nar_item const* item,
+                          uint64_t const offset, uint8_t* buf, uint32_t const max)
+{
+  positional_input pi;
+
+  if (archive == NULL || item == NULL || buf == NULL || archive->fd == -1) {
+    DPRINTF("nar_archive(%p) item(%p) buf(%p)", archive, item, buf);
+    return -1;
+  }
+
+  if (offset >= item->header.length2) {
+    return 0;
+  }
+
+  archive_input(archive, &pi);
+  pi.position = item->offset + sizeof(item_header)
+              + ROUNDUP64(item->header.length1) + offset;
+  pi.remaining = item->header.length2 - offset;
+
+  return positional_read(&pi, buf, max);
+}
+
+int libnar_pread_content2_decoded(nar_archive const* archive,
+                                  nar_item const* item, uint64_t const offset,
+                                  uint8_t* buf, uint32_t const max)
+{
+  positional_input pi;
+  nar_item target;
+  nar_blocks b;
+  int ret;
+
+  if (archive == NULL || item == NULL || buf == NULL || archive->fd == -1) {
+    DPRINTF("nar_archive(%p) item(%p) buf(%p)", archive, item, buf);
+    return -1;
+  }
+
+  archive_input(archive, &pi);
+  if (IS_REFERENCE(item->header.flags)) {
+    ret = reference_target(&pi, item->offset, &item->header,
+                           &target.offset, &target.header);
+    if (ret != 0) {
+      return ret;
+    }
+    item = &target;
+  }
+
+  /* no block cache: nothing is shared between the calls */
+  memset(&b, 0, sizeof(nar_blocks));
+  ret = pread_decoded(&pi, &b, archive->header.compression_type, archive->key,
+                      item->offset, &item->header, offset, buf, max);
+  blocks_reset(&b);
+
+  return ret;
+}
+
+/*
+** update the crc (if not NULL) and the digest (if sha is not NULL) with
+** [position, position + length[ of the archive
+*/
+static int archive_digest(nar_archive const* archive, uint8_t* buf,
+                          uint64_t const position, uint64_t const length,
+                          uint32_t* crc, sha256_state* sha)
+{
+  positional_input pi;
+  uint8_t const* p;
+  int n;
+
+  archive_input(archive, &pi);
+  pi.position = position;
+  pi.remaining = length;
+  while (pi.remaining > 0) {
+    if (archive->map != NULL) {
+      /* straight from the mapping, by chunks to keep them in the cache */
+      p = &archive->map[pi.position];
+      n = (pi.remaining > LIBNAR_WRITE_BUFFER_SIZE)
+        ? LIBNAR_WRITE_BUFFER_SIZE : pi.remaining;
+      pi.position += n;
+      pi.remaining -= n;
+      thread_stats.bytes_read += n;
+    } else {
+      n = positional_read(&pi, buf, LIBNAR_WRITE_BUFFER_SIZE);
+      if (n <= 0) {
+        return (n < 0) ? n : -1;
+      }
+      p = buf;
+    }
+    if (crc != NULL) {
+      *crc = crc32c(*crc, p, n);
+    }
+    if (sha != NULL) {
+      sha256_update(sha, p, n);
+    }
+  }
+
+  return 0;
+}
+
+/*
+** the leaf of the item at offset in the SIGN item, NULL if none
+*/
+static sign_leaf const* archive_leaf(nar_archive const* archive,
+                                     uint64_t const offset)
+{
+  nar_tree const* tree = archive->tree;
+  uint64_t low = 0;
+  uint64_t high;
+  uint64_t middle;
+
+  if (tree == NULL) {
+    return NULL;
+  }
+
+  /* the leaves are in the archive order */
+  high = tree->length;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (tree->leaves[middle].offset == offset) {
+      return &tree->leaves[middle];
+    }
+    if (tree->leaves[middle].offset < offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+** libnar_verify_item of the item itself (not of the original item of a
+** FILE_REFERENCE one)
+*/
+static int archive_verify(nar_archive const* archive, nar_item const* item)
+{
+  uint8_t digest[NAR_DIGEST_SIZE];
+  item_checksum checksum;
+  sign_leaf const* leaf;
+  positional_input pi;
+  sha256_state sha;
+  uint64_t position;
+  uint8_t* buf = NULL;
+  uint32_t crc = 0;
+  int ret;
+
+  leaf = archive_leaf(archive, item->offset);
+  if (!IS_CHECKSUM(item->header.flags) && leaf == NULL) {
+    return 1;
+  }
+
+  if (item->offset + item_length(&item->header) > archive->length) {
+    DPRINTF("the item at 0x%016llx is out of the archive",
+            (unsigned long long int) item->offset);
+    return -1;
+  }
+
+  if (archive->map == NULL) {
+    buf = malloc(LIBNAR_WRITE_BUFFER_SIZE);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  /* both in a single read */
+  sha256_init(&sha);
+  position = item->offset + sizeof(item_header);
+  ret = archive_digest(archive, buf, position, item->header.length1,
+                       IS_CHECKSUM(item->header.flags) ? &crc : NULL,
+                       (leaf != NULL) ? &sha : NULL);
+  if (ret == 0) {
+    position += ROUNDUP64(item->header.length1);
+    ret = archive_digest(archive, buf, position, item->header.length2,
+                         IS_CHECKSUM(item->header.flags) ? &crc : NULL,
+                         (leaf != NULL) ? &sha : NULL);
+  }
+  free(buf);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (IS_CHECKSUM(item->header.flags)) {
+    archive_input(archive, &pi);
+    ret = positional_read_at(&pi, &checksum, sizeof(item_checksum),
+                             position + ROUNDUP64(item->header.length2));
+    if (ret != 0) {
+      return ret;
+    }
+
+    if (checksum.crc32c != crc) {
+      DPRINTF("the checksum of the item at 0x%016llx is 0x%08x, not 0x%08x",
+              (unsigned long long int) item->offset, crc, checksum.crc32c);
+      return -EBADMSG;
+    }
+  }
+
+  if (leaf != NULL) {
+    item_digest(&sha, &item->header, digest);
+    if (memcmp(digest, leaf->digest, NAR_DIGEST_SIZE)) {
+      DPRINTF("the digest of the item at 0x%016llx does not match",
+              (unsigned long long int) item->offset);
+      return -EBADMSG;
+    }
+  }
+
+  return (leaf != NULL) ? 0 : 2;
+}
+
+int libnar_verify_item(nar_archive const* archive, nar_item const* item)
+{
+  positional_input pi;
+  nar_item target;
+  int target_ret;
+  int ret;
+
+  if (archive == NULL || item == NULL || archive->fd == -1) {
+    DPRINTF("nar_archive(%p) item(%p)", archive, item);
+    return -1;
+  }
+
+  ret = archive_verify(archive, item);
+  if (ret < 0 || !IS_REFERENCE(item->header.flags)) {
+    return ret;
+  }
+
+  /* the content is the one of the original item: it is checked too */
+  archive_input(archive, &pi);
+  if (reference_target(&pi, item->offset, &item->header,
+                       &target.offset, &target.header) != 0) {
+    return -EBADMSG;
+  }
+  target_ret = archive_verify(archive, &target);
+  return (target_ret < 0) ? target_ret : ret;
+}
+
+int libnar_verify_tree(nar_archive const* archive, uint8_t* root,
+                       uint8_t const** signature, uint32_t* signature_length)
+{
+  uint8_t frontier[TREE_LEVELS][NAR_DIGEST_SIZE];
+  nar_tree const* tree;
+  uint64_t i;
+
+  if (archive == NULL || root == NULL || signature == NULL
+      || signature_length == NULL) {
+    DPRINTF("nar_archive(%p) root(%p)", archive, root);
+    return -1;
+  }
+
+  tree = archive->tree;
+  if (tree == NULL) {
+    /* the SIGN item can't be loaded */
+    return (archive->header.signature_position != 0) ? -EBADMSG : 1;
+  }
+  *signature = (tree->signature_length) ? tree->signature : NULL;
+  *signature_length = tree->signature_length;
+
+  if (tree->length > archive->index.length) {
+    DPRINTF("the SIGN item has more items than the archive");
+    return -EBADMSG;
+  }
+
+  for (i = 0; i < tree->length; i++) {
+    if (tree->leaves[i].offset != archive->index.entries[i].offset) {
+      DPRINTF("no item at 0x%016llx", (unsigned long long int) tree->leaves[i].offset);
+      return -EBADMSG;
     }
+    frontier_push(frontier, i, tree->leaves[i].digest);
+  }
+  frontier_root(frontier, tree->length, root);
+
+  if (memcmp(root, tree->root, NAR_DIGEST_SIZE)) {
+    DPRINTF("the digests of the SIGN item do not match its root");
+    return -EBADMSG;
   }
 
   return 0;
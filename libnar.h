@@ -43,7 +43,8 @@
 ** align a value to ROUNDUP a value to 64bits
 */
 # if !defined(ROUNDUP64)
-#  define ROUNDUP64(value) (value + ((value % 8) ? (8 - (value % 8)) : 0))
+#  define ROUNDUP64(value) \
+   ((value) + (((value) % 8) ? (8 - ((value) % 8)) : 0))
 # endif
 
 /*
@@ -70,10 +71,19 @@ typedef struct {
 typedef enum {
   COMPRESSION_NONE        = 0,
   COMPRESSION_DEFLATE     = 1,
+  COMPRESSION_ZSTD        = 2, /* zstd frames, with HAVE_ZSTD */
+  COMPRESSION_LZ4         = 3, /* lz4 frames, with HAVE_LZ4 */
 
-  COMPRESSION_TYPE_LENGTH = 2
+  COMPRESSION_TYPE_LENGTH = 4
 } nar_compression_type;
 
+typedef enum {
+  CIPHER_NONE        = 0,
+  CIPHER_AES_256_GCM = 1, /* with HAVE_OPENSSL (see CIPHERS) */
+
+  CIPHER_TYPE_LENGTH = 2
+} nar_cipher_type;
+
 /*
 ** ------------- ITEM HEADER -------------------------------------------------
 */
@@ -96,21 +106,381 @@ typedef struct {
 typedef enum {
   FILE_FLAG_EXECUTABLE = 0x00,
   FILE_FLAG_COMPRESSED = 0x01,
-  FILE_FLAG_ENCRYPTED  = 0x02
+  FILE_FLAG_ENCRYPTED  = 0x02,
+  FILE_FLAG_STORED     = 0x03,
+  FILE_FLAG_BLOCKS     = 0x04,
+  FILE_FLAG_REFERENCE  = 0x05,
+  FILE_FLAG_CHECKSUM   = 0x06
 } file_flags_index;
 
 # define FILE_EXECUTABLE (1 << FILE_FLAG_EXECUTABLE)
 # define FILE_COMPRESSED (1 << FILE_FLAG_COMPRESSED)
 # define FILE_ENCRYPTED  (1 << FILE_FLAG_ENCRYPTED)
+/* informative: the item was asked compressed but stored as is */
+# define FILE_STORED     (1 << FILE_FLAG_STORED)
+/* a FILE_COMPRESSED item compressed in independent blocks (see BLOCKS) */
+# define FILE_BLOCKS     (1 << FILE_FLAG_BLOCKS)
+/* the content is the one of an earlier item (see REFERENCES) */
+# define FILE_REFERENCE  (1 << FILE_FLAG_REFERENCE)
+/* the item ends with an item_checksum (see CHECKSUMS) */
+# define FILE_CHECKSUM   (1 << FILE_FLAG_CHECKSUM)
 
 # define IS_EXECUTABLE(flags) (flags & FILE_EXECUTABLE)
 # define IS_COMPRESSED(flags) (flags & FILE_COMPRESSED)
 # define IS_ENCRYPTED(flags)  (flags & FILE_ENCRYPTED)
+# define IS_STORED(flags)     (flags & FILE_STORED)
+# define IS_BLOCKS(flags)     (flags & FILE_BLOCKS)
+# define IS_REFERENCE(flags)  (flags & FILE_REFERENCE)
+# define IS_CHECKSUM(flags)   (flags & FILE_CHECKSUM)
+
+/*
+** ---- BLOCKS
+**
+** The content2 of a FILE_BLOCKS item is:
+**   for each block: a block_header followed by the block compressed (a whole
+**                   stream of the compression type of the archive)
+**   a block_header { 0, 0 }: the end of the blocks
+**   the offsets (uint64_t) of the block_headers in the content2
+**   a block_trailer
+**
+** All the blocks but the last one hold block_size bytes: the block of an
+** offset of the item is known without reading the others.
+*/
+
+/* the default size of the uncompressed blocks */
+# define NAR_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+  uint32_t length; /* compressed */
+  uint32_t size;   /* uncompressed */
+} __attribute__((packed)) block_header;
+
+typedef struct {
+  uint64_t block_size;
+  uint64_t blocks;
+} __attribute__((packed)) block_trailer;
+
+/*
+** ---- REFERENCES
+**
+** The content2 of a FILE_REFERENCE item is an item_reference: the offset of
+** the item header of an earlier FILE item (never a reference itself) whose
+** content is the one of the reference. The flags of this original item
+** (FILE_COMPRESSED, FILE_BLOCKS...) tell how to read it.
+**
+** The readers give the content of the original item for a reference (see
+** libnar_read_content2_decoded), libnar_read_content2 gives the
+** item_reference itself. The original item is read with positional reads:
+** a reference can't be resolved when the archive is read from a pipe.
+*/
+
+typedef struct {
+  uint64_t offset;
+} __attribute__((packed)) item_reference;
+
+/*
+** ---- CHECKSUMS
+**
+** A FILE_CHECKSUM item is followed (after the padding of its content2) by an
+** item_checksum: the CRC32C of its content1 and of its content2 as they are
+** stored (compressed or not, without the paddings).
+*/
+
+typedef struct {
+  uint32_t crc32c;
+  uint32_t reserved;
+} __attribute__((packed)) item_checksum;
+
+/*
+** ---- CIPHERS
+**
+** The content2 of a FILE_ENCRYPTED item (encrypted by libnar, see
+** libnar_set_writer_key) is a cipher_header followed by the content (as it
+** would be stored otherwise: compressed or not) cut in chunks of chunk_size
+** bytes, each one encrypted and authenticated on its own:
+**   for each chunk: the chunk encrypted, followed by its tag
+** All the chunks but the last one hold chunk_size bytes: the last one is
+** shorter (empty if the content is a multiple of chunk_size). The chunks of
+** a range of the content are found, and checked, without reading the others.
+**
+** With CIPHER_AES_256_GCM, the key of the item is HMAC-SHA256(key, salt) and
+** the nonce of the chunk i is i (big endian uint64_t) followed by 1 (big
+** endian uint32_t) for the last chunk, 0 for the others: the chunks can't be
+** reordered, and the item can't be truncated, unnoticed.
+*/
+
+/* the size of a key (see libnar_open_key) */
+# define NAR_KEY_SIZE 32
+/* the size of the tag after each chunk */
+# define NAR_CIPHER_TAG_SIZE 16
+/* the chunk size of the items encrypted by libnar, and the largest one */
+# define NAR_CIPHER_CHUNK_SIZE (64 * 1024)
+# define NAR_CIPHER_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+  uint8_t salt[32];
+  uint32_t chunk_size;
+  uint32_t reserved;
+} __attribute__((packed)) cipher_header;
+
+/*
+** ---- SIGN
+**
+** The SIGN item holds a hash tree of the FILE items of the archive (the one
+** of RFC 6962, with SHA-256):
+**   the digest of an item is SHA-256(content1 | content2 | item header), the
+**   contents as they are stored (without the paddings and the checksum)
+**   a leaf is SHA-256(0x00 | digest), a node is SHA-256(0x01 | left | right)
+**   the tree of n leaves is the tree of the first k leaves (k the largest
+**   power of 2 lower than n) as left child, and the one of the others
+**
+** content1: a sign_header followed by the roots of the perfect subtrees of
+**           the tree, the largest first (the frontier: one per bit set in
+**           leaves), what an append needs to update the tree
+** content2: a sign_leaf per FILE item, in the archive order, followed by the
+**           signature of the root (if any)
+**
+** An item is checked against its digest, and the digests against the root,
+** without reading the other items (see libnar_verify_item).
+*/
+
+/* the size of a SHA-256 digest */
+# define NAR_DIGEST_SIZE 32
+/* the largest signature of a root */
+# define NAR_SIGNATURE_MAX_LENGTH 1024
+
+typedef struct {
+  uint64_t leaves;
+  uint8_t root[NAR_DIGEST_SIZE];
+  uint32_t signature_length;
+  uint32_t reserved;
+} __attribute__((packed)) sign_header;
+
+typedef struct {
+  uint64_t offset; /* of the item header */
+  uint8_t digest[NAR_DIGEST_SIZE];
+} __attribute__((packed)) sign_leaf;
+
+/*
+** sign the root of the tree (see libnar_set_sign)
+**
+** @param opaque the given opaque
+** @param root the root (NAR_DIGEST_SIZE bytes)
+** @param signature where to write the signature
+** @param length the size of signature (NAR_SIGNATURE_MAX_LENGTH), to set to
+** the length of the signature
+**
+** @return 0 on success, -1 on error.
+*/
+typedef int (*sign_root)(void* opaque, uint8_t const* root,
+                         uint8_t* signature, uint32_t* length);
+
+/*
+** ---- INDEX
+**
+** The INDEX item is an item_header followed by:
+**   content1: the number of entries (uint64_t)
+**   content2: for each entry, an index_entry_header followed by the filepath
+**             (ROUNDUP64)
+**
+** The nar_header.index_position gives the offset of the last written INDEX.
+*/
+
+typedef struct {
+  uint64_t offset;
+  uint64_t flags;
+  uint64_t length1;
+  uint64_t length2;
+} __attribute__((packed)) index_entry_header;
+
+/**
+** an index entry in memory: filepath is the offset of the filepath in the
+** nar_index.strings buffer.
+*/
+typedef struct {
+  uint64_t offset;
+  uint64_t flags;
+  uint64_t length1;
+  uint64_t length2;
+  uint64_t filepath;
+} nar_index_entry;
+
+typedef struct {
+  nar_index_entry* entries;
+  uint64_t length;
+  uint64_t capacity;
+
+  char*    strings;
+  uint64_t strings_length;
+  uint64_t strings_capacity;
+
+  /* open addressing hash table: entry index + 1 (0 means empty slot) */
+  uint64_t* slots;
+  uint64_t  slots_length;
+} nar_index;
 
 /*
 ** ------------- LIBNAR ------------------------------------------------------
 */
 
+/*
+** ---- I/O
+*/
+
+/**
+** the I/O backend of a writer or a reader: each call behaves as the system
+** call of the same name on the backend given by opaque, but returns -errno
+** on error.
+*/
+typedef struct {
+  int64_t (*read)(void* opaque, void* buf, uint64_t const size);
+  int64_t (*pread)(void* opaque, void* buf, uint64_t const size,
+                   uint64_t const offset);
+  int64_t (*write)(void* opaque, void const* buf, uint64_t const size);
+  int64_t (*pwrite)(void* opaque, void const* buf, uint64_t const size,
+                    uint64_t const offset);
+  int64_t (*seek)(void* opaque, int64_t const offset, int const whence);
+  int64_t (*size)(void* opaque);
+  int     (*truncate)(void* opaque, uint64_t const length);
+} nar_io;
+
+/**
+** the default backend: opaque is the file descriptor (see LIBNAR_FD_IO)
+*/
+extern nar_io const libnar_fd_io;
+# define LIBNAR_FD_IO(fd) ((void*)(intptr_t)(fd))
+
+/**
+** the memory backend: opaque is a nar_memory. An archive can be built in a
+** growable buffer, or read from a buffer given by the user.
+*/
+extern nar_io const libnar_memory_io;
+
+typedef struct {
+  uint8_t* data;
+  uint64_t length;
+  /* 0 if data is the read only buffer given by the user */
+  uint64_t capacity;
+  uint64_t position;
+} nar_memory;
+
+/**
+** initialize a memory backend
+**
+** @param memory the nar_memory to initialize
+** @param data the archive to read (it is not copied and it must live as long
+** as the memory backend), or NULL for an empty growable buffer
+** @param length the data size
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_init_memory(nar_memory* memory, void const* data,
+                       uint64_t const length);
+
+/**
+** release the buffer of a memory backend (not the one given by the user)
+**
+** @param memory the nar_memory to release
+*/
+void libnar_close_memory(nar_memory* memory);
+
+/**
+** the io_uring backend: opaque is returned by libnar_open_uring. The archive
+** is read and written in blocks of registered buffers, several of them in
+** flight: the sequential reads prefetch the next blocks and the writes are
+** queued (their errors are reported by the next calls and by
+** libnar_close_uring). Without io_uring (old kernels, other systems or a
+** denied io_uring_setup) it falls back to synchronous pread and pwrite.
+*/
+extern nar_io const libnar_uring_io;
+
+/* the default number of blocks in flight and their size */
+# define LIBNAR_URING_DEPTH 8
+# define LIBNAR_URING_BLOCK_SIZE (256 * 1024)
+
+/**
+** open an io_uring backend on a regular file, from the offset 0
+**
+** @param fd the archive file descriptor (kept open by the caller)
+** @param depth the number of blocks in flight (0 for LIBNAR_URING_DEPTH)
+** @param block_size the block size (0 for LIBNAR_URING_BLOCK_SIZE)
+**
+** @return the opaque of libnar_uring_io, NULL on error
+*/
+void* libnar_open_uring(int fd, uint32_t depth, uint32_t block_size);
+
+/**
+** wait for the queued writes and release the backend
+**
+** @param uring the backend returned by libnar_open_uring
+**
+** @return 0 on success. -errno if a queued write failed.
+*/
+int libnar_close_uring(void* uring);
+
+/**
+** @return 1 if the backend uses io_uring, 0 if it is the synchronous
+** fallback
+*/
+int libnar_uring_is_async(void const* uring);
+
+/*
+** ---- STATS
+*/
+
+/**
+** the counters of a nar_writer or of a nar_reader (see libnar_get_stats), or
+** of the nar_archive calls of a thread (see libnar_add_thread_stats). They
+** are updated by each call, and never reset but by the init calls.
+*/
+typedef struct {
+  /* the bytes read from and written to the archive (through the I/O backend,
+  ** the mapping or a copy by the kernel) */
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  /* the calls issued on the archive (the syscalls with the file descriptor
+  ** backend), and the seeks among them */
+  uint64_t syscalls;
+  uint64_t seeks;
+  /* the padding bytes written, or skipped */
+  uint64_t padding;
+  /* the time (nanoseconds) spent in the get_computed_content callbacks, and
+  ** in writing the buffer to the archive */
+  uint64_t callback_time;
+  uint64_t write_time;
+  /* the bytes given to and produced by the compression: for a writer the
+  ** uncompressed size (it is up to the caller: libnar only gets the
+  ** compressed content) and the FILE_COMPRESSED contents as stored, for a
+  ** reader the compressed bytes decoded and what they gave */
+  uint64_t compression_in;
+  uint64_t compression_out;
+} nar_stats;
+
+/*
+** ---- KEYS
+*/
+
+/**
+** open the key of the FILE_ENCRYPTED items (see CIPHERS). It is given to the
+** writers, the readers and the archives, and it is only read: many threads
+** may use the same key.
+**
+** @param cipher_type the cipher type of the archive (nar_header)
+** @param key the key
+** @param length the key size (NAR_KEY_SIZE)
+**
+** @return the key, NULL on error (or if the cipher type is not supported)
+*/
+void* libnar_open_key(uint64_t const cipher_type,
+                      uint8_t const* key, uint32_t const length);
+
+/**
+** wipe and release the key
+**
+** @param key the key returned by libnar_open_key (NULL does nothing)
+*/
+void libnar_close_key(void* key);
+
 /*
 ** ---- WRITER
 */
@@ -128,14 +498,52 @@ typedef enum {
 typedef int (*get_computed_content)(void* opaque,
                                     uint8_t* buf, uint32_t const max);
 
+/**
+** the default size of the buffer used to stream the contents (see
+** libnar_set_write_buffer)
+*/
+# define LIBNAR_WRITE_BUFFER_SIZE (1024 * 1024)
+
 /**
 ** This is the structure to use for the writing commands.
 */
 typedef struct {
+  /* the file descriptor, -1 if another I/O backend is used */
   int fd;
+  nar_io const* io;
+  void* io_opaque;
 
   uint64_t signature_position;
   uint64_t index_position;
+
+  /* the end of the archive (where the next item will be written) */
+  uint64_t offset;
+  nar_index index;
+
+  /* the buffer used to stream the contents */
+  uint8_t* buffer;
+  uint32_t buffer_size;
+
+  /* the content hashes of the appended items (see libnar_set_dedup) */
+  void* dedup;
+  /* the appended items are FILE_CHECKSUM (see libnar_set_checksum) */
+  int checksum;
+  /* the hash tree of the SIGN item (see libnar_set_sign) */
+  void* tree;
+  sign_root sign;
+  void* sign_opaque;
+  /* the key of the appended items and the cipher state (see
+  ** libnar_set_writer_key) */
+  void const* key;
+  void* cipher;
+
+  /* append session (see libnar_begin_append) */
+  int session;
+  uint64_t cipher_type;
+  uint64_t compression_type;
+
+  /* see libnar_get_stats */
+  nar_stats stats;
 } nar_writer;
 
 /**
@@ -148,6 +556,17 @@ typedef struct {
 */
 int libnar_init_writer(nar_writer* nar, int fd);
 
+/**
+** initialize the nar_writer state with another I/O backend
+**
+** @param nar the nar_writer state to initialize
+** @param io the I/O backend (for example &libnar_memory_io)
+** @param opaque what is given to the io calls (for example a nar_memory)
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_init_writer_io(nar_writer* nar, nar_io const* io, void* opaque);
+
 /**
 ** Close the nar_writer state
 **
@@ -155,14 +574,89 @@ int libnar_init_writer(nar_writer* nar, int fd);
 */
 void libnar_close_writer(nar_writer* nar);
 
+/**
+** set the size of the buffer used to stream the contents of the items. The
+** get_computed_content callbacks are called until it is full before it is
+** written. If not set, LIBNAR_WRITE_BUFFER_SIZE is used.
+**
+** @param nar the nar_writer state
+** @param size the buffer size (MiB-scale for big files)
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_set_write_buffer(nar_writer* nar, uint32_t const size);
+
+/**
+** deduplicate the contents of the appended items: once written, the content
+** of an item is hashed (XXH64) and compared byte by byte with the earlier
+** items of the same hash, length and encoding appended by this writer. If
+** one matches, the item is replaced by a FILE_REFERENCE item to it (see
+** REFERENCES). The encrypted items are not deduplicated.
+**
+** The archive has to be readable and seekable, and the appended items are
+** read back once (twice on a match).
+**
+** @param nar the nar_writer state
+** @param enable 1 to deduplicate the next appended items, 0 to stop
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_set_dedup(nar_writer* nar, int const enable);
+
+/**
+** add a checksum to the next appended items (see CHECKSUMS). It is computed
+** while the content is streamed, or read back from the archive for
+** libnar_append_file_fd.
+**
+** @param nar the nar_writer state
+** @param enable 1 to add the checksums, 0 to stop
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_set_checksum(nar_writer* nar, int const enable);
+
+/**
+** maintain the SIGN item of the archive (see SIGN): the digest of each
+** appended item is computed while its content is streamed (or read back for
+** libnar_append_file_fd) and added to the tree. The items already in the
+** archive but not in the tree are read once. It is enabled by
+** libnar_load_index if the archive has a SIGN item.
+**
+** @param nar the nar_writer state
+** @param enable 1 to maintain the SIGN item, 0 to stop (and not write it)
+** @param sign the callback signing the root (NULL for no signature)
+** @param opaque given to sign
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_set_sign(nar_writer* nar, int const enable,
+                    sign_root sign, void* opaque);
+
+/**
+** encrypt the next appended items (see CIPHERS): they are FILE_ENCRYPTED and
+** their contents are encrypted (after the compression done by the caller)
+** while they are streamed. libnar_append_file_fd then reads the content
+** instead of letting the kernel copy it. The encrypted items are not
+** deduplicated.
+**
+** @param nar the nar_writer state (with the cipher type of the archive: see
+** libnar_write_nar_header or libnar_begin_append)
+** @param key the key (see libnar_open_key), NULL to stop. It has to live as
+** long as it is set.
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_set_writer_key(nar_writer* nar, void const* key);
+
 /**
 ** write the NAR HEADER in the given state.
 ** The header will be stored at the begin of the file descriptor given in the
 ** nar_writer state if possible (i.e. if it can seek to the begin of the file).
 **
 ** @param nar the nar_writer state
-** @param cipher_type is not defined yet TODO
-** @param compression_type is not defined yet TODO
+** @param cipher_type the cipher of the FILE_ENCRYPTED items (nar_cipher_type)
+** @param compression_type the compression of the FILE_COMPRESSED items
+** (nar_compression_type)
 **
 ** @return 0 on success. -1 or -errno on error.
 */
@@ -170,13 +664,24 @@ int libnar_write_nar_header(nar_writer* nar,
                             uint64_t const cipher_type,
                             uint64_t const compression_type);
 
+/* the length_content of a content whose size is not known in advance */
+# define NAR_UNKNOWN_LENGTH ((uint64_t) -1)
+
 /**
 ** append a file in a NAR ARCHIVE (the file descriptor in the nar_writer state)
 **
+** The content is read from the callback until it returns 0 or length_content
+** bytes are read. If the content ends before length_content (for example with
+** NAR_UNKNOWN_LENGTH), the length of the item is the one of the content: it
+** is set before the item is written if the whole content fits in the write
+** buffer, else the item header is patched afterward (the archive file
+** descriptor must then be seekable).
+**
 ** @param nar the nar_writer state
 ** @param flags the item file flags
 ** @param filepath the filepath (ciphered or not)
 ** @param length_filepath the filepath size not necesserly ROUNDUP64
+** @param length_content the content size or NAR_UNKNOWN_LENGTH
 ** @param callback the method to get the content to stor (ciphered or not)
 ** @param opaque the userdata to give to the callback function
 **
@@ -187,6 +692,87 @@ int libnar_append_file(nar_writer* nar, uint64_t const flags,
                        uint64_t const length_content,
                        get_computed_content callback, void* opaque);
 
+/**
+** append a file in a NAR ARCHIVE from a file descriptor. The content is
+** moved by the kernel when possible (copy_file_range, sendfile or splice)
+** and through the nar_writer buffer otherwise.
+**
+** @param nar the nar_writer state
+** @param flags the item file flags
+** @param filepath the filepath (ciphered or not)
+** @param length_filepath the filepath size not necesserly ROUNDUP64
+** @param src_fd the file descriptor to read the content from (from its
+** current offset)
+** @param length_content the number of bytes to copy from src_fd
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_append_file_fd(nar_writer* nar, uint64_t const flags,
+                          char const* filepath, uint64_t const length_filepath,
+                          int src_fd, uint64_t const length_content);
+
+/**
+** load the index of the archive pointed by the file descriptor of the
+** nar_writer state (it has to be readable and seekable). The items appended
+** after the last INDEX (or all the items if there is no INDEX) are added to
+** the loaded index. If the INDEX is the last item of the archive, it is
+** truncated: libnar_write_index will write the new one at its place.
+** Likewise for the SIGN item just before the INDEX (see libnar_set_sign).
+**
+** @param nar the nar_writer state
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_load_index(nar_writer* nar);
+
+/**
+** append the INDEX item (all the items appended with this nar_writer state
+** and the ones loaded with libnar_load_index) and set the index_position.
+** Use libnar_write_nar_header to record the new index_position.
+**
+** @param nar the nar_writer state
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_write_index(nar_writer* nar);
+
+/**
+** write the SIGN item (see libnar_set_sign) at the end of the archive, to
+** call before libnar_write_index. The NAR HEADER has to be written next
+** (with libnar_write_nar_header) in order to update the signature position.
+**
+** @param nar the nar_writer state
+**
+** @return 0 on success (or if the SIGN item is not maintained). -1 or -errno
+** on error.
+*/
+int libnar_write_sign(nar_writer* nar);
+
+/**
+** start an append session on an existing archive: load its index (see
+** libnar_load_index), read its NAR HEADER and seek once to its end. Until
+** libnar_end_append, the items are appended without any other seek and the
+** NAR HEADER is not rewritten. What a failed append wrote is truncated, so
+** the session can go on (or end) after it.
+**
+** @param nar the nar_writer state (the file descriptor has to be readable and
+** seekable)
+** @param nh if not NULL, it is filled with the NAR HEADER of the archive
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_begin_append(nar_writer* nar, nar_header* nh);
+
+/**
+** end the append session: write the SIGN item (if maintained), the INDEX
+** and the NAR HEADER once.
+**
+** @param nar the nar_writer state
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_end_append(nar_writer* nar);
+
 /*
 ** ---- READER
 */
@@ -195,11 +781,49 @@ int libnar_append_file(nar_writer* nar, uint64_t const flags,
 ** nar_reader state
 */
 typedef struct {
+  /* the file descriptor, -1 if another I/O backend is used */
   int fd;
+  nar_io const* io;
+  void* io_opaque;
 
   uint64_t item_offset;
   uint64_t item_offset_content1;
   uint64_t item_offset_content2;
+
+  /* the position in the archive and the one of the current item header */
+  uint64_t position;
+  uint64_t item_position;
+
+  /* the archive mapping (see libnar_map_reader) */
+  uint8_t const* map;
+  uint64_t map_length;
+
+  /* the read-ahead buffer (see libnar_set_read_ahead) */
+  uint8_t* buffer;
+  uint32_t buffer_size;
+  uint32_t buffer_offset;
+  uint32_t buffer_length;
+
+  /* the archive compression type and the decoder state (see
+  ** libnar_read_content2_decoded) */
+  uint64_t compression_type;
+  void* decoder;
+
+  /* the block table and the last block decoded (see libnar_pread_item) */
+  void* blocks;
+
+  /* the original item of the current reference and its decoder */
+  void* reference;
+
+  /* the key of the FILE_ENCRYPTED items (see libnar_set_reader_key) and the
+  ** cipher state of libnar_read_content2_decoded */
+  void const* key;
+  void* cipher;
+
+  nar_index index;
+
+  /* see libnar_get_stats */
+  nar_stats stats;
 } nar_reader;
 
 /**
@@ -212,6 +836,54 @@ typedef struct {
 */
 int libnar_init_reader(nar_reader* nar, int fd);
 
+/**
+** initialize the nar_reader state with another I/O backend
+**
+** @param nar the nar_reader state to initialize
+** @param io the I/O backend (for example &libnar_memory_io)
+** @param opaque what is given to the io calls (for example a nar_memory)
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_init_reader_io(nar_reader* nar, nar_io const* io, void* opaque);
+
+/**
+** map the whole archive in memory: the reader does not issue any read
+** syscall anymore and libnar_map_content1/libnar_map_content2 become
+** available. The reader has to use the file descriptor backend on a regular
+** file.
+**
+** @param nar the initialized nar_reader state
+**
+** @return 0 on success. -1 or -errno on error (the reader is still usable).
+*/
+int libnar_map_reader(nar_reader* nar);
+
+/**
+** set the size of the read-ahead buffer of the reader. The item headers, the
+** filenames, the small contents and the forward jumps are then served from
+** this buffer which is refilled with one read syscall when empty.
+**
+** @param nar the nar_reader state
+** @param size the buffer size (for example 256KiB). 0 to disable it.
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_set_read_ahead(nar_reader* nar, uint32_t const size);
+
+/**
+** set the key of the FILE_ENCRYPTED items: their contents are then decrypted
+** by libnar_read_content2_decoded and libnar_pread_item (without it, these
+** calls fail on such items).
+**
+** @param nar the nar_reader state
+** @param key the key (see libnar_open_key), NULL to unset it. It has to live
+** as long as it is set.
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_set_reader_key(nar_reader* nar, void const* key);
+
 /**
 ** close the nar_reader state
 **
@@ -274,6 +946,126 @@ int libnar_read_content1(nar_reader* nar, item_header const* ih,
 int libnar_read_content2(nar_reader* nar, item_header const* ih,
                          char* buf, uint32_t const max);
 
+/**
+** get the content1 (filename in the case of a file) of the current item
+** straight from the mapping (see libnar_map_reader). The content1 is then
+** considered as read.
+**
+** @param nar the mapped reader state
+** @param ih the current item header
+** @param ptr it will point to the content1 in the mapping
+** @param length it will be set to the content1 size
+**
+** @return 0 on success, -1 on error.
+*/
+int libnar_map_content1(nar_reader* nar, item_header const* ih,
+                        uint8_t const** ptr, uint64_t* length);
+
+/**
+** read the content2 (the file content in the case of a file) uncompressed:
+** if the item is FILE_COMPRESSED, its content is decoded according to the
+** compression type of the archive (the one of the last libnar_read_nar_header:
+** deflate, and zstd or lz4 if libnar is built with HAVE_ZSTD or HAVE_LZ4)
+** else it is the same as libnar_read_content2. Of a FILE_REFERENCE item, it
+** is the content of the original item. A FILE_ENCRYPTED item is decrypted
+** (see libnar_set_reader_key) before it is decoded: a whole chunk which fits
+** in buf is decrypted in place, in buf. The decoder buffers are allocated on
+** the first call and reused for all the items of the reader.
+**
+** @param nar the reader state
+** @param ih the current item header
+** @param buf it will be filled with the uncompressed content
+** @param max the buf size
+**
+** @return returns the readed size (max unless the content ends) or 0 (if
+** nothing more to read). -1 or -errno on error.
+*/
+int libnar_read_content2_decoded(nar_reader* nar, item_header const* ih,
+                                 uint8_t* buf, uint32_t const max);
+
+/**
+** read the uncompressed content2 of the current item from the given offset,
+** with positional reads: the state of the sequential reads is unchanged. Of
+** a FILE_BLOCKS item only the blocks holding [offset, offset + max[ are
+** decoded (and the last one is kept for the next call), a FILE_COMPRESSED
+** one is decoded from its beginning. A FILE_REFERENCE item is read from its
+** original item. Of a FILE_ENCRYPTED item only the chunks holding what is
+** read are decrypted (see CIPHERS).
+**
+** @param nar the reader state (of a regular file)
+** @param ih the current item header
+** @param offset the offset in the uncompressed content2
+** @param buf it will be filled with the uncompressed content
+** @param max the buf size
+**
+** @return returns the readed size (max unless the content ends) or 0 (if
+** offset is after the end). -1 or -errno on error.
+*/
+int libnar_pread_item(nar_reader* nar, item_header const* ih,
+                      uint64_t const offset, uint8_t* buf, uint32_t const max);
+
+/**
+** get the content2 (the file content in the case of a file) of the current
+** item straight from the mapping (see libnar_map_reader). The content1 and
+** the content2 are then considered as read.
+**
+** @param nar the mapped reader state
+** @param ih the current item header
+** @param ptr it will point to the content2 in the mapping
+** @param length it will be set to the content2 size
+**
+** @return 0 on success, -1 on error.
+*/
+int libnar_map_content2(nar_reader* nar, item_header const* ih,
+                        uint8_t const** ptr, uint64_t* length);
+
+/**
+** write what is left of the content2 of the current item to the given file
+** descriptor. The bytes are moved by the kernel when possible
+** (copy_file_range, sendfile or splice) from the item offset in the archive.
+** The content is written as it is stored (it is up to you to uncrypt or
+** uncompress it if needed), but for a FILE_REFERENCE item: the content of
+** its original item is written uncompressed.
+**
+** @param nar the reader state
+** @param ih the current item header
+** @param out_fd the file descriptor to write the content2 in
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_extract_content2_to_fd(nar_reader* nar, item_header const* ih,
+                                  int out_fd);
+
+/**
+** write the content2 of the item at the given offset of the archive to the
+** given file descriptor, with positional reads only: no reader state is used
+** and the file offset of fd is unchanged. Several threads can extract
+** different items of the same file descriptor at once.
+**
+** @param fd the NAR file descriptor (a regular file)
+** @param offset the offset of the item header (see nar_index_entry.offset)
+** @param ih the item header
+** @param out_fd the file descriptor to write the content2 in
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_pextract_content2_to_fd(int fd, uint64_t const offset,
+                                   item_header const* ih, int out_fd);
+
+/**
+** same as libnar_pextract_content2_to_fd but a FILE_ENCRYPTED item is
+** decrypted, a FILE_COMPRESSED item is uncompressed and a FILE_REFERENCE
+** item is resolved (see libnar_read_content2_decoded).
+**
+** @param compression_type the compression type of the archive (nar_header)
+** @param key the key of the FILE_ENCRYPTED items (see libnar_open_key), or
+** NULL
+*/
+int libnar_pextract_content2_decoded_to_fd(int fd, uint64_t const offset,
+                                           item_header const* ih,
+                                           uint64_t const compression_type,
+                                           void const* key, int out_fd);
+
 /**
 ** @param nar the reader state
 ** @param ih the previous item_state (if NULL, do nothing and return 0)
@@ -282,4 +1074,218 @@ int libnar_read_content2(nar_reader* nar, item_header const* ih,
 */
 int libnar_jump_to_next_item_header(nar_reader* nar, item_header const* ih);
 
+/**
+** get the counters of a reader and of a writer (see STATS), added together:
+** for example the ones of the reader and of the writer of a copy
+**
+** @param reader the reader state, or NULL
+** @param writer the writer state, or NULL
+** @param stats it will be filled with the counters
+**
+** @return 0 on success, -1 on error.
+*/
+int libnar_get_stats(nar_reader const* reader, nar_writer const* writer,
+                     nar_stats* stats);
+
+/**
+** add the counters of the reads done by the calling thread with the
+** nar_archive calls and the libnar_pextract_* calls to stats. These calls
+** share no state: each thread counts its own reads, the workers of a pool
+** add theirs to sum them.
+**
+** @param stats the counters to add to
+**
+** @return 0 on success, -1 on error.
+*/
+int libnar_add_thread_stats(nar_stats* stats);
+
+/**
+** load the INDEX item given by the nar_header.index_position, and the items
+** appended after it. nar->index.entries then lists all the item files (a
+** filepath may be listed several times: the last entry is the current one).
+**
+** @param nar the reader state
+** @param nh the nar_header (use libnar_read_nar_header to get it)
+**
+** @return 0 on success, -1 if there is no index or -errno on error.
+*/
+int libnar_open_index(nar_reader* nar, nar_header const* nh);
+
+/**
+** look for the item file named filepath in the loaded index, seek to it and
+** read its item header. Then use libnar_read_content1/libnar_read_content2
+** as if the item was reached with libnar_read_item_header.
+**
+** @param nar the reader state (with an opened index)
+** @param filepath the filepath of the item to look for
+** @param length_filepath the filepath size
+** @param ih a pointer to the return value. It must not be null.
+**
+** @return 0 on success and *ih is filled. -1 if not found or -errno on error.
+*/
+int libnar_lookup(nar_reader* nar,
+                  char const* filepath, uint64_t const length_filepath,
+                  item_header* ih);
+
+/**
+** release the loaded index
+**
+** @param nar the reader state
+*/
+void libnar_close_index(nar_reader* nar);
+
+/*
+** ---- ARCHIVE
+**
+** An archive opened once and never modified afterwards: the calls below
+** only use positional reads (pread or the mapping) and no shared state, so
+** many threads may serve reads from the same nar_archive without locking.
+*/
+
+typedef struct {
+  int fd;
+  uint64_t length;
+  nar_header header;
+
+  /* the mapping of the archive (NULL if it can't be mapped) */
+  uint8_t const* map;
+
+  /* the item files: from the INDEX item, or from a scan of the archive */
+  nar_index index;
+
+  /* the hash tree of the SIGN item (NULL if none, see libnar_verify_tree) */
+  void* tree;
+
+  /* the key of the FILE_ENCRYPTED items (see libnar_set_archive_key) */
+  void const* key;
+} nar_archive;
+
+/**
+** an item file of an archive: the offset of its item header and the header
+*/
+typedef struct {
+  uint64_t offset;
+  item_header header;
+} nar_item;
+
+/**
+** open the archive: read its NAR HEADER and list its item files.
+**
+** @param archive the archive to initialize
+** @param fd the NAR file descriptor (a regular file, the archive keeps it but
+** does not close it)
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_open_archive(nar_archive* archive, int fd);
+
+/**
+** release the archive (once no thread uses it anymore)
+**
+** @param archive the archive to release
+*/
+void libnar_close_archive(nar_archive* archive);
+
+/**
+** set the key of the FILE_ENCRYPTED items read by
+** libnar_pread_content2_decoded (before the archive is shared by threads)
+**
+** @param archive the opened archive
+** @param key the key (see libnar_open_key), NULL to unset it. It has to live
+** as long as it is set.
+**
+** @return 0 on success. -1 on error.
+*/
+int libnar_set_archive_key(nar_archive* archive, void const* key);
+
+/**
+** read the item header at the given offset (see nar_index_entry.offset)
+**
+** @param archive the opened archive
+** @param offset the offset of the item header in the archive
+** @param item it will be filled with the item
+**
+** @return 0 on success. -1 or -errno on error.
+*/
+int libnar_pread_item_header(nar_archive const* archive, uint64_t const offset,
+                             nar_item* item);
+
+/**
+** look for the item file named filepath (the last one appended)
+**
+** @param archive the opened archive
+** @param filepath the filepath of the item to look for
+** @param length_filepath the filepath size
+** @param item it will be filled with the item
+**
+** @return 0 on success. -1 if not found or -errno on error.
+*/
+int libnar_archive_lookup(nar_archive const* archive,
+                          char const* filepath, uint64_t const length_filepath,
+                          nar_item* item);
+
+/**
+** read the content1 (filename in the case of a file) of the item from the
+** given offset
+**
+** @return returns the readed size (max unless the content ends) or 0 (if
+** offset is after the end). -1 or -errno on error.
+*/
+int libnar_pread_content1(nar_archive const* archive, nar_item const* item,
+                          uint64_t const offset, char* buf, uint32_t const max);
+
+/**
+** read the content2 (the file content in the case of a file), as it is
+** stored, of the item from the given offset
+**
+** @return returns the readed size (max unless the content ends) or 0 (if
+** offset is after the end). -1 or -errno on error.
+*/
+int libnar_pread_content2(nar_archive const* archive, nar_item const* item,
+                          uint64_t const offset, uint8_t* buf, uint32_t const max);
+
+/**
+** same as libnar_pread_content2 but of the uncompressed content2 (see
+** libnar_pread_item): of a FILE_BLOCKS item only the blocks holding
+** [offset, offset + max[ are decoded, of a FILE_ENCRYPTED item only the
+** chunks holding them are decrypted, a FILE_REFERENCE item is read from its
+** original item.
+*/
+int libnar_pread_content2_decoded(nar_archive const* archive,
+                                  nar_item const* item, uint64_t const offset,
+                                  uint8_t* buf, uint32_t const max);
+
+/**
+** check the item with its checksum (see CHECKSUMS) and with its digest in the
+** SIGN item (see SIGN), both computed in a single read of the item. The
+** digests themselves are checked by libnar_verify_tree. The original item of
+** a FILE_REFERENCE item is checked too. It can be called by several threads
+** on the same archive.
+**
+** @param archive the opened archive
+** @param item the item to check
+**
+** @return 0 if the digest matches (and the checksum if the item has one), 2
+** if the item has no digest but its checksum matches, 1 if it has neither,
+** -EBADMSG if one does not match (or if the reference can't be resolved). -1
+** or -errno on error.
+*/
+int libnar_verify_item(nar_archive const* archive, nar_item const* item);
+
+/**
+** check the SIGN item of the archive: the root computed from the digests of
+** the items is the one recorded, and the digests are the ones of the items
+** of the index (the items appended after the SIGN item have no digest).
+**
+** @param archive the opened archive
+** @param root it will be filled with the root (NAR_DIGEST_SIZE bytes)
+** @param signature it will point to the signature of the root (NULL if none)
+** @param signature_length it will be set to the signature length
+**
+** @return 0 if the tree matches, -EBADMSG if not, 1 if the archive has no
+** SIGN item. -1 or -errno on error.
+*/
+int libnar_verify_tree(nar_archive const* archive, uint8_t* root,
+                       uint8_t const** signature, uint32_t* signature_length);
+
 #endif /* !LIBNAR_H_ */
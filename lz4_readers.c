@@ -0,0 +1,239 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "nar.h"
+#include "lz4_readers.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4frame.h>
+
+typedef struct {
+  FILE* input;
+
+  int started;
+  int finished;
+  LZ4F_cctx* cctx;
+  LZ4F_preferences_t preferences;
+
+  /* what has been compressed but not returned yet: out[offset, length[ */
+  uint8_t* out;
+  size_t out_capacity;
+  size_t out_offset;
+  size_t out_length;
+  uint8_t in[LZ4_BUFFER_SIZE];
+  /* the bytes read from the input */
+  uint64_t consumed;
+} lz4_reader_state;
+
+int lz4_configure(struct nar_options* opts, char const* parameters)
+{
+  char* end;
+  long value;
+
+  if (!strcmp(parameters, "hc")) {
+    opts->compression_level = LZ4_HC_LEVEL;
+    return 0;
+  }
+
+  value = strtol(parameters, &end, 10);
+  if (end == parameters || *end != '\0' || value < -65537 || value > 12) {
+    ERROR("the lz4 parameter is hc or a level up to 12: %s", parameters);
+    return -1;
+  }
+  opts->compression_level = value;
+
+  return 0;
+}
+
+void* init_lz4_reader(struct nar_options const* opts)
+{
+  lz4_reader_state* lrs;
+
+  if (opts->input == NULL) {
+    return NULL;
+  }
+
+  lrs = calloc(1, sizeof(lz4_reader_state));
+  if (lrs == NULL) {
+    return NULL;
+  }
+
+  lrs->input = fopen(opts->input, "r");
+  if (lrs->input == NULL) {
+    ERROR("open(%s) errno(%d): %s", opts->input, errno, strerror(errno));
+    free(lrs);
+    return NULL;
+  }
+
+  if (opts->compression_level != NAR_DEFAULT_LEVEL) {
+    lrs->preferences.compressionLevel = opts->compression_level;
+  }
+
+  lrs->out_capacity = LZ4F_HEADER_SIZE_MAX
+                    + LZ4F_compressBound(sizeof(lrs->in), &lrs->preferences);
+  lrs->out = malloc(lrs->out_capacity);
+  if (lrs->out == NULL
+      || LZ4F_isError(LZ4F_createCompressionContext(&lrs->cctx, LZ4F_VERSION))) {
+    ERROR("unable to initialize lz4");
+    fclose(lrs->input);
+    free(lrs->out);
+    free(lrs);
+    return NULL;
+  }
+
+  DPRINTF("initialization done");
+  return lrs;
+}
+
+void close_lz4_reader(void* opaque)
+{
+  lz4_reader_state* lrs = opaque;
+
+  if (lrs != NULL) {
+    fclose(lrs->input);
+    LZ4F_freeCompressionContext(lrs->cctx);
+    free(lrs->out);
+    free(lrs);
+  }
+}
+
+int lz4_reader(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  lz4_reader_state* lrs = opaque;
+  uint32_t have = 0;
+  size_t length;
+  size_t ret;
+
+  if (lrs == NULL) {
+    DPRINTF("opaque(%p)", lrs);
+    return -1;
+  }
+
+  while (have < max) {
+    if (lrs->out_offset < lrs->out_length) {
+      length = lrs->out_length - lrs->out_offset;
+      length = (length > max - have) ? max - have : length;
+      memcpy(&buf[have], &lrs->out[lrs->out_offset], length);
+      lrs->out_offset += length;
+      have += length;
+      continue;
+    }
+
+    if (lrs->finished) {
+      break;
+    }
+
+    /* the next part of the frame: its header, a block or its end */
+    if (!lrs->started) {
+      ret = LZ4F_compressBegin(lrs->cctx, lrs->out, lrs->out_capacity,
+                               &lrs->preferences);
+      lrs->started = 1;
+    } else {
+      length = fread(lrs->in, sizeof(uint8_t), sizeof(lrs->in), lrs->input);
+      if (ferror(lrs->input)) {
+        DPRINTF("error on read");
+        return -1;
+      }
+      lrs->consumed += length;
+
+      if (length > 0) {
+        ret = LZ4F_compressUpdate(lrs->cctx, lrs->out, lrs->out_capacity,
+                                  lrs->in, length, NULL);
+      } else {
+        ret = LZ4F_compressEnd(lrs->cctx, lrs->out, lrs->out_capacity, NULL);
+        lrs->finished = 1;
+      }
+    }
+
+    if (LZ4F_isError(ret)) {
+      ERROR("lz4: %s", LZ4F_getErrorName(ret));
+      return -1;
+    }
+    lrs->out_offset = 0;
+    lrs->out_length = ret;
+  }
+
+  return have;
+}
+
+int lz4_size(void* opaque, uint64_t* size)
+{
+  lz4_reader_state* lrs = opaque;
+
+  if (lrs == NULL || size == NULL) {
+    DPRINTF("opaque(%p) size(%p)", lrs, size);
+    return -1;
+  }
+
+  fseek(lrs->input, 0, SEEK_END);
+  *size = ftell(lrs->input);
+  fseek(lrs->input, 0, SEEK_SET);
+
+  return 0;
+}
+
+int lz4_consumed(void* opaque, uint64_t* consumed)
+{
+  lz4_reader_state* lrs = opaque;
+
+  if (lrs == NULL || consumed == NULL) {
+    DPRINTF("opaque(%p) consumed(%p)", lrs, consumed);
+    return -1;
+  }
+
+  *consumed = lrs->consumed;
+
+  return 0;
+}
+
+int lz4_compress_block(struct nar_options const* opts,
+                       uint8_t const* in, uint32_t const length,
+                       uint8_t* out, uint32_t* out_length)
+{
+  LZ4F_preferences_t preferences;
+  size_t ret;
+
+  memset(&preferences, 0, sizeof(LZ4F_preferences_t));
+  if (opts->compression_level != NAR_DEFAULT_LEVEL) {
+    preferences.compressionLevel = opts->compression_level;
+  }
+
+  ret = LZ4F_compressFrame(out, *out_length, in, length, &preferences);
+  if (LZ4F_isError(ret)) {
+    ERROR("lz4: %s", LZ4F_getErrorName(ret));
+    return -1;
+  }
+  *out_length = ret;
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LZ4_READERS_H_
+# define LZ4_READERS_H_
+
+/* the input buffer of the lz4 engine */
+# define LZ4_BUFFER_SIZE (256 * 1024)
+
+/* the level of "-t lz4:hc" */
+# define LZ4_HC_LEVEL 9
+
+/*
+** parse the parameters of "-t lz4:<parameters>" in the options:
+** <level> (negative: faster, from 3: lz4-hc) or hc
+*/
+int lz4_configure(struct nar_options* opts, char const* parameters);
+void* init_lz4_reader(struct nar_options const* opts);
+void close_lz4_reader(void* opaque);
+int lz4_reader(void* opaque, uint8_t* buf, uint32_t const max);
+int lz4_size(void* opaque, uint64_t* size);
+/* the bytes of the input compressed so far */
+int lz4_consumed(void* opaque, uint64_t* consumed);
+/* compress a whole block in out (*out_length: its size, then the one used) */
+int lz4_compress_block(struct nar_options const* opts,
+                       uint8_t const* in, uint32_t const length,
+                       uint8_t* out, uint32_t* out_length);
+
+#endif /* !LZ4_READERS_H_ */
@@ -35,9 +35,19 @@
 #include "nar.h"
 #include "default_reader.h"
 #include "zlib_readers.h"
+#if defined(HAVE_ZSTD)
+# include "zstd_readers.h"
+#endif
+#if defined(HAVE_LZ4)
+# include "lz4_readers.h"
+#endif
+#if defined(HAVE_OPENSSL)
+# include "openssl_signer.h"
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -46,8 +56,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
-static char short_options[] = "cla:n:e:ht:T:eEC";
+static char short_options[] = "cla:n:e:x:ht:T:eECf:0j:J:M:N:A:B:R:UDKVSk:P:s";
 
 static struct option long_options[] = {
   {"create",   no_argument,       NULL, 'c'},
@@ -58,6 +70,24 @@ static struct option long_options[] = {
   {"narfile",  required_argument, NULL, 'n'},
   {"help",     no_argument,       NULL, 'h'},
   {"extract",  required_argument, NULL, 'e'},
+  {"extract-all", required_argument, NULL, 'x'},
+  {"files-from", required_argument, NULL, 'f'},
+  {"null",       no_argument,       NULL, '0'},
+  {"name",       required_argument, NULL, 'N'},
+  {"threads",    required_argument, NULL, 'j'},
+  {"jobs",       required_argument, NULL, 'J'},
+  {"memory-budget", required_argument, NULL, 'M'},
+  {"auto-compress", required_argument, NULL, 'A'},
+  {"block-size",    required_argument, NULL, 'B'},
+  {"range",         required_argument, NULL, 'R'},
+  {"io-uring",      no_argument,       NULL, 'U'},
+  {"dedup",         no_argument,       NULL, 'D'},
+  {"no-checksum",   no_argument,       NULL, 'K'},
+  {"verify",        no_argument,       NULL, 'V'},
+  {"sign",          no_argument,       NULL, 'S'},
+  {"key",           required_argument, NULL, 'k'},
+  {"cipher-key",    required_argument, NULL, 'P'},
+  {"stats",         no_argument,       NULL, 's'},
 
   {"compression-type", required_argument, NULL, 't'},
   {"cipher-type",      required_argument, NULL, 'T'},
@@ -69,21 +99,61 @@ static struct compression_driver {
   void* opaque;
   get_computed_content callback;
   int   (*size) (void*  opaque, uint64_t* size);
+  /* the bytes of the input compressed so far (NULL: not compressing) */
+  int   (*consumed)(void* opaque, uint64_t* consumed);
   void* (*init) (struct nar_options const* nar);
   void  (*close)(void*  opaque);
+  int   (*configure)(struct nar_options* nar, char const* parameters);
+  int   (*compress)(struct nar_options const* nar,
+                    uint8_t const* in, uint32_t const length,
+                    uint8_t* out, uint32_t* out_length);
 } compression_drivers[COMPRESSION_TYPE_LENGTH + 1] = {
   { .name = "none"
   , .opaque = NULL
   , .callback = default_reader
   , .size = default_size
+  , .consumed = NULL
   , .init = init_default_reader
-  , .close = close_default_reader },
+  , .close = close_default_reader
+  , .configure = NULL
+  , .compress = NULL },
   { .name = "deflate"
   , .opaque = NULL
   , .callback = zlib_reader
   , .size = zlib_size
+  , .consumed = zlib_consumed
   , .init = init_zlib_reader
-  , .close = close_zlib_reader },
+  , .close = close_zlib_reader
+  , .configure = zlib_configure
+  , .compress = zlib_compress_block },
+#if defined(HAVE_ZSTD)
+  { .name = "zstd"
+  , .opaque = NULL
+  , .callback = zstd_reader
+  , .size = zstd_size
+  , .consumed = zstd_consumed
+  , .init = init_zstd_reader
+  , .close = close_zstd_reader
+  , .configure = zstd_configure
+  , .compress = zstd_compress_block },
+#else
+  { .name = "zstd"
+  , .opaque = NULL, .callback = NULL, .init = NULL, .close = NULL},
+#endif
+#if defined(HAVE_LZ4)
+  { .name = "lz4"
+  , .opaque = NULL
+  , .callback = lz4_reader
+  , .size = lz4_size
+  , .consumed = lz4_consumed
+  , .init = init_lz4_reader
+  , .close = close_lz4_reader
+  , .configure = lz4_configure
+  , .compress = lz4_compress_block },
+#else
+  { .name = "lz4"
+  , .opaque = NULL, .callback = NULL, .init = NULL, .close = NULL},
+#endif
 
   { .name = "help"
   , .opaque = NULL, .callback = NULL, .init = NULL, .close = NULL}
@@ -113,6 +183,257 @@ static nar_compression_type to_compression_type(char const* type)
   return ret;
 }
 
+static char const* const cipher_names[CIPHER_TYPE_LENGTH] = {
+  "none",
+  "aes-256-gcm"
+};
+
+static nar_cipher_type to_cipher_type(char const* type)
+{
+  nar_cipher_type ret;
+
+  for (ret = 0; ret < CIPHER_TYPE_LENGTH; ret++) {
+    if (!strcmp(type, cipher_names[ret])) {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+/*
+** a size in bytes with an optional K, M or G suffix (0 if invalid)
+*/
+static uint64_t to_size(char const* size)
+{
+  char* end = NULL;
+  uint64_t ret;
+
+  ret = strtoull(size, &end, 10);
+  switch (*end) {
+  case 'G': ret <<= 10; /* fallthrough */
+  case 'M': ret <<= 10; /* fallthrough */
+  case 'K': ret <<= 10; end++; break;
+  default: break;
+  }
+
+  return (end == size || *end != '\0') ? 0 : ret;
+}
+
+/*
+** ---- BLOCKS
+**
+** With --block-size, a file is cut in blocks compressed independently by the
+** driver of the archive, followed by the table of their offsets (see
+** FILE_BLOCKS in libnar.h): libnar_pread_item then reads any part of it by
+** uncompressing the blocks of this part only.
+*/
+
+typedef struct {
+  struct compression_driver* cd;
+  struct nar_options opts;
+  FILE* input;
+
+  uint8_t* in;
+  uint32_t block_size;
+
+  /* what is compressed but not returned yet: out[offset, length[ */
+  uint8_t* out;
+  uint64_t out_capacity;
+  uint64_t out_offset;
+  uint64_t out_length;
+
+  /* the offset of each block_header in the content2 */
+  uint64_t* offsets;
+  uint64_t blocks;
+  uint64_t capacity;
+  uint64_t position;
+  int finished;
+  /* the bytes read from the input */
+  uint64_t consumed;
+} blocks_state;
+
+/* what a compressed block may need */
+static uint64_t block_bound(uint64_t size)
+{
+  return size + (size >> 4) + 4096;
+}
+
+static void close_blocks_reader(void* opaque)
+{
+  blocks_state* bs = opaque;
+
+  if (bs != NULL) {
+    if (bs->input != NULL) {
+      fclose(bs->input);
+    }
+    free(bs->in);
+    free(bs->out);
+    free(bs->offsets);
+    free(bs);
+  }
+}
+
+/*
+** opts->compression_type is the one of the archive
+*/
+static void* init_blocks_reader(struct nar_options const* opts)
+{
+  blocks_state* bs;
+
+  if (opts->input == NULL || opts->block_size == 0
+      || compression_drivers[opts->compression_type].compress == NULL) {
+    ERROR("the blocks need a compression type");
+    return NULL;
+  }
+
+  bs = calloc(1, sizeof(blocks_state));
+  if (bs == NULL) {
+    return NULL;
+  }
+  bs->cd = &compression_drivers[opts->compression_type];
+  bs->opts = *opts;
+  bs->block_size = opts->block_size;
+  bs->out_capacity = sizeof(block_header) + block_bound(bs->block_size);
+  bs->in = malloc(bs->block_size);
+  bs->out = malloc(bs->out_capacity);
+  bs->input = fopen(opts->input, "r");
+  if (bs->input == NULL) {
+    ERROR("open(%s) errno(%d): %s", opts->input, errno, strerror(errno));
+  }
+  if (bs->in == NULL || bs->out == NULL || bs->input == NULL) {
+    close_blocks_reader(bs);
+    return NULL;
+  }
+
+  return bs;
+}
+
+/*
+** fill bs->out with the next block, or with the end of the blocks and the
+** table once the input ends
+*/
+static int blocks_next(blocks_state* bs)
+{
+  block_trailer bt = { bs->block_size, bs->blocks };
+  block_header bh = { 0, 0 };
+  uint64_t* offsets;
+  uint8_t* out;
+  uint64_t length;
+  uint32_t out_length;
+
+  length = fread(bs->in, sizeof(uint8_t), bs->block_size, bs->input);
+  if (ferror(bs->input)) {
+    DPRINTF("error on read");
+    return -1;
+  }
+  bs->consumed += length;
+
+  if (length > 0) {
+    if (bs->blocks == bs->capacity) {
+      bs->capacity = (bs->capacity) ? bs->capacity * 2 : 64;
+      offsets = realloc(bs->offsets, bs->capacity * sizeof(uint64_t));
+      if (offsets == NULL) {
+        return -1;
+      }
+      bs->offsets = offsets;
+    }
+    bs->offsets[bs->blocks++] = bs->position;
+
+    out_length = bs->out_capacity - sizeof(block_header);
+    if (bs->cd->compress(&bs->opts, bs->in, length,
+                         &bs->out[sizeof(block_header)], &out_length)) {
+      return -1;
+    }
+    bh.length = out_length;
+    bh.size = length;
+    memcpy(bs->out, &bh, sizeof(block_header));
+    bs->out_length = sizeof(block_header) + out_length;
+  } else {
+    length = sizeof(block_header) + bs->blocks * sizeof(uint64_t)
+           + sizeof(block_trailer);
+    if (length > bs->out_capacity) {
+      out = realloc(bs->out, length);
+      if (out == NULL) {
+        return -1;
+      }
+      bs->out = out;
+      bs->out_capacity = length;
+    }
+    memcpy(bs->out, &bh, sizeof(block_header));
+    if (bs->blocks > 0) {
+      memcpy(&bs->out[sizeof(block_header)], bs->offsets,
+             bs->blocks * sizeof(uint64_t));
+    }
+    memcpy(&bs->out[length - sizeof(block_trailer)], &bt, sizeof(block_trailer));
+    bs->out_length = length;
+    bs->finished = 1;
+  }
+  bs->out_offset = 0;
+
+  return 0;
+}
+
+static int blocks_reader(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  blocks_state* bs = opaque;
+  uint32_t have = 0;
+  uint64_t length;
+
+  if (bs == NULL) {
+    DPRINTF("opaque(%p)", bs);
+    return -1;
+  }
+
+  while (have < max) {
+    if (bs->out_offset == bs->out_length) {
+      if (bs->finished) {
+        break;
+      }
+      if (blocks_next(bs) != 0) {
+        return -1;
+      }
+    }
+
+    length = bs->out_length - bs->out_offset;
+    if (length > max - have) {
+      length = max - have;
+    }
+    memcpy(&buf[have], &bs->out[bs->out_offset], length);
+    bs->out_offset += length;
+    bs->position += length;
+    have += length;
+  }
+
+  return have;
+}
+
+static int blocks_consumed(void* opaque, uint64_t* consumed)
+{
+  blocks_state* bs = opaque;
+
+  if (bs == NULL || consumed == NULL) {
+    DPRINTF("opaque(%p) consumed(%p)", bs, consumed);
+    return -1;
+  }
+
+  *consumed = bs->consumed;
+
+  return 0;
+}
+
+static struct compression_driver blocks_driver = {
+  .name = "blocks"
+  , .opaque = NULL
+  , .callback = blocks_reader
+  , .size = NULL
+  , .consumed = blocks_consumed
+  , .init = init_blocks_reader
+  , .close = close_blocks_reader
+  , .configure = NULL
+  , .compress = NULL
+};
+
 # define LICENCE_MESSAGE                                       \
 "Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>\n" \
 "this implementation of nar comes without any warranty\n"
@@ -131,269 +452,1936 @@ static void show_help_message(char const* name)
          "                        specify a narfile\n"
          "    --create|-c create\n"
          "                        create the file specified in the option --narfile\n"
-         "    --append=<path>|-a <path>\n"
-         "                        append the file or directory pointed by the <path> in\n"
-         "                        the narfile specified in the option --narfile\n"
+         "    --append=<path>|-a <path> [<path>...]\n"
+         "                        append the files or directories (recursively) pointed\n"
+         "                        by the <path>s in the narfile specified in the option\n"
+         "                        --narfile (- for the standard input)\n"
+         "    --name=<name>|-N <name>\n"
+         "                        the filepath of the item read from the standard input\n"
+         "                        (default: -)\n"
+         "    --files-from=<file>|-f <file>\n"
+         "                        append the files or directories listed in <file> (one\n"
+         "                        per line, - for the standard input)\n"
+         "    --null|-0\n"
+         "                        the paths of --files-from are separated by NUL\n"
+         "    --compression-type=<type>[:<parameters>]|-t <type>[:<parameters>]\n"
+         "                        the compression of the archive (with --create, see\n"
+         "                        -t help) and its parameters when compressing, for\n"
+         "                        deflate: <level>[:<strategy>[:<window>[:<memlevel>]]]\n"
+         "                        (strategy: default, filtered, huffman, rle, fixed)\n"
+         "                        zstd: <level>[:long[=<windowlog>]] (level < 0: fast)\n"
+         "                        lz4: <level> (level < 0: fast, level >= 3: hc) or hc\n"
+         "    --auto-compress=<gain>|-A <gain>\n"
+         "                        compress (as --compress) only the files whose first\n"
+         "                        blocks shrink by <gain> percent at least with a fast\n"
+         "                        deflate, the others are stored as is (see --list)\n"
+         "    --block-size=<size>|-B <size>\n"
+         "                        with --compress, compress the files in independent\n"
+         "                        blocks of <size> bytes (K, M or G suffixes, 1M is a\n"
+         "                        good start): a part of a large file is then read\n"
+         "                        without uncompressing all what comes before it\n"
+         "    --dedup|-D\n"
+         "                        with --append, store a file whose content is the\n"
+         "                        one of a file appended before it by the same command\n"
+         "                        as a reference to this file\n"
+         "    --no-checksum|-K\n"
+         "                        with --append, do not store the CRC32C of the\n"
+         "                        appended files (see --verify)\n"
+         "    --sign|-S\n"
+         "                        with --append, keep a hash tree of the files of the\n"
+         "                        archive (then kept by the next appends), with\n"
+         "                        --extract, check the file with it first\n"
+         "    --encrypt|-E\n"
+         "                        with --append, encrypt the appended files with the\n"
+         "                        key of --cipher-key (see --cipher-type)\n"
+         "    --cipher-type=<type>|-T <type>\n"
+         "                        with --create, the cipher of the encrypted files:\n"
+         "                        none or aes-256-gcm (make OPENSSL=1)\n"
+         "    --cipher-key=<file>|-P <file>\n"
+         "                        the key of the encrypted files, to append them\n"
+         "                        (with --encrypt) or to extract them: <file> holds\n"
+         "                        the 32 bytes of the key or their 64 hexadecimal\n"
+         "                        digits\n"
+         "    --key=<file>|-k <file>\n"
+         "                        with --append, sign the tree with the PEM private\n"
+         "                        key <file> (an append without it drops the\n"
+         "                        signature), with --verify or --extract, check the\n"
+         "                        signature with the PEM public key <file> (make\n"
+         "                        OPENSSL=1)\n"
+         "    --threads=<n>|-j <n>\n"
+         "                        compress the large files with <n> threads (the\n"
+         "                        archive stays readable by a single threaded nar)\n"
+         "    --jobs=<n>|-J <n>\n"
+         "                        read and compress (or extract with --extract-all)\n"
+         "                        <n> files at once, the files are still appended in\n"
+         "                        the same order\n"
+         "    --memory-budget=<size>|-M <size>\n"
+         "                        the memory (K, M or G suffixes) used by --jobs to\n"
+         "                        hold the compressed files (default: 64M)\n"
+         "    --io-uring|-U\n"
+         "                        with --append, --list or --extract, keep several\n"
+         "                        reads or writes of the archive in flight with\n"
+         "                        io_uring (synchronous I/O if it is not available)\n"
+         "    --stats|-s\n"
+         "                        print at exit (on the standard error) the counters\n"
+         "                        of libnar: bytes, syscalls, seeks, padding, time\n"
+         "                        in the callbacks and in the writes, compression,\n"
+         "                        and the throughput\n"
          "    --list|-l\n"
          "                        list the content of the archive given by option\n"
          "                        --narfile\n"
          "    --extract=<path>|-e <path>\n"
          "                        extract the item file named (path) from the given\n"
-         "                        narfile specified in the option --narfile",
+         "                        narfile specified in the option --narfile\n"
+         "    --range=<offset>[:<length>]|-R <offset>[:<length>]\n"
+         "                        with --extract, extract <length> bytes (default: up\n"
+         "                        to the end) from <offset> only (see --block-size)\n"
+         "    --extract-all=<dir>|-x <dir>\n"
+         "                        extract all the item files of the narfile in the\n"
+         "                        directory <dir> (with --jobs workers)\n"
+         "    --verify|-V\n"
+         "                        check the checksums of all the items of the narfile\n"
+         "                        and its hash tree (with --jobs workers)",
          name, name);
 }
 
-static int main_append_file(struct nar_options const* opts)
-{
+struct append_context {
   nar_writer nw;
-  nar_reader nr;
-  nar_header nh;
-  struct compression_driver* cd = compression_drivers; /* Set to default */
-  int ofd;
+  struct nar_options const* opts;
+  struct compression_driver* cd;
+  /* the flags of the compressed items */
+  uint64_t flags;
+
+  /* the archive itself is never appended */
+  struct stat archive;
+
+  /* if set, the files are queued instead of appended (see --jobs) */
+  struct pipeline* pipeline;
+};
+
+static int append_file_fd(nar_writer* nw, char const* input, uint64_t const flags)
+{
+  struct stat st;
+  int ifd;
+  int ret;
+
+  ifd = open(input, O_RDONLY);
+  if (ifd == -1) {
+    ERROR("open(%s) errno(%d): %s", input, errno, strerror(errno));
+    return -errno;
+  }
+
+  if (-1 == fstat(ifd, &st)) {
+    ERROR("fstat(%s) errno(%d): %s", input, errno, strerror(errno));
+    close(ifd);
+    return -errno;
+  }
+
+  ret = libnar_append_file_fd(nw, flags, input, strlen(input), ifd, st.st_size);
+  close(ifd);
+
+  return ret;
+}
+
+/*
+** with --auto-compress, is compressing the file input worth it? The standard
+** input can't be sampled: it is always compressed.
+*/
+static int compression_skipped(struct append_context* ctx, char const* input)
+{
+  int gain;
+
+  if (ctx->opts->min_gain < 0) {
+    return 0;
+  }
+
+  if (zlib_sample_gain(input, AUTO_SAMPLE_SIZE, &gain) != 0) {
+    /* the append reports the error */
+    return 0;
+  }
+  DPRINTF("%s: %d%% gain expected", input, gain);
+
+  return gain < ctx->opts->min_gain;
+}
+
+static int append_file(struct append_context* ctx, char const* input)
+{
+  struct compression_driver* cd = ctx->cd;
+  struct nar_options opts;
+  char const* name = input;
+  uint64_t consumed;
+  void* opaque;
+  int ret;
+
+  if (!strcmp(input, "-")) {
+    /* the standard input: read until its end, from a pipe too */
+    input = "/dev/stdin";
+    name = (ctx->opts->name != NULL) ? ctx->opts->name : "-";
+  }
+
+  if (ctx->opts->compress && name == input && compression_skipped(ctx, input)) {
+    ret = append_file_fd(&ctx->nw, input, FILE_STORED);
+  } else if (ctx->opts->compress || name != input) {
+    opts = *ctx->opts;
+    opts.input = input;
+
+    opaque = cd->init(&opts);
+    if (opaque == NULL) {
+      ERROR("can't initialize the compression_driver: %s", cd->name);
+      return -1;
+    }
+
+    /* the length of the item is the one of what the driver gives */
+    ret = libnar_append_file(&ctx->nw,
+                             (ctx->opts->compress) ? ctx->flags : 0,
+                             name, strlen(name), NAR_UNKNOWN_LENGTH,
+                             cd->callback, opaque);
+    /* libnar only gets the compressed content: the driver read the input */
+    if (ret == 0 && ctx->opts->compress && cd->consumed != NULL
+        && cd->consumed(opaque, &consumed) == 0) {
+      ctx->nw.stats.compression_in += consumed;
+    }
+    cd->close(opaque);
+  } else {
+    /* not compressed: let the kernel copy the file */
+    ret = append_file_fd(&ctx->nw, input, 0);
+  }
+
+  if (ret != 0) {
+    ERROR("append(%s) errno(%d): %s", name, -ret, strerror(-ret));
+  }
+
+  return ret;
+}
+
+/*
+** ---- PIPELINE
+**
+** With --jobs, the files to append are first listed. Then a pool of workers
+** reads and compresses them in memory while the main thread appends them, in
+** the order of the list, to the archive. The memory in flight is bounded by
+** --memory-budget: a file which can't fit in is streamed by the main thread.
+*/
+
+enum pipeline_state {
+  ITEM_PENDING = 0,
+  ITEM_READY,
+  ITEM_FAILED,
+  ITEM_STORED, /* not worth compressing (see --auto-compress) */
+  ITEM_DIRECT  /* appended by the main thread itself */
+};
+
+struct pipeline_item {
+  char* path;
+  uint64_t size;
+  enum pipeline_state state;
+
+  uint8_t* data;
+  uint64_t length;
+  uint64_t reserved; /* accounted in pipeline.in_flight */
+};
+
+struct pipeline {
+  struct append_context* ctx;
+
+  struct pipeline_item* items;
+  size_t length;
+  size_t capacity;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;    /* an item has been compressed */
+  pthread_cond_t released; /* the main thread released some memory */
+  size_t next_job;
+  size_t next_write;
+  uint64_t in_flight;
+  uint64_t budget;
+  int stop;
+};
+
+struct buffer_cursor {
+  uint8_t const* data;
   uint64_t length;
-  uint64_t flags = 0;
+};
+
+static int buffer_reader(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  struct buffer_cursor* cursor = opaque;
+  uint32_t length;
+
+  length = (cursor->length > max) ? max : cursor->length;
+  memcpy(buf, cursor->data, length);
+  cursor->data += length;
+  cursor->length -= length;
+
+  return length;
+}
+
+/* what a compressed file may need: it is grown if needed */
+static uint64_t pipeline_reserve(uint64_t size)
+{
+  return size + (size >> 4) + 4096;
+}
+
+static int pipeline_push(struct pipeline* pl, char const* path, uint64_t size)
+{
+  struct pipeline_item* item;
+
+  if (pl->length == pl->capacity) {
+    size_t capacity = (pl->capacity) ? pl->capacity * 2 : 64;
+
+    item = realloc(pl->items, capacity * sizeof(struct pipeline_item));
+    if (item == NULL) {
+      return -ENOMEM;
+    }
+    pl->items = item;
+    pl->capacity = capacity;
+  }
+
+  item = &pl->items[pl->length];
+  memset(item, 0, sizeof(struct pipeline_item));
+  item->path = strdup(path);
+  if (item->path == NULL) {
+    return -ENOMEM;
+  }
+  item->size = size;
+  if (!pl->ctx->opts->compress || size == NAR_UNKNOWN_LENGTH
+      || pipeline_reserve(size) > pl->budget) {
+    item->state = ITEM_DIRECT;
+  }
+  pl->length++;
+
+  return 0;
+}
+
+static int pipeline_compress(struct append_context* ctx, struct pipeline_item* item)
+{
+  struct compression_driver* cd = ctx->cd;
+  struct nar_options opts;
+  uint64_t capacity = item->reserved;
+  void* opaque;
   int ret = 0;
 
-  if (opts == NULL || opts->output == NULL || opts->input == NULL) {
-    DPRINTF("opts(%p) opts->output(%p) opts->input(%p)",
-            opts, (opts) ? opts->output : NULL, (opts) ? opts->output : NULL);
+  opts = *ctx->opts;
+  opts.input = item->path;
+
+  /* not cd->opaque: it is shared by the workers */
+  opaque = cd->init(&opts);
+  if (opaque == NULL) {
+    ERROR("can't initialize the compression_driver: %s", cd->name);
     return -1;
   }
 
-  ofd = open(opts->output, O_RDWR);
-  if (ofd == -1) {
-    ERROR("open(%s) errno(%d): %s",
-          opts->output, errno, strerror(errno));
-    return -1;
+  item->data = malloc(capacity);
+  while (item->data != NULL) {
+    uint64_t max = capacity - item->length;
+
+    if (max == 0) {
+      uint8_t* data = realloc(item->data, capacity * 2);
+
+      if (data == NULL) {
+        break;
+      }
+      item->data = data;
+      capacity *= 2;
+      continue;
+    }
+
+    ret = cd->callback(opaque, &item->data[item->length],
+                       (max > LIBNAR_WRITE_BUFFER_SIZE) ? LIBNAR_WRITE_BUFFER_SIZE : max);
+    if (ret <= 0) {
+      break;
+    }
+    item->length += ret;
   }
+  cd->close(opaque);
 
-  memset(&nh, 0, sizeof(nar_header));
+  if (item->data == NULL || ret != 0) {
+    ERROR("compress(%s) failed", item->path);
+    ret = -1;
+  }
 
-  if (opts->compress) {
-    libnar_init_reader(&nr, ofd);
-    libnar_read_nar_header(&nr, &nh);
-    libnar_close_reader(&nr);
+  item->reserved = capacity;
+  return ret;
+}
 
-    if (!IS_COMPRESSION_SUPPORTED(nh.compression_type)) {
-      ERROR("compression type not supported %llu", (unsigned long long int) nh.compression_type);
-      goto exit_close_output;
+static void* pipeline_worker(void* opaque)
+{
+  struct pipeline* pl = opaque;
+  struct pipeline_item* item;
+  uint64_t reserved;
+  size_t i;
+  int ret;
+
+  pthread_mutex_lock(&pl->lock);
+  while (!pl->stop && pl->next_job < pl->length) {
+    i = pl->next_job++;
+    item = &pl->items[i];
+    if (item->state == ITEM_DIRECT) {
+      continue;
+    }
+
+    /* the next item to write never waits: the budget can't block the writer */
+    reserved = pipeline_reserve(item->size);
+    while (!pl->stop && i != pl->next_write
+           && pl->in_flight + reserved > pl->budget) {
+      pthread_cond_wait(&pl->released, &pl->lock);
+    }
+    if (pl->stop) {
+      break;
+    }
+    pl->in_flight += reserved;
+    item->reserved = reserved;
+    pthread_mutex_unlock(&pl->lock);
+
+    if (compression_skipped(pl->ctx, item->path)) {
+      pthread_mutex_lock(&pl->lock);
+      pl->in_flight -= reserved;
+      item->reserved = 0;
+      item->state = ITEM_STORED;
+      pthread_cond_broadcast(&pl->released);
+      pthread_cond_broadcast(&pl->ready);
+      continue;
     }
 
-    cd = &compression_drivers[nh.compression_type];
-    flags |= FILE_COMPRESSED;
+    ret = pipeline_compress(pl->ctx, item);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->in_flight = pl->in_flight - reserved + item->reserved;
+    item->state = (ret == 0) ? ITEM_READY : ITEM_FAILED;
+    pthread_cond_broadcast(&pl->ready);
   }
+  pthread_mutex_unlock(&pl->lock);
 
-  ret = libnar_init_writer(&nw, ofd);
-  if (ret) {
-    ERROR("init_nar_writer(%s) errno(%d): %s",
-          opts->output, -ret, strerror(-ret));
-    goto exit_close_output;
+  return NULL;
+}
+
+/*
+** compress the queued files with the workers and append them in order
+*/
+static int pipeline_run(struct pipeline* pl, int jobs)
+{
+  struct append_context* ctx = pl->ctx;
+  struct pipeline_item* item;
+  struct buffer_cursor cursor;
+  pthread_t* workers;
+  int workers_length = 0;
+  size_t i;
+  int ret = 0;
+
+  workers = calloc(jobs, sizeof(pthread_t));
+  if (workers == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < (size_t) jobs && i < pl->length; i++) {
+    if (pthread_create(&workers[i], NULL, pipeline_worker, pl) != 0) {
+      ERROR("can't create the worker %zu", i);
+      break;
+    }
+    workers_length++;
+  }
+
+  for (i = 0; ret == 0 && i < pl->length; i++) {
+    item = &pl->items[i];
+
+    pthread_mutex_lock(&pl->lock);
+    while (item->state == ITEM_PENDING && workers_length > 0) {
+      pthread_cond_wait(&pl->ready, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    switch (item->state) {
+    case ITEM_READY:
+      cursor.data = item->data;
+      cursor.length = item->length;
+      ret = libnar_append_file(&ctx->nw, ctx->flags,
+                               item->path, strlen(item->path),
+                               item->length, buffer_reader, &cursor);
+      if (ret == 0) {
+        ctx->nw.stats.compression_in += item->size;
+      }
+      if (ret != 0) {
+        ERROR("append(%s) errno(%d): %s", item->path, -ret, strerror(-ret));
+      }
+      break;
+    case ITEM_FAILED:
+      ret = -1;
+      break;
+    case ITEM_STORED:
+      ret = append_file_fd(&ctx->nw, item->path, FILE_STORED);
+      if (ret != 0) {
+        ERROR("append(%s) errno(%d): %s", item->path, -ret, strerror(-ret));
+      }
+      break;
+    default:
+      /* too large for the budget (or no worker): streamed */
+      ret = append_file(ctx, item->path);
+      break;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    free(item->data);
+    item->data = NULL;
+    pl->in_flight -= item->reserved;
+    item->reserved = 0;
+    pl->next_write = i + 1;
+    pthread_cond_broadcast(&pl->released);
+    pthread_mutex_unlock(&pl->lock);
+  }
+
+  pthread_mutex_lock(&pl->lock);
+  pl->stop = 1;
+  pthread_cond_broadcast(&pl->released);
+  pthread_mutex_unlock(&pl->lock);
+
+  while (workers_length > 0) {
+    pthread_join(workers[--workers_length], NULL);
+  }
+  free(workers);
+
+  return ret;
+}
+
+static void init_pipeline(struct pipeline* pl, struct append_context* ctx)
+{
+  memset(pl, 0, sizeof(struct pipeline));
+  pl->ctx = ctx;
+  pl->budget = ctx->opts->memory_budget;
+  pthread_mutex_init(&pl->lock, NULL);
+  pthread_cond_init(&pl->ready, NULL);
+  pthread_cond_init(&pl->released, NULL);
+}
+
+static void close_pipeline(struct pipeline* pl)
+{
+  size_t i;
+
+  for (i = 0; i < pl->length; i++) {
+    free(pl->items[i].data);
+    free(pl->items[i].path);
+  }
+  free(pl->items);
+
+  pthread_cond_destroy(&pl->released);
+  pthread_cond_destroy(&pl->ready);
+  pthread_mutex_destroy(&pl->lock);
+}
+
+/*
+** append the file or all the files of the directory (recursively)
+*/
+static int append_path(struct append_context* ctx, char const* path)
+{
+  struct dirent** entries;
+  struct stat st;
+  int i, length;
+  int ret = 0;
+
+  if (!strcmp(path, "-")) {
+    if (ctx->pipeline != NULL) {
+      return pipeline_push(ctx->pipeline, path, NAR_UNKNOWN_LENGTH);
+    }
+    return append_file(ctx, path);
+  }
+
+  if (-1 == lstat(path, &st)) {
+    ERROR("stat(%s) errno(%d): %s", path, errno, strerror(errno));
+    return -errno;
+  }
+
+  if (st.st_dev == ctx->archive.st_dev && st.st_ino == ctx->archive.st_ino) {
+    DPRINTF("%s is the archive: skipped", path);
+    return 0;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    if (ctx->pipeline != NULL) {
+      return pipeline_push(ctx->pipeline, path, st.st_size);
+    }
+    return append_file(ctx, path);
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    ERROR("%s is not a regular file nor a directory: skipped", path);
+    return 0;
+  }
+
+  /* sorted: the same directory always gives the same archive */
+  length = scandir(path, &entries, NULL, alphasort);
+  if (length == -1) {
+    ERROR("scandir(%s) errno(%d): %s", path, errno, strerror(errno));
+    return -errno;
+  }
+
+  for (i = 0; i < length; i++) {
+    char const* name = entries[i]->d_name;
+    size_t l = strlen(path);
+    char* child;
+
+    if (ret != 0 || !strcmp(name, ".") || !strcmp(name, "..")) {
+      continue;
+    }
+
+    child = malloc(l + strlen(name) + 2);
+    if (child == NULL) {
+      ret = -ENOMEM;
+      continue;
+    }
+    sprintf(child, (l && path[l - 1] == '/') ? "%s%s" : "%s/%s", path, name);
+    ret = append_path(ctx, child);
+    free(child);
+  }
+
+  for (i = 0; i < length; i++) {
+    free(entries[i]);
+  }
+  free(entries);
+
+  return ret;
+}
+
+/*
+** append all the paths listed in the file (- for the standard input)
+*/
+static int append_files_from(struct append_context* ctx, char const* list)
+{
+  int delimiter = (ctx->opts->null_separated) ? '\0' : '\n';
+  FILE* input;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  int ret = 0;
+
+  input = (!strcmp(list, "-")) ? stdin : fopen(list, "r");
+  if (input == NULL) {
+    ERROR("open(%s) errno(%d): %s", list, errno, strerror(errno));
+    return -errno;
+  }
+
+  while (ret == 0 && (length = getdelim(&line, &size, delimiter, input)) != -1) {
+    if (length > 0 && line[length - 1] == delimiter) {
+      line[--length] = '\0';
+    }
+    if (length > 0) {
+      ret = append_path(ctx, line);
+    }
+  }
+
+  free(line);
+  if (input != stdin) {
+    fclose(input);
+  }
+
+  return ret;
+}
+
+/*
+** an io_uring backend on the archive, NULL if it is not a regular file
+*/
+static void* open_uring(int fd)
+{
+  void* uring = libnar_open_uring(fd, 0, 0);
+
+  if (uring != NULL && !libnar_uring_is_async(uring)) {
+    DPRINTF("io_uring is not available: synchronous I/O");
+  }
+
+  return uring;
+}
+
+/*
+** the key of --key: a private key to sign the root of the SIGN item or a
+** public key to check its signature
+*/
+static void* load_key(struct nar_options const* opts, int const private_key)
+{
+#if defined(HAVE_OPENSSL)
+  return openssl_load_key(opts->key, private_key);
+#else
+  (void) private_key;
+  ERROR("can't load %s: nar is built without OpenSSL", opts->key);
+  return NULL;
+#endif
+}
+
+static void free_key(void* key)
+{
+#if defined(HAVE_OPENSSL)
+  openssl_free_key(key);
+#else
+  (void) key;
+#endif
+}
+
+/*
+** check the signature of the root with the key of --key
+*/
+static int check_signature(void* key, uint8_t const* root,
+                           uint8_t const* signature, uint32_t const length)
+{
+  if (signature == NULL) {
+    ERROR("the archive is not signed");
+    return -1;
+  }
+#if defined(HAVE_OPENSSL)
+  return openssl_verify_root(key, root, signature, length);
+#else
+  (void) key;
+  (void) root;
+  (void) length;
+  return -1;
+#endif
+}
+
+/*
+** maintain the SIGN item of the archive, signed with the key of --key if any
+*/
+static int set_sign(nar_writer* nw, struct nar_options const* opts, void** key)
+{
+  sign_root sign = NULL;
+  int ret;
+
+  if (opts->key != NULL) {
+    *key = load_key(opts, 1);
+    if (*key == NULL) {
+      return -1;
+    }
+#if defined(HAVE_OPENSSL)
+    sign = openssl_sign_root;
+#endif
+  }
+
+  ret = libnar_set_sign(nw, 1, sign, *key);
+  if (ret != 0) {
+    ERROR("can't hash the items of %s errno(%d): %s",
+          opts->output, -ret, strerror(-ret));
+  }
+
+  return ret;
+}
+
+static int hex_digit(char const c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/*
+** the key of --cipher-key for the cipher type of the archive: the file holds
+** the NAR_KEY_SIZE bytes of the key or their hexadecimal digits
+*/
+static void* load_cipher_key(struct nar_options const* opts,
+                             uint64_t const cipher_type)
+{
+  uint8_t key[NAR_KEY_SIZE];
+  char buf[2 * NAR_KEY_SIZE + 2];
+  ssize_t length;
+  void* ret = NULL;
+  int fd;
+  int i;
+
+  if (cipher_type == CIPHER_NONE) {
+    ERROR("%s has no cipher type (see --create --cipher-type)", opts->output);
+    return NULL;
+  }
+
+  fd = open(opts->cipher_key, O_RDONLY);
+  if (fd == -1) {
+    ERROR("open(%s) errno(%d): %s", opts->cipher_key, errno, strerror(errno));
+    return NULL;
+  }
+  length = read(fd, buf, sizeof(buf));
+  close(fd);
+
+  if (length == NAR_KEY_SIZE) {
+    memcpy(key, buf, NAR_KEY_SIZE);
+  } else {
+    if (length > 0 && buf[length - 1] == '\n') {
+      length--;
+    }
+    for (i = 0; length == 2 * NAR_KEY_SIZE && i < NAR_KEY_SIZE; i++) {
+      if (hex_digit(buf[2 * i]) < 0 || hex_digit(buf[2 * i + 1]) < 0) {
+        break;
+      }
+      key[i] = hex_digit(buf[2 * i]) << 4 | hex_digit(buf[2 * i + 1]);
+    }
+    if (length != 2 * NAR_KEY_SIZE || i != NAR_KEY_SIZE) {
+      ERROR("%s: a key is %d bytes or %d hexadecimal digits",
+            opts->cipher_key, NAR_KEY_SIZE, 2 * NAR_KEY_SIZE);
+      memset(buf, 0, sizeof(buf));
+      return NULL;
+    }
+  }
+
+  ret = libnar_open_key(cipher_type, key, NAR_KEY_SIZE);
+  if (ret == NULL) {
+    ERROR("the cipher type %llu of %s is not supported",
+          (unsigned long long int) cipher_type, opts->output);
+  }
+  memset(key, 0, sizeof(key));
+  memset(buf, 0, sizeof(buf));
+
+  return ret;
+}
+
+/*
+** ---- STATS
+**
+** With --stats, each action prints the counters of its reader and of its
+** writer (see libnar_get_stats) and its throughput. --extract-all and
+** --verify read the archive with positional reads shared by their workers:
+** each one adds the counters of its thread (see libnar_add_thread_stats).
+*/
+
+/* the start of the action */
+static struct timespec stats_start;
+
+static void show_stats(struct nar_options const* opts,
+                       nar_reader const* nr, nar_writer const* nw,
+                       nar_stats const* threads,
+                       uint64_t const items, uint64_t bytes)
+{
+  struct timespec now;
+  nar_stats st;
+  double seconds;
+
+  if (!opts->stats) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = (now.tv_sec - stats_start.tv_sec)
+          + (now.tv_nsec - stats_start.tv_nsec) / 1e9;
+  if (seconds <= 0) {
+    seconds = 1e-9;
+  }
+
+  libnar_get_stats(nr, nw, &st);
+  if (threads != NULL) {
+    st = *threads;
+  }
+  if (bytes == 0) {
+    bytes = st.bytes_read + st.bytes_written;
+  }
+
+  fprintf(stderr, "stats: %.6f s, %llu items (%.2f items/s), %llu bytes "
+          "(%.2f MB/s)\n", seconds, (unsigned long long int) items,
+          items / seconds, (unsigned long long int) bytes,
+          bytes / seconds / 1e6);
+  if (nr == NULL && nw == NULL && threads == NULL) {
+    return;
+  }
+  fprintf(stderr, "stats: %llu bytes read, %llu bytes written, "
+          "%llu syscalls (%.2f per item), %llu seeks, %llu padding bytes\n",
+          (unsigned long long int) st.bytes_read,
+          (unsigned long long int) st.bytes_written,
+          (unsigned long long int) st.syscalls,
+          (items) ? (double) st.syscalls / items : 0.0,
+          (unsigned long long int) st.seeks,
+          (unsigned long long int) st.padding);
+  if (nw != NULL) {
+    fprintf(stderr, "stats: %.6f s in the callbacks, %.6f s in the writes\n",
+            st.callback_time / 1e9, st.write_time / 1e9);
+  }
+  if (st.compression_in != 0 || st.compression_out != 0) {
+    fprintf(stderr, "stats: compression %llu bytes in, %llu bytes out\n",
+            (unsigned long long int) st.compression_in,
+            (unsigned long long int) st.compression_out);
+  }
+}
+
+static int main_append_file(struct nar_options const* opts)
+{
+  struct nar_options item_opts;
+  struct append_context ctx;
+  struct pipeline pl;
+  nar_header nh;
+  uint64_t indexed;
+  void* key = NULL;
+  void* cipher_key = NULL;
+  void* uring;
+  int ofd;
+  int i;
+  int ret = 0;
+
+  if (opts == NULL || opts->output == NULL
+      || (opts->input == NULL && opts->inputs_length == 0
+          && opts->files_from == NULL)) {
+    DPRINTF("opts(%p) opts->output(%p) opts->input(%p)",
+            opts, (opts) ? opts->output : NULL, (opts) ? opts->input : NULL);
+    return -1;
+  }
+
+  ofd = open(opts->output, O_RDWR);
+  if (ofd == -1) {
+    ERROR("open(%s) errno(%d): %s",
+          opts->output, errno, strerror(errno));
+    return -1;
+  }
+
+  memset(&ctx, 0, sizeof(struct append_context));
+  ctx.opts = opts;
+  ctx.cd = compression_drivers; /* Set to default */
+  fstat(ofd, &ctx.archive);
+
+  uring = (opts->io_uring) ? open_uring(ofd) : NULL;
+  if (uring != NULL) {
+    ret = libnar_init_writer_io(&ctx.nw, &libnar_uring_io, uring);
+  } else {
+    ret = libnar_init_writer(&ctx.nw, ofd);
+  }
+  if (ret) {
+    ERROR("init_nar_writer(%s) errno(%d): %s",
+          opts->output, -ret, strerror(-ret));
+    libnar_close_uring(uring);
+    close(ofd);
+    return ret;
+  }
+
+  /* the archive is opened, its index loaded and its header read once */
+  ret = libnar_begin_append(&ctx.nw, &nh);
+  if (ret != 0) {
+    ERROR("begin_append(%s) errno(%d): %s",
+          opts->output, -ret, strerror(-ret));
+    goto exit_close_output;
+  }
+  indexed = ctx.nw.index.length;
+
+  if (opts->dedup) {
+    ret = libnar_set_dedup(&ctx.nw, 1);
+  }
+  if (ret == 0 && !opts->no_checksum) {
+    ret = libnar_set_checksum(&ctx.nw, 1);
+  }
+  if (ret == 0 && (opts->sign || opts->key != NULL)) {
+    ret = set_sign(&ctx.nw, opts, &key);
+  }
+  if (ret == 0 && opts->encrypt) {
+    cipher_key = load_cipher_key(opts, nh.cipher_type);
+    ret = (cipher_key != NULL) ? libnar_set_writer_key(&ctx.nw, cipher_key) : -1;
+  }
+
+  if (opts->compress) {
+    if (!IS_COMPRESSION_SUPPORTED(nh.compression_type)) {
+      ERROR("compression type not supported %llu", (unsigned long long int) nh.compression_type);
+      ret = -1;
+    }
+
+    ctx.cd = &compression_drivers[nh.compression_type];
+    ctx.flags = FILE_COMPRESSED;
+
+    if (ret == 0 && opts->block_size) {
+      if (ctx.cd->compress == NULL) {
+        ERROR("the compression type %s can't compress blocks", ctx.cd->name);
+        ret = -1;
+      }
+
+      /* the blocks are compressed by the driver of the archive */
+      item_opts = *opts;
+      item_opts.compression_type = nh.compression_type;
+      ctx.opts = &item_opts;
+      ctx.cd = &blocks_driver;
+      ctx.flags |= FILE_BLOCKS;
+    }
+  }
+
+  if (opts->jobs > 1) {
+    init_pipeline(&pl, &ctx);
+    ctx.pipeline = &pl;
+  }
+
+  if (ret == 0 && opts->input != NULL) {
+    ret = append_path(&ctx, opts->input);
+  }
+
+  for (i = 0; ret == 0 && i < opts->inputs_length; i++) {
+    ret = append_path(&ctx, opts->inputs[i]);
+  }
+
+  if (ret == 0 && opts->files_from != NULL) {
+    ret = append_files_from(&ctx, opts->files_from);
+  }
+
+  if (ctx.pipeline != NULL) {
+    if (ret == 0) {
+      ret = pipeline_run(ctx.pipeline, opts->jobs);
+    }
+    close_pipeline(ctx.pipeline);
+  }
+
+  /* index what has been appended, even on error */
+  i = libnar_end_append(&ctx.nw);
+  if (i != 0) {
+    ERROR("end_append(%s) errno(%d): %s",
+          opts->output, -i, strerror(-i));
+    ret = (ret) ? ret : i;
+  }
+  show_stats(opts, NULL, &ctx.nw, NULL, ctx.nw.index.length - indexed, 0);
+
+exit_close_output:
+  libnar_close_writer(&ctx.nw);
+  free_key(key);
+  libnar_close_key(cipher_key);
+  /* the queued writes */
+  i = libnar_close_uring(uring);
+  if (i != 0) {
+    ERROR("write(%s) errno(%d): %s", opts->output, -i, strerror(-i));
+    ret = (ret) ? ret : i;
+  }
+  close(ofd);
+  return ret;
+}
+
+static int main_create_nar_file(struct nar_options const* opts)
+{
+  nar_writer nw;
+  int fd;
+  int ret = 0;
+
+  if (opts == NULL || opts->output == NULL) {
+    DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
+    return -1;
+  }
+
+  fd = creat(opts->output, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    ERROR("create(%s) errno(%d): %s",
+          opts->output, errno, strerror(errno));
+    return -1;
+  }
+
+  ret = libnar_init_writer(&nw, fd);
+  if (ret) {
+    ERROR("init_nar_writer(%s) errno(%d): %s",
+          opts->output, -ret, strerror(-ret));
+    goto exit_function;
+  }
+
+  ret = libnar_write_nar_header(&nw, opts->cipher_type, opts->compression_type);
+  if (ret != 0) {
+    ERROR("write_nar_header(%s) errno(%d): %s",
+          opts->output, -ret, strerror(-ret));
+    goto exit_function;
+  }
+  show_stats(opts, NULL, &nw, NULL, 0, 0);
+
+exit_function:
+  libnar_close_writer(&nw);
+  close(fd);
+  return ret;
+}
+
+static void dump_nar_header(nar_header* nh)
+{
+  if (nh != NULL) {
+    char magic[9];
+
+    memcpy(magic, &nh->magic, sizeof(uint64_t));
+    magic[8] = '\0';
+
+    PRINTF("magic: %s", magic);
+    PRINTF("version: %u.%u", nh->version.major, nh->version.minor);
+    PRINTF("cipher_type(0x%016llx) compression_type(0x%016llx)",
+           (unsigned long long int) nh->cipher_type, (unsigned long long int) nh->compression_type);
+    PRINTF("signature_position(0x%016llx) index_position(0x%016llx)",
+           (unsigned long long int) nh->signature_position, (unsigned long long int) nh->index_position);
+    PRINTF("unused[0](0x%016llx) unused[1](0x%016llx)",
+           (unsigned long long int) nh->unused[0], (unsigned long long int) nh->unused[1]);
+  }
+}
+
+static void dump_item_header(item_header* ih)
+{
+  if (ih != NULL) {
+    char magic[9];
+
+    memcpy(magic, &ih->magic, sizeof(uint64_t));
+    magic[8] = '\0';
+
+    PRINTF("magic: %s", magic);
+    PRINTF("flags: 0x%016llx", (unsigned long long int) ih->flags);
+    if (IS_EXECUTABLE(ih->flags)) {
+      PRINTF("  executable");
+    }
+    if (IS_COMPRESSED(ih->flags)) {
+      PRINTF("  compressed");
+    }
+    if (IS_ENCRYPTED(ih->flags)) {
+      PRINTF("  encrypted");
+    }
+    if (IS_STORED(ih->flags)) {
+      PRINTF("  stored (compression skipped)");
+    }
+    if (IS_BLOCKS(ih->flags)) {
+      PRINTF("  blocks");
+    }
+    if (IS_REFERENCE(ih->flags)) {
+      PRINTF("  reference (deduplicated)");
+    }
+    if (IS_CHECKSUM(ih->flags)) {
+      PRINTF("  checksum");
+    }
+    PRINTF("length1: 0x%016llx", (unsigned long long int) ih->length1);
+    PRINTF("length2: 0x%016llx", (unsigned long long int) ih->length2);
+  }
+}
+
+/*
+** initialize the reader of the archive: with io_uring if asked for (the
+** returned backend is closed after the reader), else from its mapping or
+** through the read-ahead buffer
+*/
+static void* init_archive_reader(nar_reader* nr, int fd,
+                                 struct nar_options const* opts)
+{
+  void* uring = (opts->io_uring) ? open_uring(fd) : NULL;
+
+  if (uring != NULL) {
+    libnar_init_reader_io(nr, &libnar_uring_io, uring);
+    return uring;
+  }
+
+  libnar_init_reader(nr, fd);
+  if (libnar_map_reader(nr) != 0) {
+    libnar_set_read_ahead(nr, READ_AHEAD_SIZE);
+  }
+
+  return NULL;
+}
+
+static int main_list_nar_file(struct nar_options const* opts)
+{
+  char magic[9];
+  int ret = 0;
+  nar_header nh;
+  item_header ih;
+  nar_reader nr;
+  uint64_t items = 0;
+  void* uring;
+  int fd;
+
+  if (opts == NULL || opts->output == NULL) {
+    DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
+    return -1;
+  }
+
+  fd = open(opts->output, O_RDONLY);
+  if (fd == -1) {
+    DPRINTF("open errno(%d): %s", errno, strerror(errno));
+    return -1;
+  }
+
+  uring = init_archive_reader(&nr, fd, opts);
+
+  libnar_read_nar_header(&nr, &nh);
+  dump_nar_header(&nh);
+
+  while(libnar_read_item_header(&nr, &ih) == 0) {
+    memcpy(magic, &ih.magic, sizeof(uint64_t));
+    magic[8] = '\0';
+
+    dump_item_header(&ih);
+    items++;
+    if (!strncmp(magic, FILE_HEADER_MAGIC, sizeof(uint64_t)) && nr.map != NULL) {
+      uint8_t const* filename;
+      uint64_t size;
+
+      if (libnar_map_content1(&nr, &ih, &filename, &size) == 0) {
+        PRINTF("filename(%llu): %.*s",
+               (unsigned long long int) size, (int) size, filename);
+      } else {
+        ERROR("can't read the filename");
+      }
+    } else if (!strncmp(magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
+      char filename[256];
+      int size;
+
+      memset(filename, 0, sizeof(filename));
+      size = libnar_read_content1(&nr, &ih, filename, sizeof(filename));
+      if (size >= 0) {
+        PRINTF("filename(%d): %s", size, filename);
+      } else {
+        ERROR("can't read the filename: errno(%d): %s", -size, strerror(-size));
+      }
+    }
+    libnar_jump_to_next_item_header(&nr, &ih);
+  }
+
+  show_stats(opts, &nr, NULL, NULL, items, 0);
+  libnar_close_reader(&nr);
+  libnar_close_uring(uring);
+
+  close(fd);
+
+  return ret;
+}
+
+static int write_all(int fd, uint8_t const* buf, size_t length)
+{
+  ssize_t ret;
+
+  while (length > 0) {
+    ret = write(fd, buf, length);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    buf += ret;
+    length -= ret;
+  }
+
+  return 0;
+}
+
+/*
+** extract the range of the item with positional reads: only the blocks of
+** the range are uncompressed. A compressed item without blocks is one stream:
+** it is uncompressed once from its start, and what is before the range is
+** dropped (a positional read would uncompress it again for each buffer).
+*/
+static int extract_range(nar_reader* nr, item_header const* ih,
+                         struct nar_options const* opts)
+{
+  uint8_t buf[65536];
+  int const stream = IS_COMPRESSED(ih->flags) && !IS_BLOCKS(ih->flags);
+  uint64_t offset = opts->range_offset;
+  uint64_t remaining = opts->range_length;
+  uint64_t skip = (stream) ? opts->range_offset : 0;
+  uint64_t start;
+  uint64_t length;
+  uint32_t max;
+  int ret;
+
+  for (;;) {
+    max = sizeof(buf);
+    if (opts->range_length) {
+      if (remaining == 0) {
+        return 0;
+      }
+      max = (remaining < max && skip == 0) ? remaining : max;
+    }
+
+    if (stream) {
+      ret = libnar_read_content2_decoded(nr, ih, buf, max);
+    } else {
+      ret = libnar_pread_item(nr, ih, offset, buf, max);
+    }
+    if (ret <= 0) {
+      return ret;
+    }
+    offset += ret;
+
+    /* the part of the buffer in the range */
+    start = (skip < (uint64_t) ret) ? skip : (uint64_t) ret;
+    skip -= start;
+    length = ret - start;
+    if (opts->range_length) {
+      length = (remaining < length) ? remaining : length;
+      remaining -= length;
+    }
+
+    ret = write_all(STDOUT_FILENO, &buf[start], length);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+}
+
+static void extract_item(nar_reader* nr, item_header const* ih,
+                         struct nar_options const* opts)
+{
+  uint8_t buf[65536];
+  int ret;
+
+  if (opts->range) {
+    ret = extract_range(nr, ih, opts);
+  } else if (IS_COMPRESSED(ih->flags) || IS_ENCRYPTED(ih->flags)) {
+    /* decrypted and inflated by the library */
+    while ((ret = libnar_read_content2_decoded(nr, ih, buf, sizeof(buf))) > 0) {
+      ret = write_all(STDOUT_FILENO, buf, ret);
+      if (ret != 0) {
+        break;
+      }
+    }
+  } else {
+    ret = libnar_extract_content2_to_fd(nr, ih, STDOUT_FILENO);
+  }
+
+  if (ret != 0) {
+    ERROR("can't extract the item: errno(%d): %s", -ret, strerror(-ret));
+  }
+}
+
+/*
+** check the hash tree of the archive (and its signature with --key), and
+** print its root if show is set. Returns 1 if it has none.
+*/
+static int verify_tree(struct nar_options const* opts, nar_archive* archive,
+                       int const show)
+{
+  uint8_t root[NAR_DIGEST_SIZE];
+  uint8_t const* signature;
+  uint32_t length;
+  void* key;
+  int ret;
+  int i;
+
+  ret = libnar_verify_tree(archive, root, &signature, &length);
+  if (ret == 1) {
+    if (opts->key != NULL) {
+      ERROR("%s has no hash tree to check the signature of", opts->output);
+      return -1;
+    }
+    return 1;
+  }
+  if (ret != 0) {
+    ERROR("%s: the hash tree is corrupted (%d)", opts->output, ret);
+    return ret;
+  }
+
+  if (show) {
+    fprintf(stdout, "%s: root ", opts->output);
+    for (i = 0; i < NAR_DIGEST_SIZE; i++) {
+      fprintf(stdout, "%02x", root[i]);
+    }
+    fprintf(stdout, "%s\n", (signature != NULL) ? " (signed)" : "");
+  }
+
+  if (opts->key != NULL) {
+    key = load_key(opts, 0);
+    ret = (key != NULL) ? check_signature(key, root, signature, length) : -1;
+    free_key(key);
+    if (ret != 0) {
+      ERROR("%s: the signature of the root does not match %s",
+            opts->output, opts->key);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** --extract --sign: check the item named target (and the hash tree) first,
+** without reading the other items
+*/
+static int verify_target(struct nar_options const* opts, int fd)
+{
+  nar_archive archive;
+  nar_item item;
+  int ret;
+
+  ret = libnar_open_archive(&archive, fd);
+  if (ret != 0) {
+    ERROR("can't open the archive %s (a regular file is needed)", opts->output);
+    return ret;
+  }
+
+  ret = verify_tree(opts, &archive, 0);
+  if (ret == 1) {
+    ERROR("%s has no hash tree (see --sign)", opts->output);
+  }
+  if (ret == 0) {
+    ret = libnar_archive_lookup(&archive, opts->target, strlen(opts->target),
+                                &item);
+    if (ret != 0) {
+      ERROR("%s: no item %s", opts->output, opts->target);
+    }
+  }
+  if (ret == 0) {
+    ret = libnar_verify_item(&archive, &item);
+    if (ret != 0) {
+      ERROR("%s: %s %s", opts->output, opts->target,
+            (ret > 0) ? "is not in the hash tree" : "is corrupted");
+    }
+  }
+
+  libnar_close_archive(&archive);
+  return ret;
+}
+
+static int main_extract_nar_file(struct nar_options const* opts)
+{
+  char magic[9];
+  int ret = 0;
+  nar_header nh;
+  item_header ih;
+  nar_reader nr;
+  uint64_t items = 0;
+  void* cipher_key = NULL;
+  void* uring;
+  int fd;
+
+  if (opts == NULL || opts->output == NULL) {
+    DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
+    return -1;
+  }
+
+  fd = open(opts->output, O_RDONLY);
+  if (fd == -1) {
+    DPRINTF("open errno(%d): %s", errno, strerror(errno));
+    return -1;
+  }
+
+  if (opts->sign) {
+    ret = verify_target(opts, fd);
+    if (ret != 0) {
+      close(fd);
+      return ret;
+    }
+  }
+
+  uring = init_archive_reader(&nr, fd, opts);
+
+  libnar_read_nar_header(&nr, &nh);
+
+  if (opts->cipher_key != NULL) {
+    cipher_key = load_cipher_key(opts, nh.cipher_type);
+    if (cipher_key == NULL) {
+      ret = -1;
+      goto exit_close_reader;
+    }
+    libnar_set_reader_key(&nr, cipher_key);
+  }
+
+  if (libnar_open_index(&nr, &nh) == 0) {
+    if (libnar_lookup(&nr, opts->target, strlen(opts->target), &ih) == 0) {
+      extract_item(&nr, &ih, opts);
+      items++;
+      goto exit_close_reader;
+    }
+
+    /* the index is not up to date: look for the item in the whole archive */
+    libnar_close_index(&nr);
+    libnar_read_nar_header(&nr, &nh);
+  }
+
+  while(libnar_read_item_header(&nr, &ih) == 0) {
+    memcpy(magic, &ih.magic, sizeof(uint64_t));
+    magic[8] = '\0';
+
+    if (!strncmp(magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
+      char filename[256];
+      int size;
+
+      memset(filename, 0, sizeof(filename));
+      size = libnar_read_content1(&nr, &ih, filename, sizeof(filename));
+      if (size >= 0 && !strncmp(filename, opts->target, sizeof(filename))) {
+        extract_item(&nr, &ih, opts);
+        items++;
+      }
+    }
+    libnar_jump_to_next_item_header(&nr, &ih);
+  }
+
+exit_close_reader:
+  show_stats(opts, &nr, NULL, NULL, items, 0);
+  libnar_close_reader(&nr);
+  libnar_close_key(cipher_key);
+  libnar_close_uring(uring);
+
+  close(fd);
+
+  return ret;
+}
+
+/*
+** ---- PARALLEL EXTRACTION
+**
+** --extract-all first lists the item files, from the index or with one pass
+** over the archive. Then a pool of workers extracts them with positional
+** reads: the workers share the archive file descriptor but no reader state.
+*/
+
+struct extract_entry {
+  uint64_t offset;
+  item_header ih;
+  char* path;
+};
+
+struct extract_context {
+  int fd;
+  uint64_t compression_type;
+  uint64_t cipher_type;
+  /* the key of --cipher-key */
+  void* key;
+  char const* directory;
+
+  struct extract_entry* entries;
+  size_t length;
+  size_t capacity;
+
+  pthread_mutex_t lock;
+  size_t next;
+  int error;
+  /* the counters of the workers */
+  nar_stats stats;
+};
+
+static int extract_push(struct extract_context* ctx, uint64_t const offset,
+                        item_header const* ih, char const* path)
+{
+  struct extract_entry* entry;
+
+  if (ctx->length == ctx->capacity) {
+    size_t capacity = (ctx->capacity) ? ctx->capacity * 2 : 64;
+
+    entry = realloc(ctx->entries, capacity * sizeof(struct extract_entry));
+    if (entry == NULL) {
+      return -ENOMEM;
+    }
+    ctx->entries = entry;
+    ctx->capacity = capacity;
+  }
+
+  entry = &ctx->entries[ctx->length];
+  entry->offset = offset;
+  entry->ih = *ih;
+  entry->path = strndup(path, ih->length1);
+  if (entry->path == NULL) {
+    return -ENOMEM;
+  }
+  ctx->length++;
+
+  return 0;
+}
+
+static int compare_path(void const* a, void const* b)
+{
+  struct extract_entry const* ea = a;
+  struct extract_entry const* eb = b;
+  int ret = strcmp(ea->path, eb->path);
+
+  if (ret == 0) {
+    ret = (ea->offset < eb->offset) ? -1 : (ea->offset > eb->offset);
+  }
+  return ret;
+}
+
+static int compare_offset(void const* a, void const* b)
+{
+  struct extract_entry const* ea = a;
+  struct extract_entry const* eb = b;
+
+  return (ea->offset < eb->offset) ? -1 : (ea->offset > eb->offset);
+}
+
+/*
+** keep the last item of each filepath, in the archive order
+*/
+static void extract_sort(struct extract_context* ctx)
+{
+  size_t i, length = 0;
+
+  qsort(ctx->entries, ctx->length, sizeof(struct extract_entry), compare_path);
+  for (i = 0; i < ctx->length; i++) {
+    if (i + 1 < ctx->length
+        && !strcmp(ctx->entries[i].path, ctx->entries[i + 1].path)) {
+      free(ctx->entries[i].path);
+      continue;
+    }
+    ctx->entries[length++] = ctx->entries[i];
+  }
+  ctx->length = length;
+
+  qsort(ctx->entries, ctx->length, sizeof(struct extract_entry), compare_offset);
+}
+
+static int extract_list(struct extract_context* ctx)
+{
+  nar_archive archive;
+  item_header ih;
+  uint64_t i;
+  int ret;
+
+  /* the index of the archive, or a scan of its items if it has none */
+  ret = libnar_open_archive(&archive, ctx->fd);
+  if (ret != 0) {
+    return ret;
+  }
+  ctx->compression_type = archive.header.compression_type;
+  ctx->cipher_type = archive.header.cipher_type;
+
+  for (i = 0; ret == 0 && i < archive.index.length; i++) {
+    nar_index_entry const* entry = &archive.index.entries[i];
+
+    memcpy(&ih.magic, FILE_HEADER_MAGIC, sizeof(uint64_t));
+    ih.flags = entry->flags;
+    ih.length1 = entry->length1;
+    ih.length2 = entry->length2;
+    ret = extract_push(ctx, entry->offset, &ih,
+                       &archive.index.strings[entry->filepath]);
+  }
+
+  libnar_close_archive(&archive);
+  return ret;
+}
+
+/* has the relative path a ".." component? */
+static int goes_up(char const* path)
+{
+  for (;;) {
+    if (path[0] == '.' && path[1] == '.' && (path[2] == '/' || path[2] == '\0')) {
+      return 1;
+    }
+    path = strchr(path, '/');
+    if (path == NULL) {
+      return 0;
+    }
+    path++;
+  }
+}
+
+/*
+** create the file (and its parent directories) of the entry in the
+** directory and copy its content in it
+*/
+static int extract_entry(struct extract_context* ctx,
+                         struct extract_entry const* entry)
+{
+  char const* path = entry->path;
+  char* output;
+  char* slash;
+  int ofd;
+  int ret;
+
+  while (*path == '/') {
+    path++;
+  }
+  if (*path == '\0' || goes_up(path)) {
+    ERROR("%s is outside of the directory: skipped", entry->path);
+    return 0;
+  }
+
+  output = malloc(strlen(ctx->directory) + strlen(path) + 2);
+  if (output == NULL) {
+    return -ENOMEM;
   }
+  sprintf(output, "%s/%s", ctx->directory, path);
 
-  cd->opaque = cd->init(opts);
-  if (cd->opaque == NULL) {
-    ERROR("can't initialize the compression_driver: %s", cd->name);
-    ret = -1;
-    goto exit_close_output;
+  for (slash = strchr(&output[strlen(ctx->directory) + 1], '/');
+       slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (-1 == mkdir(output, 0755) && errno != EEXIST) {
+      ERROR("mkdir(%s) errno(%d): %s", output, errno, strerror(errno));
+    }
+    *slash = '/';
   }
 
-  ret = cd->size(cd->opaque, &length);
-  DPRINTF("size: ret(%d) length(%llu)", ret, (unsigned long long int) length);
-  ret = libnar_append_file(&nw, flags, opts->input, strlen(opts->input),
-                           length, cd->callback, cd->opaque);
+  ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC,
+             IS_EXECUTABLE(entry->ih.flags) ? 0755 : 0644);
+  if (ofd == -1) {
+    ret = -errno;
+    ERROR("open(%s) errno(%d): %s", output, errno, strerror(errno));
+    free(output);
+    return ret;
+  }
+
+  ret = libnar_pextract_content2_decoded_to_fd(ctx->fd, entry->offset, &entry->ih,
+                                               ctx->compression_type, ctx->key,
+                                               ofd);
   if (ret != 0) {
-    ERROR("append(%s) errno(%d): %s",
-          opts->input, -ret, strerror(-ret));
-    goto exit_close_input;
+    ERROR("extract(%s) errno(%d): %s", output, -ret, strerror(-ret));
   }
 
-exit_close_input:
-  cd->close(cd->opaque);
-exit_close_output:
-  libnar_close_writer(&nw);
   close(ofd);
+  free(output);
   return ret;
 }
 
-static int main_create_nar_file(struct nar_options const* opts)
+static void* extract_worker(void* opaque)
 {
-  nar_writer nw;
-  int fd;
-  int ret = 0;
+  struct extract_context* ctx = opaque;
+  size_t i;
+  int ret;
 
-  if (opts == NULL || opts->output == NULL) {
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (i >= ctx->length) {
+      break;
+    }
+
+    ret = extract_entry(ctx, &ctx->entries[i]);
+    if (ret != 0) {
+      pthread_mutex_lock(&ctx->lock);
+      ctx->error = ret;
+      pthread_mutex_unlock(&ctx->lock);
+    }
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  libnar_add_thread_stats(&ctx->stats);
+  pthread_mutex_unlock(&ctx->lock);
+
+  return NULL;
+}
+
+static int main_extract_all(struct nar_options const* opts)
+{
+  struct extract_context ctx;
+  pthread_t* workers;
+  int workers_length = 0;
+  int jobs;
+  size_t i;
+  int ret;
+
+  if (opts == NULL || opts->output == NULL || opts->target == NULL) {
     DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
     return -1;
   }
 
-  fd = creat(opts->output, S_IRUSR | S_IWUSR);
-  if (fd == -1) {
-    ERROR("create(%s) errno(%d): %s",
-          opts->output, errno, strerror(errno));
+  memset(&ctx, 0, sizeof(struct extract_context));
+  ctx.directory = opts->target;
+  ctx.fd = open(opts->output, O_RDONLY);
+  if (ctx.fd == -1) {
+    ERROR("open(%s) errno(%d): %s", opts->output, errno, strerror(errno));
     return -1;
   }
 
-  ret = libnar_init_writer(&nw, fd);
-  if (ret) {
-    ERROR("init_nar_writer(%s) errno(%d): %s",
-          opts->output, -ret, strerror(-ret));
-    goto exit_function;
+  if (-1 == mkdir(ctx.directory, 0755) && errno != EEXIST) {
+    ERROR("mkdir(%s) errno(%d): %s", ctx.directory, errno, strerror(errno));
+    close(ctx.fd);
+    return -1;
   }
 
-  /* TODO: handle options */
-  ret = libnar_write_nar_header(&nw, 0, opts->compression_type);
+  ret = extract_list(&ctx);
   if (ret != 0) {
-    ERROR("write_nar_header(%s) errno(%d): %s",
-          opts->output, -ret, strerror(-ret));
-    goto exit_function;
+    ERROR("can't list the items of %s", opts->output);
+    goto exit_free_entries;
   }
+  extract_sort(&ctx);
 
-exit_function:
-  libnar_close_writer(&nw);
-  close(fd);
-  return ret;
-}
+  if (opts->cipher_key != NULL) {
+    ctx.key = load_cipher_key(opts, ctx.cipher_type);
+    if (ctx.key == NULL) {
+      ret = -1;
+      goto exit_free_entries;
+    }
+  }
 
-static void dump_nar_header(nar_header* nh)
-{
-  if (nh != NULL) {
-    char magic[9];
+  jobs = (opts->jobs) ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  jobs = (jobs < 1) ? 1 : jobs;
+  workers = calloc(jobs, sizeof(pthread_t));
+  if (workers == NULL) {
+    ret = -ENOMEM;
+    goto exit_free_entries;
+  }
 
-    memcpy(magic, &nh->magic, sizeof(uint64_t));
-    magic[8] = '\0';
+  pthread_mutex_init(&ctx.lock, NULL);
+  for (i = 0; i < (size_t) jobs && i < ctx.length; i++) {
+    if (pthread_create(&workers[i], NULL, extract_worker, &ctx) != 0) {
+      ERROR("can't create the worker %zu", i);
+      break;
+    }
+    workers_length++;
+  }
 
-    PRINTF("magic: %s", magic);
-    PRINTF("version: %u.%u", nh->version.major, nh->version.minor);
-    PRINTF("cipher_type(0x%016llx) compression_type(0x%016llx)",
-           (unsigned long long int) nh->cipher_type, (unsigned long long int) nh->compression_type);
-    PRINTF("signature_position(0x%016llx) index_position(0x%016llx)",
-           (unsigned long long int) nh->signature_position, (unsigned long long int) nh->index_position);
-    PRINTF("unused[0](0x%016llx) unused[1](0x%016llx)",
-           (unsigned long long int) nh->unused[0], (unsigned long long int) nh->unused[1]);
+  /* no worker at all: extract them here */
+  if (workers_length == 0) {
+    extract_worker(&ctx);
+  } else {
+    /* the listing of the items */
+    pthread_mutex_lock(&ctx.lock);
+    libnar_add_thread_stats(&ctx.stats);
+    pthread_mutex_unlock(&ctx.lock);
   }
-}
 
-static void dump_item_header(item_header* ih)
-{
-  if (ih != NULL) {
-    char magic[9];
+  while (workers_length > 0) {
+    pthread_join(workers[--workers_length], NULL);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+  free(workers);
+  ret = ctx.error;
 
-    memcpy(magic, &ih->magic, sizeof(uint64_t));
-    magic[8] = '\0';
+  if (opts->stats) {
+    uint64_t bytes = 0;
 
-    PRINTF("magic: %s", magic);
-    PRINTF("flags: 0x%016llx", (unsigned long long int) ih->flags);
-    if (IS_EXECUTABLE(ih->flags)) {
-      PRINTF("  executable");
-    }
-    if (IS_COMPRESSED(ih->flags)) {
-      PRINTF("  compressed");
-    }
-    if (IS_ENCRYPTED(ih->flags)) {
-      PRINTF("  encrypted");
+    for (i = 0; i < ctx.length; i++) {
+      bytes += ctx.entries[i].ih.length2;
     }
-    PRINTF("length1: 0x%016llx", (unsigned long long int) ih->length1);
-    PRINTF("length2: 0x%016llx", (unsigned long long int) ih->length2);
+    show_stats(opts, NULL, NULL, &ctx.stats, ctx.length, bytes);
   }
-}
-
-static int main_list_nar_file(struct nar_options const* opts)
-{
-  char magic[9];
-  int ret = 0;
-  nar_header nh;
-  item_header ih;
-  nar_reader nr;
-  int fd;
 
-  if (opts == NULL || opts->output == NULL) {
-    DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
-    return -1;
+exit_free_entries:
+  for (i = 0; i < ctx.length; i++) {
+    free(ctx.entries[i].path);
   }
+  free(ctx.entries);
+  libnar_close_key(ctx.key);
+  close(ctx.fd);
 
-  fd = open(opts->output, O_RDONLY);
-  if (fd == -1) {
-    DPRINTF("open errno(%d): %s", errno, strerror(errno));
-    return -1;
-  }
+  return ret;
+}
 
-  ret = libnar_init_reader(&nr, fd);
+/*
+** ---- VERIFY
+**
+** --verify checks the items of the archive (see libnar_verify_item) with a
+** pool of workers: each one takes the next item of the index.
+*/
 
-  libnar_read_nar_header(&nr, &nh);
-  dump_nar_header(&nh);
+struct verify_context {
+  char const* narfile;
+  nar_archive archive;
+
+  pthread_mutex_t lock;
+  uint64_t next;
+  uint64_t verified;
+  uint64_t unchecked;
+  uint64_t corrupted;
+  int error;
+  /* the counters of the workers */
+  nar_stats stats;
+};
 
-  while(libnar_read_item_header(&nr, &ih) == 0) {
-    memcpy(magic, &ih.magic, sizeof(uint64_t));
-    magic[8] = '\0';
+static void* verify_worker(void* opaque)
+{
+  struct verify_context* ctx = opaque;
+  nar_index const* index = &ctx->archive.index;
+  nar_index_entry const* entry;
+  nar_item item;
+  uint64_t i;
+  int ret;
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (i >= index->length) {
+      break;
+    }
+    entry = &index->entries[i];
 
-    dump_item_header(&ih);
-    if (!strncmp(magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
-      char filename[256];
-      int size;
+    ret = libnar_pread_item_header(&ctx->archive, entry->offset, &item);
+    if (ret == 0) {
+      ret = libnar_verify_item(&ctx->archive, &item);
+    }
 
-      memset(filename, 0, sizeof(filename));
-      size = libnar_read_content1(&nr, &ih, filename, sizeof(filename));
-      if (size >= 0) {
-        PRINTF("filename(%d): %s", size, filename);
-      } else {
-        ERROR("can't read the filename: errno(%d): %s", -size, strerror(-size));
-      }
+    pthread_mutex_lock(&ctx->lock);
+    if (ret == 0 || ret == 2) {
+      ctx->verified++;
+    } else if (ret == 1) {
+      ctx->unchecked++;
+    } else {
+      ERROR("%s: %.*s at 0x%016llx is corrupted (%d)", ctx->narfile,
+            (int) entry->length1, &index->strings[entry->filepath],
+            (unsigned long long int) entry->offset, ret);
+      ctx->corrupted++;
+      ctx->error = -1;
     }
-    libnar_jump_to_next_item_header(&nr, &ih);
+    pthread_mutex_unlock(&ctx->lock);
   }
 
-  libnar_close_reader(&nr);
-
-  close(fd);
+  pthread_mutex_lock(&ctx->lock);
+  libnar_add_thread_stats(&ctx->stats);
+  pthread_mutex_unlock(&ctx->lock);
 
-  return ret;
+  return NULL;
 }
 
-static int main_extract_nar_file(struct nar_options const* opts)
+static int main_verify(struct nar_options const* opts)
 {
-  char magic[9];
-  int ret = 0;
-  nar_header nh;
-  item_header ih;
-  nar_reader nr;
+  struct verify_context ctx;
+  pthread_t* workers;
+  int workers_length = 0;
+  int jobs;
   int fd;
+  int i;
+  int ret;
 
   if (opts == NULL || opts->output == NULL) {
     DPRINTF("opts(%p) opts->output(%p)", opts, (opts) ? opts->output : NULL);
     return -1;
   }
 
+  memset(&ctx, 0, sizeof(struct verify_context));
+  ctx.narfile = opts->output;
   fd = open(opts->output, O_RDONLY);
   if (fd == -1) {
-    DPRINTF("open errno(%d): %s", errno, strerror(errno));
+    ERROR("open(%s) errno(%d): %s", opts->output, errno, strerror(errno));
     return -1;
   }
 
-  ret = libnar_init_reader(&nr, fd);
-
-  libnar_read_nar_header(&nr, &nh);
+  ret = libnar_open_archive(&ctx.archive, fd);
+  if (ret != 0) {
+    ERROR("can't open the archive %s", opts->output);
+    close(fd);
+    return ret;
+  }
 
-  while(libnar_read_item_header(&nr, &ih) == 0) {
-    memcpy(magic, &ih.magic, sizeof(uint64_t));
-    magic[8] = '\0';
+  ret = verify_tree(opts, &ctx.archive, 1);
+  if (ret == 1) {
+    ret = 0;
+  } else if (ret != 0) {
+    goto exit_close_archive;
+  }
 
-    if (!strncmp(magic, FILE_HEADER_MAGIC, sizeof(uint64_t))) {
-      char filename[256];
-      int size;
+  jobs = (opts->jobs) ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  jobs = (jobs < 1) ? 1 : jobs;
+  workers = calloc(jobs, sizeof(pthread_t));
+  if (workers == NULL) {
+    ret = -ENOMEM;
+    goto exit_close_archive;
+  }
 
-      memset(filename, 0, sizeof(filename));
-      size = libnar_read_content1(&nr, &ih, filename, sizeof(filename));
-      if (size >= 0 && !strncmp(filename, opts->target, sizeof(filename))) {
-        while ((size = libnar_read_content2(&nr, &ih, filename, sizeof(filename))) > 0) {
-            write(STDOUT_FILENO, filename, size);
-        }
-      }
+  pthread_mutex_init(&ctx.lock, NULL);
+  for (i = 0; i < jobs && (uint64_t) i < ctx.archive.index.length; i++) {
+    if (pthread_create(&workers[i], NULL, verify_worker, &ctx) != 0) {
+      ERROR("can't create the worker %d", i);
+      break;
     }
-    libnar_jump_to_next_item_header(&nr, &ih);
+    workers_length++;
   }
 
-  libnar_close_reader(&nr);
+  /* no worker at all: verify them here */
+  if (workers_length == 0) {
+    verify_worker(&ctx);
+  } else {
+    /* the opening of the archive and the check of its hash tree */
+    pthread_mutex_lock(&ctx.lock);
+    libnar_add_thread_stats(&ctx.stats);
+    pthread_mutex_unlock(&ctx.lock);
+  }
+
+  while (workers_length > 0) {
+    pthread_join(workers[--workers_length], NULL);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+  free(workers);
+
+  PRINTF("%s: %llu items verified, %llu without checksum nor digest, %llu corrupted",
+         opts->output, (unsigned long long int) ctx.verified,
+         (unsigned long long int) ctx.unchecked,
+         (unsigned long long int) ctx.corrupted);
+  ret = ctx.error;
+
+  if (opts->stats) {
+    uint64_t bytes = 0;
+    uint64_t j;
+
+    for (j = 0; j < ctx.archive.index.length; j++) {
+      bytes += ctx.archive.index.entries[j].length2;
+    }
+    show_stats(opts, NULL, NULL, &ctx.stats, ctx.archive.index.length,
+               bytes);
+  }
 
+exit_close_archive:
+  libnar_close_archive(&ctx.archive);
   close(fd);
 
   return ret;
@@ -406,8 +2394,13 @@ int main(int argc, char * const* argv)
   int i;
   int help = 0, error = 0;
 
+  char* parameters;
+
   struct nar_options opt;
   memset(&opt, 0, sizeof(struct nar_options));
+  opt.compression_level = NAR_DEFAULT_LEVEL;
+  opt.memory_budget = PIPELINE_MEMORY_BUDGET;
+  opt.min_gain = -1;
 
   while (!help && !error) {
     c = getopt_long(argc, argv, short_options,
@@ -435,7 +2428,7 @@ int main(int argc, char * const* argv)
       }
       break;
     case 'a':
-      if (!opt.action) {
+      if (!opt.action || (opt.action == APPEND && opt.input == NULL)) {
         opt.action = APPEND;
         opt.input = optarg;
       } else {
@@ -452,6 +2445,51 @@ int main(int argc, char * const* argv)
         error = 1;
       }
       break;
+    case 'x':
+      if (!opt.action) {
+        opt.action = EXTRACT_ALL;
+        opt.target = optarg;
+      } else {
+        ERROR("can't extract files with other action: 0x%03x", opt.action);
+        error = 1;
+      }
+      break;
+    case 'f':
+      if (!opt.action || opt.action == APPEND) {
+        opt.action = APPEND;
+        opt.files_from = optarg;
+      } else {
+        ERROR("can't append files with other action: 0x%03x", opt.action);
+        error = 1;
+      }
+      break;
+    case '0':
+      opt.null_separated = 1;
+      break;
+    case 'N':
+      opt.name = optarg;
+      break;
+    case 'J':
+      opt.jobs = atoi(optarg);
+      if (opt.jobs < 1) {
+        ERROR("option --jobs|-J expects a positive number: %s", optarg);
+        error = 1;
+      }
+      break;
+    case 'M':
+      opt.memory_budget = to_size(optarg);
+      if (opt.memory_budget == 0) {
+        ERROR("option --memory-budget|-M expects a size: %s", optarg);
+        error = 1;
+      }
+      break;
+    case 'j':
+      opt.threads = atoi(optarg);
+      if (opt.threads < 1) {
+        ERROR("option --threads|-j expects a positive number: %s", optarg);
+        error = 1;
+      }
+      break;
     case 'l':
       if (!opt.action) {
         opt.action = LIST;
@@ -461,20 +2499,56 @@ int main(int argc, char * const* argv)
       }
       break;
     case 't':
+      /* <type>[:<parameters>] */
+      parameters = strchr(optarg, ':');
+      if (parameters != NULL) {
+        *parameters++ = '\0';
+      }
       opt.compression_type = to_compression_type(optarg);
       switch (opt.compression_type) {
       case COMPRESSION_TYPE_LENGTH:
         PRINTF("list of supported compression type:");
         for (i = COMPRESSION_NONE; i < COMPRESSION_TYPE_LENGTH; i++) {
-          PRINTF("  %s", compression_drivers[i].name);
+          if (IS_COMPRESSION_SUPPORTED(i)) {
+            PRINTF("  %s", compression_drivers[i].name);
+          }
         }
         break;
       default:
+        if (parameters == NULL) {
+          break;
+        }
+        if (compression_drivers[opt.compression_type].configure == NULL) {
+          ERROR("compression type %s has no parameter",
+                compression_drivers[opt.compression_type].name);
+          error = 1;
+        } else if (compression_drivers[opt.compression_type].configure(&opt, parameters)) {
+          error = 1;
+        }
         break;
       }
       break;
     case 'T':
-      opt.cipher_type = optarg;
+      opt.cipher_type = to_cipher_type(optarg);
+      if (opt.cipher_type == CIPHER_TYPE_LENGTH) {
+        ERROR("option --cipher-type|-T expects none or aes-256-gcm: %s", optarg);
+        error = 1;
+      }
+#if !defined(HAVE_OPENSSL)
+      if (opt.cipher_type == CIPHER_AES_256_GCM) {
+        ERROR("cipher type %s not available: nar is built without OpenSSL (make OPENSSL=1)", optarg);
+        error = 1;
+      }
+#endif
+      break;
+    case 'P':
+      if (opt.action == APPEND || opt.action == EXTRACT
+          || opt.action == EXTRACT_ALL) {
+        opt.cipher_key = optarg;
+      } else {
+        ERROR("option --cipher-key|-P only available with option --append|-a, --extract|-e or --extract-all|-x");
+        error = 1;
+      }
       break;
     case 'C':
       if (opt.action == APPEND) {
@@ -484,6 +2558,92 @@ int main(int argc, char * const* argv)
         error = 1;
       }
       break;
+    case 'U':
+      opt.io_uring = 1;
+      break;
+    case 's':
+      opt.stats = 1;
+      break;
+    case 'R':
+      /* <offset>[:<length>] */
+      opt.range = 1;
+      opt.range_offset = strtoull(optarg, &parameters, 10);
+      if (*parameters == ':') {
+        opt.range_length = strtoull(parameters + 1, &parameters, 10);
+        if (opt.range_length == 0) {
+          parameters = optarg;
+        }
+      }
+      if (parameters == optarg || *parameters != '\0') {
+        ERROR("option --range|-R expects <offset>[:<length>]: %s", optarg);
+        error = 1;
+      }
+      break;
+    case 'B':
+      opt.block_size = to_size(optarg);
+      if (opt.block_size == 0 || opt.block_size > MAX_BLOCK_SIZE) {
+        ERROR("option --block-size|-B expects a size up to 1G: %s", optarg);
+        error = 1;
+      }
+      break;
+    case 'A':
+      if (opt.action == APPEND) {
+        opt.compress = 1;
+        opt.min_gain = atoi(optarg);
+        if (opt.min_gain < 0 || opt.min_gain > 100) {
+          ERROR("option --auto-compress|-A expects a percentage: %s", optarg);
+          error = 1;
+        }
+      } else {
+        ERROR("option --auto-compress|-A only available with option --append|-a");
+        error = 1;
+      }
+      break;
+    case 'D':
+      if (opt.action == APPEND) {
+        opt.dedup = 1;
+      } else {
+        ERROR("option --dedup|-D only available with option --append|-a");
+        error = 1;
+      }
+      break;
+    case 'K':
+      if (opt.action == APPEND) {
+        opt.no_checksum = 1;
+      } else {
+        ERROR("option --no-checksum|-K only available with option --append|-a");
+        error = 1;
+      }
+      break;
+    case 'S':
+      if (opt.action == APPEND || opt.action == EXTRACT) {
+        opt.sign = 1;
+      } else {
+        ERROR("option --sign|-S only available with option --append|-a or --extract|-e");
+        error = 1;
+      }
+      break;
+    case 'k':
+#if defined(HAVE_OPENSSL)
+      if (opt.action == APPEND || opt.action == EXTRACT || opt.action == VERIFY) {
+        opt.key = optarg;
+      } else {
+        ERROR("option --key|-k only available with option --append|-a, --extract|-e or --verify|-V");
+        error = 1;
+      }
+#else
+      ERROR("option --key|-k not available: nar is built without OpenSSL (make OPENSSL=1)");
+      error = 1;
+#endif
+      break;
+    case 'V':
+      if (!opt.action) {
+        opt.action = VERIFY;
+      } else {
+        ERROR("can't verify a file with other action: 0x%03x", opt.action);
+        error = 1;
+      }
+      break;
     case 'E':
       if (opt.action == APPEND) {
         opt.encrypt = 1;
@@ -499,17 +2659,39 @@ int main(int argc, char * const* argv)
     }
   }
 
+  if (opt.action == APPEND) {
+    /* the other paths to append */
+    opt.inputs = &argv[optind];
+    opt.inputs_length = argc - optind;
+  }
+
   if (!IS_COMPRESSION_SUPPORTED(opt.compression_type)) {
     ERROR("compression type not supported %u", opt.compression_type);
     error = 1;
   }
 
+  if (opt.encrypt && opt.cipher_key == NULL) {
+    ERROR("option --encrypt|-E needs the option --cipher-key|-P");
+    error = 1;
+  }
+
+  if (opt.block_size && !opt.compress) {
+    ERROR("option --block-size|-B needs the option --compress|-C (or --auto-compress|-A)");
+    error = 1;
+  }
+
+  if (opt.range && opt.action != EXTRACT) {
+    ERROR("option --range|-R only available with option --extract|-e");
+    error = 1;
+  }
+
   if (!help && !error && opt.output == NULL) {
     ERROR("output should not be null: use option --narfile:<file>");
     error = 1;
   }
 
   if (!help && !error) {
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
     switch (opt.action) {
     case CREATE:
       error = main_create_nar_file(&opt);
@@ -523,6 +2705,12 @@ int main(int argc, char * const* argv)
     case EXTRACT:
       error = main_extract_nar_file(&opt);
       break;
+    case EXTRACT_ALL:
+      error = main_extract_all(&opt);
+      break;
+    case VERIFY:
+      error = main_verify(&opt);
+      break;
     case NOTHING:
     default:
       break;
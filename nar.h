@@ -35,6 +35,7 @@
 # include "libnar.h"
 
 # include <stdio.h>
+# include <limits.h>
 
 # if defined(DEBUG)
 #  define DPRINTF(fmt, ...)                                 \
@@ -70,12 +71,29 @@
    } while (0)
 # endif
 
+/* the compression level when none is given (the driver default) */
+# define NAR_DEFAULT_LEVEL INT_MIN
+
+/* the bytes of each file compressed to guess its gain (see --auto-compress) */
+# define AUTO_SAMPLE_SIZE (256 * 1024)
+
+/* the largest --block-size */
+# define MAX_BLOCK_SIZE (1024 * 1024 * 1024)
+
+/* the default memory used by the files compressed at once (see --jobs) */
+# define PIPELINE_MEMORY_BUDGET (64 * 1024 * 1024)
+
+/* the read-ahead buffer size when the archive can't be mapped */
+# define READ_AHEAD_SIZE (256 * 1024)
+
 enum option_action {
   NOTHING = 0x00,
   CREATE  = 0x01,
   APPEND  = 0x02,
   LIST    = 0x04,
-  EXTRACT = 0x08
+  EXTRACT = 0x08,
+  EXTRACT_ALL = 0x10,
+  VERIFY  = 0x20
 };
 
 struct nar_options {
@@ -83,14 +101,59 @@ struct nar_options {
 
   char const* output;
   nar_compression_type compression_type;
-  char const* cipher_type;
+  nar_cipher_type cipher_type;
 
-  /* When appending an Item "file" */
+  /* When appending an Item "file" (- for the standard input, named name) */
   char const* input;
+  char const* name;
   int compress;
   int encrypt;
+  /* the file of the key of the encrypted items (see libnar_open_key) */
+  char const* cipher_key;
+
+  /* When appending several Items */
+  char* const* inputs;
+  int inputs_length;
+  char const* files_from;
+  int null_separated;
+
+  /* When compressing: the parameters given with --compression-type */
+  int compression_level;
+  int compression_strategy;
+  int compression_window;
+  int compression_memlevel;
+  /* the gain (percent) a file needs to be compressed, -1: always compressed */
+  int min_gain;
+  /* the size of the blocks compressed independently, 0: a single stream */
+  uint64_t block_size;
+
+  /* When compressing: the number of deflate threads */
+  int threads;
+  /* the number of files compressed at once and the memory they may use */
+  int jobs;
+  uint64_t memory_budget;
+
+  /* replace the items already in the archive by references (see
+  ** libnar_set_dedup) */
+  int dedup;
+  /* append the items without checksum (see libnar_set_checksum) */
+  int no_checksum;
+  /* maintain the SIGN item (see libnar_set_sign), or check an extracted item
+  ** with it */
+  int sign;
+  /* the PEM key signing the root of the SIGN item, or checking its signature */
+  char const* key;
+
+  /* read and write the archive with io_uring (see libnar_open_uring) */
+  int io_uring;
+  /* print the counters of libnar at exit (see libnar_get_stats) */
+  int stats;
 
   char const* target;
+  /* When extracting: only [range_offset, range_offset + range_length[ */
+  int range;
+  uint64_t range_offset;
+  uint64_t range_length;
 };
 
 
@@ -0,0 +1,122 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "nar.h"
+#include "openssl_signer.h"
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+
+void* openssl_load_key(char const* path, int const private_key)
+{
+  EVP_PKEY* key;
+  FILE* file;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    ERROR("fopen(%s) failed", path);
+    return NULL;
+  }
+
+  if (private_key) {
+    key = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+  } else {
+    key = PEM_read_PUBKEY(file, NULL, NULL, NULL);
+  }
+  fclose(file);
+
+  if (key == NULL) {
+    ERROR("can't read the %s key of %s: %s", (private_key) ? "private" : "public",
+          path, ERR_error_string(ERR_get_error(), NULL));
+  }
+
+  return key;
+}
+
+void openssl_free_key(void* key)
+{
+  EVP_PKEY_free(key);
+}
+
+/* Ed25519 and Ed448 sign the message itself, the others a SHA-256 of it */
+static EVP_MD const* key_digest(EVP_PKEY* key)
+{
+  int id = EVP_PKEY_get_base_id(key);
+
+  return (id == EVP_PKEY_ED25519 || id == EVP_PKEY_ED448) ? NULL : EVP_sha256();
+}
+
+int openssl_sign_root(void* key, uint8_t const* root,
+                      uint8_t* signature, uint32_t* length)
+{
+  EVP_MD_CTX* ctx;
+  size_t size = *length;
+  int ret = -1;
+
+  ctx = EVP_MD_CTX_new();
+  if (ctx == NULL) {
+    return -1;
+  }
+
+  if (EVP_DigestSignInit(ctx, NULL, key_digest(key), NULL, key) == 1
+      && EVP_DigestSign(ctx, NULL, &size, root, NAR_DIGEST_SIZE) == 1
+      && size <= *length
+      && EVP_DigestSign(ctx, signature, &size, root, NAR_DIGEST_SIZE) == 1) {
+    *length = size;
+    ret = 0;
+  } else {
+    ERROR("can't sign the root: %s", ERR_error_string(ERR_get_error(), NULL));
+  }
+
+  EVP_MD_CTX_free(ctx);
+  return ret;
+}
+
+int openssl_verify_root(void* key, uint8_t const* root,
+                        uint8_t const* signature, uint32_t const length)
+{
+  EVP_MD_CTX* ctx;
+  int ret = -1;
+
+  ctx = EVP_MD_CTX_new();
+  if (ctx == NULL) {
+    return -1;
+  }
+
+  if (EVP_DigestVerifyInit(ctx, NULL, key_digest(key), NULL, key) == 1
+      && EVP_DigestVerify(ctx, signature, length, root, NAR_DIGEST_SIZE) == 1) {
+    ret = 0;
+  }
+
+  EVP_MD_CTX_free(ctx);
+  return ret;
+}
@@ -0,0 +1,48 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef OPENSSL_SIGNER_H_
+# define OPENSSL_SIGNER_H_
+
+/*
+** load the PEM key of path: a private key (to sign) if private_key is set,
+** else a public key (to verify). Ed25519, Ed448, EC or RSA keys.
+*/
+void* openssl_load_key(char const* path, int const private_key);
+void openssl_free_key(void* key);
+/* sign the root of a SIGN item (a sign_root callback, the key as opaque) */
+int openssl_sign_root(void* key, uint8_t const* root,
+                      uint8_t* signature, uint32_t* length);
+/* 0 if the signature of the root is valid, -1 if not */
+int openssl_verify_root(void* key, uint8_t const* root,
+                        uint8_t const* signature, uint32_t const length);
+
+#endif /* !OPENSSL_SIGNER_H_ */
@@ -0,0 +1,295 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** the check of the positional reads of nar_archive (make tests/archive_test):
+**
+**   archive_test <archive> <threads> <reads> <file>...
+**
+** each file is looked up in the archive (libnar_archive_lookup and
+** libnar_pread_content1), then <threads> threads share the nar_archive and
+** each one reads <reads> random ranges of random files with
+** libnar_pread_content2_decoded (and libnar_pread_content2 for the items
+** stored as they are). Every range is compared with the file itself.
+*/
+
+#include "libnar.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+/* the largest range read */
+#define TEST_MAX_RANGE (64 * 1024)
+
+struct test_file {
+  char const* path;
+  uint8_t* data;
+  uint64_t size;
+  nar_item item;
+};
+
+struct test_context {
+  nar_archive archive;
+  struct test_file* files;
+  int files_length;
+  unsigned long reads;
+
+  pthread_mutex_t lock;
+  unsigned long errors;
+};
+
+struct test_worker {
+  pthread_t thread;
+  struct test_context* ctx;
+  uint64_t seed;
+};
+
+/* xorshift64*: each thread draws its own ranges */
+static uint64_t test_random(uint64_t* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static void test_error(struct test_context* ctx, struct test_file const* f,
+                       char const* call, uint64_t offset, uint32_t length,
+                       int ret)
+{
+  pthread_mutex_lock(&ctx->lock);
+  fprintf(stderr, "%s: %s(%llu, %u) returned %d\n", f->path, call,
+          (unsigned long long int) offset, length, ret);
+  ctx->errors++;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void* test_worker(void* opaque)
+{
+  struct test_worker* w = opaque;
+  struct test_context* ctx = w->ctx;
+  struct test_file const* f;
+  uint8_t* buf;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t expected;
+  unsigned long i;
+  int ret;
+
+  buf = malloc(TEST_MAX_RANGE);
+  if (buf == NULL) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->errors++;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+  }
+
+  for (i = 0; i < ctx->reads; i++) {
+    f = &ctx->files[test_random(&w->seed) % ctx->files_length];
+    /* up to the end of the file (and once in a while after it) */
+    offset = test_random(&w->seed) % (f->size + 2);
+    length = 1 + test_random(&w->seed) % TEST_MAX_RANGE;
+    expected = (offset >= f->size) ? 0
+             : (f->size - offset < length) ? f->size - offset : length;
+
+    ret = libnar_pread_content2_decoded(&ctx->archive, &f->item, offset,
+                                        buf, length);
+    if (ret < 0 || (uint32_t) ret != expected
+        || memcmp(buf, &f->data[offset], expected)) {
+      test_error(ctx, f, "libnar_pread_content2_decoded", offset, length, ret);
+      continue;
+    }
+
+    if (f->item.header.flags & (FILE_COMPRESSED | FILE_ENCRYPTED
+                                | FILE_REFERENCE)) {
+      continue;
+    }
+    ret = libnar_pread_content2(&ctx->archive, &f->item, offset, buf, length);
+    if (ret < 0 || (uint32_t) ret != expected
+        || memcmp(buf, &f->data[offset], expected)) {
+      test_error(ctx, f, "libnar_pread_content2", offset, length, ret);
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/*
+** read the whole file in memory
+*/
+static int test_load(struct test_file* f)
+{
+  struct stat st;
+  ssize_t ret;
+  uint64_t i;
+  int fd;
+
+  fd = open(f->path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(f->path);
+    return -1;
+  }
+
+  f->size = st.st_size;
+  f->data = malloc(f->size + 1);
+  if (f->data == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  for (i = 0; i < f->size; i += ret) {
+    ret = read(fd, &f->data[i], f->size - i);
+    if (ret <= 0) {
+      perror(f->path);
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+  return 0;
+}
+
+/*
+** look up the file in the archive and check its filename
+*/
+static int test_lookup(nar_archive const* archive, struct test_file* f)
+{
+  uint64_t length = strlen(f->path);
+  char name[4096];
+  int ret;
+
+  ret = libnar_archive_lookup(archive, f->path, length, &f->item);
+  if (ret != 0) {
+    fprintf(stderr, "%s: not found in the archive (%d)\n", f->path, ret);
+    return -1;
+  }
+
+  if (length > sizeof(name)) {
+    return 0;
+  }
+  ret = libnar_pread_content1(archive, &f->item, 0, name, sizeof(name));
+  if (ret < 0 || (uint64_t) ret != length || memcmp(name, f->path, length)) {
+    fprintf(stderr, "%s: libnar_pread_content1 returned %d\n", f->path, ret);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  struct test_context ctx;
+  struct test_worker* workers;
+  int threads;
+  int ret = 1;
+  int fd;
+  int i;
+
+  if (argc < 5) {
+    fprintf(stderr, "usage: %s <archive> <threads> <reads> <file>...\n",
+            argv[0]);
+    return 2;
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  threads = atoi(argv[2]);
+  ctx.reads = strtoul(argv[3], NULL, 10);
+  ctx.files_length = argc - 4;
+  if (threads <= 0) {
+    fprintf(stderr, "%s: the number of threads is from 1\n", argv[2]);
+    return 2;
+  }
+
+  fd = open(argv[1], O_RDONLY);
+  if (fd == -1) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (libnar_open_archive(&ctx.archive, fd) != 0) {
+    fprintf(stderr, "%s: can't open the archive\n", argv[1]);
+    close(fd);
+    return 1;
+  }
+
+  ctx.files = calloc(ctx.files_length, sizeof(struct test_file));
+  workers = calloc(threads, sizeof(struct test_worker));
+  if (ctx.files == NULL || workers == NULL) {
+    goto exit_free;
+  }
+
+  for (i = 0; i < ctx.files_length; i++) {
+    ctx.files[i].path = argv[4 + i];
+    if (test_load(&ctx.files[i]) != 0
+        || test_lookup(&ctx.archive, &ctx.files[i]) != 0) {
+      goto exit_free;
+    }
+  }
+
+  pthread_mutex_init(&ctx.lock, NULL);
+  for (i = 0; i < threads; i++) {
+    workers[i].ctx = &ctx;
+    workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    if (pthread_create(&workers[i].thread, NULL, test_worker, &workers[i])) {
+      fprintf(stderr, "pthread_create errno(%d): %s\n", errno, strerror(errno));
+      threads = i;
+      ctx.errors++;
+      break;
+    }
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+
+  printf("%s: %lu reads by %d threads, %lu errors\n", argv[1],
+         ctx.reads * threads, threads, ctx.errors);
+  ret = (ctx.errors != 0);
+
+exit_free:
+  for (i = 0; ctx.files != NULL && i < ctx.files_length; i++) {
+    free(ctx.files[i].data);
+  }
+  free(ctx.files);
+  free(workers);
+  libnar_close_archive(&ctx.archive);
+  close(fd);
+  return ret;
+}
@@ -32,44 +32,495 @@
 #include "nar.h"
 #include "zlib_readers.h"
 
+#include <sys/stat.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <zlib.h>
 
+/*
+** ---- PARALLEL DEFLATE
+**
+** The input is split in blocks compressed (raw deflate) by a pool of threads.
+** Each block uses the end of the previous one as dictionary and ends on a
+** byte boundary (Z_SYNC_FLUSH), the last one with Z_FINISH: their
+** concatenation, with a zlib header and the combined adler32, is a regular
+** zlib stream, as the one of the single threaded reader.
+*/
+
+typedef struct {
+  uint8_t* in;
+  uint32_t length;
+  uint8_t const* dictionary;
+  uint32_t dictionary_length;
+  int last;
+
+  uint8_t* out;
+  uint32_t out_length;
+  uLong adler;
+  int error;
+} pzlib_job;
+
+typedef struct {
+  uint32_t block_size;
+  int level;
+  int window_bits;
+  int mem_level;
+  int strategy;
+
+  pthread_t* workers;
+  int workers_length;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  unsigned int generation;
+  int stop;
+
+  /* the current batch: one block per worker */
+  pzlib_job* jobs;
+  int jobs_capacity;
+  int jobs_length;
+  int next_job;
+  int jobs_done;
+
+  /* the end of the last block of the previous batch (one window at most) */
+  uint8_t dictionary[32768];
+  uint32_t dictionary_size;
+  uint32_t dictionary_length;
+
+  /* what is being returned to the zlib_reader caller */
+  uint8_t header[2];
+  uint8_t trailer[4];
+  uLong adler;
+  int eof;
+  int finished;
+  int current_job;
+  uint8_t const* pending;
+  uint32_t pending_length;
+  /* the bytes read from the input */
+  uint64_t total_in;
+} pzlib_state;
+
 typedef struct {
   FILE* input;
 
-  int flush;
+  int eof;
+  int finished;
   z_stream strm;
+  /* what has been read but not consumed by deflate yet is in strm */
+  uint8_t in[ZLIB_BUFFER_SIZE];
+
+  pzlib_state* parallel;
 } zlib_reader_state;
 
-void* init_zlib_reader(struct nar_options const* opts)
+static struct {
+  char const* name;
+  int strategy;
+} const zlib_strategies[] = {
+  { "default",  Z_DEFAULT_STRATEGY },
+  { "filtered", Z_FILTERED },
+  { "huffman",  Z_HUFFMAN_ONLY },
+  { "rle",      Z_RLE },
+  { "fixed",    Z_FIXED },
+  { NULL, 0 }
+};
+
+/*
+** the deflate parameters of the options (or the zlib defaults)
+*/
+static void zlib_parameters(struct nar_options const* opts, int* level,
+                            int* window_bits, int* mem_level, int* strategy)
+{
+  *level = (opts->compression_level == NAR_DEFAULT_LEVEL)
+         ? Z_DEFAULT_COMPRESSION : opts->compression_level;
+  *window_bits = (opts->compression_window) ? opts->compression_window : 15;
+  *mem_level = (opts->compression_memlevel) ? opts->compression_memlevel : 8;
+  *strategy = opts->compression_strategy;
+}
+
+static void pzlib_compress(z_stream* strm, pzlib_job* job)
 {
-  zlib_reader_state* zrs = NULL;
   int ret;
 
-  if (opts->input != NULL) {
-    zrs = malloc(sizeof(zlib_reader_state));
-    if (zrs != NULL) {
-      memset(zrs, 0, sizeof(zlib_reader_state));
-      zrs->input = fopen(opts->input, "r");
-      zrs->strm.zalloc = Z_NULL;
-      zrs->strm.zfree = Z_NULL;
-      zrs->strm.opaque = Z_NULL;
-
-      zrs->flush = feof(zrs->input) ? Z_FINISH : Z_NO_FLUSH;
-
-      ret = deflateInit(&zrs->strm, Z_DEFAULT_COMPRESSION);
-      if (ret != Z_OK) {
-        fclose(zrs->input);
-        free(zrs);
-        zrs = NULL;
-        ERROR("unable to initialize deflate");
+  job->adler = adler32(adler32(0L, Z_NULL, 0), job->in, job->length);
+
+  deflateReset(strm);
+  if (job->dictionary_length) {
+    deflateSetDictionary(strm, job->dictionary, job->dictionary_length);
+  }
+
+  strm->next_in = job->in;
+  strm->avail_in = job->length;
+  strm->next_out = job->out;
+  strm->avail_out = deflateBound(strm, job->length) + 16;
+
+  ret = deflate(strm, (job->last) ? Z_FINISH : Z_SYNC_FLUSH);
+  if (ret == Z_STREAM_ERROR || strm->avail_in != 0
+      || (job->last && ret != Z_STREAM_END)) {
+    job->error = 1;
+  }
+
+  job->out_length = strm->next_out - job->out;
+}
+
+static void* pzlib_worker(void* opaque)
+{
+  pzlib_state* pzs = opaque;
+  unsigned int generation = 0;
+  z_stream strm;
+  int ret;
+
+  memset(&strm, 0, sizeof(z_stream));
+  ret = deflateInit2(&strm, pzs->level, Z_DEFLATED, -pzs->window_bits,
+                     pzs->mem_level, pzs->strategy);
+
+  pthread_mutex_lock(&pzs->lock);
+  while (!pzs->stop) {
+    if (generation == pzs->generation || pzs->next_job == pzs->jobs_length) {
+      generation = pzs->generation;
+      pthread_cond_wait(&pzs->work, &pzs->lock);
+      continue;
+    }
+
+    pzlib_job* job = &pzs->jobs[pzs->next_job++];
+    pthread_mutex_unlock(&pzs->lock);
+
+    if (ret == Z_OK) {
+      pzlib_compress(&strm, job);
+    } else {
+      job->error = 1;
+    }
+
+    pthread_mutex_lock(&pzs->lock);
+    if (++pzs->jobs_done == pzs->jobs_length) {
+      pthread_cond_signal(&pzs->done);
+    }
+  }
+  pthread_mutex_unlock(&pzs->lock);
+
+  if (ret == Z_OK) {
+    deflateEnd(&strm);
+  }
+
+  return NULL;
+}
+
+static void close_pzlib(pzlib_state* pzs)
+{
+  int i;
+
+  pthread_mutex_lock(&pzs->lock);
+  pzs->stop = 1;
+  pthread_cond_broadcast(&pzs->work);
+  pthread_mutex_unlock(&pzs->lock);
+
+  for (i = 0; i < pzs->workers_length; i++) {
+    pthread_join(pzs->workers[i], NULL);
+  }
+
+  for (i = 0; i < pzs->jobs_capacity; i++) {
+    free(pzs->jobs[i].in);
+    free(pzs->jobs[i].out);
+  }
+
+  pthread_cond_destroy(&pzs->done);
+  pthread_cond_destroy(&pzs->work);
+  pthread_mutex_destroy(&pzs->lock);
+  free(pzs->jobs);
+  free(pzs->workers);
+  free(pzs);
+}
+
+static pzlib_state* init_pzlib(struct nar_options const* opts)
+{
+  int threads = opts->threads;
+  pzlib_state* pzs;
+  uLong bound;
+  int i;
+
+  pzs = calloc(1, sizeof(pzlib_state));
+  if (pzs == NULL) {
+    return NULL;
+  }
+
+  pzs->block_size = PZLIB_BLOCK_SIZE;
+  zlib_parameters(opts, &pzs->level, &pzs->window_bits,
+                  &pzs->mem_level, &pzs->strategy);
+  pzs->dictionary_size = 1 << pzs->window_bits;
+  pthread_mutex_init(&pzs->lock, NULL);
+  pthread_cond_init(&pzs->work, NULL);
+  pthread_cond_init(&pzs->done, NULL);
+
+  /* zlib header: deflate with the window size, no dictionary */
+  pzs->header[0] = ((pzs->window_bits - 8) << 4) | Z_DEFLATED;
+  pzs->header[1] = 2 << 6;
+  pzs->header[1] += 31 - ((pzs->header[0] << 8) + pzs->header[1]) % 31;
+  pzs->adler = adler32(0L, Z_NULL, 0);
+  pzs->current_job = -1;
+  pzs->pending = pzs->header;
+  pzs->pending_length = sizeof(pzs->header);
+
+  pzs->workers = calloc(threads, sizeof(pthread_t));
+  pzs->jobs = calloc(threads, sizeof(pzlib_job));
+  if (pzs->workers == NULL || pzs->jobs == NULL) {
+    close_pzlib(pzs);
+    return NULL;
+  }
+
+  bound = compressBound(pzs->block_size) + 64;
+  for (i = 0; i < threads; i++) {
+    pzs->jobs_capacity++;
+    pzs->jobs[i].in = malloc(pzs->block_size);
+    pzs->jobs[i].out = malloc(bound);
+    if (pzs->jobs[i].in == NULL || pzs->jobs[i].out == NULL) {
+      close_pzlib(pzs);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&pzs->workers[i], NULL, pzlib_worker, pzs) != 0) {
+      ERROR("can't create the deflate thread %d", i);
+      break;
+    }
+    pzs->workers_length++;
+  }
+
+  if (pzs->workers_length == 0) {
+    close_pzlib(pzs);
+    return NULL;
+  }
+
+  DPRINTF("%d deflate threads", pzs->workers_length);
+  return pzs;
+}
+
+/*
+** read and compress the next batch of blocks. Returns -1 on error.
+*/
+static int pzlib_next_batch(pzlib_state* pzs, FILE* input)
+{
+  pzlib_job* job;
+  int i, c;
+
+  for (i = 0; i < pzs->workers_length && !pzs->eof; i++) {
+    job = &pzs->jobs[i];
+
+    job->length = fread(job->in, sizeof(uint8_t), pzs->block_size, input);
+    if (ferror(input)) {
+      DPRINTF("error on read");
+      return -1;
+    }
+    pzs->total_in += job->length;
+
+    /* is it the last block? */
+    c = getc(input);
+    if (c == EOF) {
+      pzs->eof = 1;
+    } else {
+      ungetc(c, input);
+    }
+
+    job->last = pzs->eof;
+    job->error = 0;
+    if (i == 0) {
+      job->dictionary = pzs->dictionary;
+      job->dictionary_length = pzs->dictionary_length;
+    } else {
+      uint32_t l = pzs->jobs[i - 1].length;
+      uint32_t d = (l > pzs->dictionary_size) ? pzs->dictionary_size : l;
+
+      job->dictionary = &pzs->jobs[i - 1].in[l - d];
+      job->dictionary_length = d;
+    }
+  }
+
+  pthread_mutex_lock(&pzs->lock);
+  pzs->jobs_length = i;
+  pzs->next_job = 0;
+  pzs->jobs_done = 0;
+  pzs->generation++;
+  pthread_cond_broadcast(&pzs->work);
+  while (pzs->jobs_done != pzs->jobs_length) {
+    pthread_cond_wait(&pzs->done, &pzs->lock);
+  }
+  pthread_mutex_unlock(&pzs->lock);
+
+  for (c = 0; c < i; c++) {
+    job = &pzs->jobs[c];
+    if (job->error) {
+      ERROR("deflate error");
+      return -1;
+    }
+    pzs->adler = adler32_combine(pzs->adler, job->adler, job->length);
+  }
+
+  /* keep the end of the batch as dictionary of the next one */
+  job = &pzs->jobs[i - 1];
+  pzs->dictionary_length = (job->length > pzs->dictionary_size)
+                         ? pzs->dictionary_size : job->length;
+  memcpy(pzs->dictionary, &job->in[job->length - pzs->dictionary_length],
+         pzs->dictionary_length);
+
+  if (pzs->eof) {
+    pzs->trailer[0] = pzs->adler >> 24;
+    pzs->trailer[1] = pzs->adler >> 16;
+    pzs->trailer[2] = pzs->adler >> 8;
+    pzs->trailer[3] = pzs->adler;
+  }
+
+  return 0;
+}
+
+static int pzlib_reader(zlib_reader_state* zrs, uint8_t* buf, uint32_t const max)
+{
+  pzlib_state* pzs = zrs->parallel;
+  uint32_t have = 0;
+  uint32_t length;
+
+  while (have < max) {
+    if (pzs->pending_length == 0) {
+      /* next output chunk: the blocks of the batch, then the trailer */
+      if (pzs->current_job + 1 < pzs->jobs_length) {
+        pzlib_job* job = &pzs->jobs[++pzs->current_job];
+
+        pzs->pending = job->out;
+        pzs->pending_length = job->out_length;
+      } else if (!pzs->eof) {
+        if (pzlib_next_batch(pzs, zrs->input) != 0) {
+          return -1;
+        }
+        pzs->current_job = -1;
+      } else if (!pzs->finished) {
+        pzs->pending = pzs->trailer;
+        pzs->pending_length = sizeof(pzs->trailer);
+        pzs->finished = 1;
+      } else {
+        break;
+      }
+      continue;
+    }
+
+    length = (pzs->pending_length > max - have) ? max - have : pzs->pending_length;
+    memcpy(&buf[have], pzs->pending, length);
+    pzs->pending += length;
+    pzs->pending_length -= length;
+    have += length;
+  }
+
+  return have;
+}
+
+int zlib_configure(struct nar_options* opts, char const* parameters)
+{
+  char const* field = parameters;
+  char* end;
+  long value;
+  int i, n;
+
+  /* level[:strategy[:window[:memlevel]]], an empty field is the default */
+  for (n = 0; field != NULL; n++) {
+    if (*field != ':' && *field != '\0') {
+      if (n == 1) {
+        for (i = 0; zlib_strategies[i].name != NULL; i++) {
+          size_t l = strlen(zlib_strategies[i].name);
+
+          if (!strncmp(field, zlib_strategies[i].name, l)
+              && (field[l] == ':' || field[l] == '\0')) {
+            break;
+          }
+        }
+        if (zlib_strategies[i].name == NULL) {
+          ERROR("unknown deflate strategy: %s", field);
+          return -1;
+        }
+        opts->compression_strategy = zlib_strategies[i].strategy;
+      } else {
+        value = strtol(field, &end, 10);
+        if (end == field || (*end != ':' && *end != '\0')) {
+          ERROR("invalid deflate parameter: %s", field);
+          return -1;
+        }
+        switch (n) {
+        case 0:
+          if (value < 0 || value > 9) {
+            ERROR("the deflate level is from 0 to 9: %ld", value);
+            return -1;
+          }
+          opts->compression_level = value;
+          break;
+        case 2:
+          if (value < 9 || value > 15) {
+            ERROR("the deflate window is from 9 to 15: %ld", value);
+            return -1;
+          }
+          opts->compression_window = value;
+          break;
+        case 3:
+          if (value < 1 || value > 9) {
+            ERROR("the deflate memlevel is from 1 to 9: %ld", value);
+            return -1;
+          }
+          opts->compression_memlevel = value;
+          break;
+        default:
+          ERROR("too many deflate parameters: %s", parameters);
+          return -1;
+        }
       }
-      DPRINTF("initialization done");
+    }
+
+    field = strchr(field, ':');
+    if (field != NULL) {
+      field++;
     }
   }
 
+  return 0;
+}
+
+void* init_zlib_reader(struct nar_options const* opts)
+{
+  zlib_reader_state* zrs = NULL;
+  struct stat st;
+  int level, window_bits, mem_level, strategy;
+  int ret;
+
+  if (opts->input == NULL) {
+    return NULL;
+  }
+
+  zrs = calloc(1, sizeof(zlib_reader_state));
+  if (zrs == NULL) {
+    return NULL;
+  }
+
+  zrs->input = fopen(opts->input, "r");
+  if (zrs->input == NULL) {
+    ERROR("open(%s) errno(%d): %s", opts->input, errno, strerror(errno));
+    free(zrs);
+    return NULL;
+  }
+
+  /* a file of one block is not worth the threads */
+  if (opts->threads > 1 && fstat(fileno(zrs->input), &st) == 0
+      && st.st_size > PZLIB_BLOCK_SIZE) {
+    zrs->parallel = init_pzlib(opts);
+    ret = (zrs->parallel != NULL) ? Z_OK : Z_MEM_ERROR;
+  } else {
+    zlib_parameters(opts, &level, &window_bits, &mem_level, &strategy);
+    ret = deflateInit2(&zrs->strm, level, Z_DEFLATED, window_bits,
+                       mem_level, strategy);
+  }
+  if (ret != Z_OK) {
+    fclose(zrs->input);
+    free(zrs);
+    ERROR("unable to initialize deflate");
+    return NULL;
+  }
+
+  DPRINTF("initialization done");
   return zrs;
 }
 
@@ -80,7 +531,11 @@ void close_zlib_reader(void* opaque)
 
   if (zrs != NULL) {
     fclose(zrs->input);
-    deflateEnd(&zrs->strm);
+    if (zrs->parallel != NULL) {
+      close_pzlib(zrs->parallel);
+    } else {
+      deflateEnd(&zrs->strm);
+    }
     free(zrs);
   }
 
@@ -91,55 +546,48 @@ int zlib_reader(void* opaque, uint8_t* buf, uint32_t const max)
 {
   zlib_reader_state* zrs = NULL;
   zrs = opaque;
-  int have = 0;
+  size_t length;
   int ret;
-  uint8_t* in = NULL;
 
   if (zrs == NULL) {
     DPRINTF("opaque(%p)", zrs);
     return -1;
   }
 
-  in = malloc(max);
-  if (in == NULL) {
-    DPRINTF("in(%p)", in);
-    return -1;
+  if (zrs->parallel != NULL) {
+    return pzlib_reader(zrs, buf, max);
   }
-  memset(in, 0, max);
 
-  if (zrs->flush == Z_FINISH) {
-    DPRINTF("finish");
-    goto zlib_read_finish;
-  }
-
-  zrs->strm.avail_in = fread(in, sizeof(uint8_t), max, zrs->input);
-  if (ferror(zrs->input)) {
-    have = -1;
-    DPRINTF("error on read");
-    goto zlib_read_finish;
-  }
-
-  zrs->flush = feof(zrs->input) ? Z_FINISH : Z_NO_FLUSH;
-  zrs->strm.next_in = in;
-
-  zrs->strm.avail_out = max;
+  /* fill buf: the output is drained until the end of the stream */
   zrs->strm.next_out = buf;
-  ret = deflate(&zrs->strm, zrs->flush);
+  zrs->strm.avail_out = max;
+  while (zrs->strm.avail_out > 0 && !zrs->finished) {
+    if (zrs->strm.avail_in == 0 && !zrs->eof) {
+      length = fread(zrs->in, sizeof(uint8_t), sizeof(zrs->in), zrs->input);
+      if (ferror(zrs->input)) {
+        DPRINTF("error on read");
+        return -1;
+      }
+      zrs->eof = feof(zrs->input) || length == 0;
+      zrs->strm.next_in = zrs->in;
+      zrs->strm.avail_in = length;
+    }
 
-  switch (ret) {
-  case Z_STREAM_ERROR:
-    have = -1;
-    break;
-  case Z_STREAM_END:
-  default:
-    have = (max - zrs->strm.avail_out);
-    break;
+    ret = deflate(&zrs->strm, (zrs->eof) ? Z_FINISH : Z_NO_FLUSH);
+    switch (ret) {
+    case Z_STREAM_END:
+      zrs->finished = 1;
+      break;
+    case Z_OK:
+    case Z_BUF_ERROR:
+      break;
+    default:
+      ERROR("deflate error %d", ret);
+      return -1;
+    }
   }
 
-zlib_read_finish:
-  DPRINTF("buf(%s) have(%d)", buf, have);
-  free(in);
-  return have;
+  return max - zrs->strm.avail_out;
 }
 
 int zlib_size(void* opaque, uint64_t* size)
@@ -159,3 +607,97 @@ int zlib_size(void* opaque, uint64_t* size)
 
   return 0;
 }
+
+int zlib_consumed(void* opaque, uint64_t* consumed)
+{
+  zlib_reader_state* zrs = opaque;
+
+  if (zrs == NULL || consumed == NULL) {
+    DPRINTF("opaque(%p) consumed(%p)", zrs, consumed);
+    return -1;
+  }
+
+  *consumed = (zrs->parallel != NULL) ? zrs->parallel->total_in
+                                      : zrs->strm.total_in;
+
+  return 0;
+}
+
+int zlib_compress_block(struct nar_options const* opts,
+                        uint8_t const* in, uint32_t const length,
+                        uint8_t* out, uint32_t* out_length)
+{
+  int level, window_bits, mem_level, strategy;
+  z_stream strm;
+  int ret;
+
+  memset(&strm, 0, sizeof(z_stream));
+  zlib_parameters(opts, &level, &window_bits, &mem_level, &strategy);
+  if (deflateInit2(&strm, level, Z_DEFLATED,
+                   window_bits, mem_level, strategy) != Z_OK) {
+    ERROR("unable to initialize zlib");
+    return -1;
+  }
+
+  strm.next_in = (Bytef*)in;
+  strm.avail_in = length;
+  strm.next_out = out;
+  strm.avail_out = *out_length;
+  ret = deflate(&strm, Z_FINISH);
+  *out_length = strm.total_out;
+  deflateEnd(&strm);
+
+  if (ret != Z_STREAM_END) {
+    ERROR("deflate(%d): the block does not fit", ret);
+    return -1;
+  }
+
+  return 0;
+}
+
+int zlib_sample_gain(char const* input, uint32_t const sample, int* gain)
+{
+  FILE* file;
+  uint8_t* in;
+  uint8_t* out;
+  uLongf out_length;
+  size_t length;
+  int ret;
+
+  file = fopen(input, "r");
+  if (file == NULL) {
+    ERROR("open(%s) errno(%d): %s", input, errno, strerror(errno));
+    return -errno;
+  }
+
+  in = malloc(sample);
+  out_length = compressBound(sample);
+  out = malloc(out_length);
+  if (in == NULL || out == NULL) {
+    ret = -ENOMEM;
+    goto finish;
+  }
+
+  length = fread(in, sizeof(uint8_t), sample, file);
+  if (length == 0) {
+    /* nothing to gain from an empty file */
+    *gain = 0;
+    ret = (ferror(file)) ? -EIO : 0;
+    goto finish;
+  }
+
+  ret = compress2(out, &out_length, in, length, Z_BEST_SPEED);
+  if (ret != Z_OK) {
+    ERROR("compress2(%s) error(%d)", input, ret);
+    ret = -EIO;
+    goto finish;
+  }
+  *gain = 100 - (int) ((out_length * 100) / length);
+  ret = 0;
+
+finish:
+  free(out);
+  free(in);
+  fclose(file);
+  return ret;
+}
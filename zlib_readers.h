@@ -32,9 +32,33 @@
 #ifndef ZLIB_READERS_H_
 # define ZLIB_READERS_H_
 
+/* the size of the blocks compressed in parallel (see --threads) */
+# define PZLIB_BLOCK_SIZE (128 * 1024)
+
+/* the input buffer of the deflate engine */
+# define ZLIB_BUFFER_SIZE (256 * 1024)
+
+/*
+** parse the parameters of "-t deflate:<parameters>" in the options:
+** level[:strategy[:window[:memlevel]]] (see deflateInit2)
+*/
+int zlib_configure(struct nar_options* opts, char const* parameters);
 void* init_zlib_reader(struct nar_options const* opts);
 void close_zlib_reader(void* opaque);
 int zlib_reader(void* opaque, uint8_t* buf, uint32_t const max);
 int zlib_size(void* opaque, uint64_t* size);
+/* the bytes of the input compressed so far */
+int zlib_consumed(void* opaque, uint64_t* consumed);
+/* compress a whole block in out (*out_length: its size, then the one used) */
+int zlib_compress_block(struct nar_options const* opts,
+                        uint8_t const* in, uint32_t const length,
+                        uint8_t* out, uint32_t* out_length);
+
+/*
+** set gain to the gain (in percent of the input, negative if it grows) of a
+** fast deflate of the first <sample> bytes of the file input: an estimate of
+** what compressing the whole file is worth (see --auto-compress)
+*/
+int zlib_sample_gain(char const* input, uint32_t const sample, int* gain);
 
 #endif /* !ZLIB_READERS_H_ */
@@ -0,0 +1,258 @@
+/*
+** Copyright (c) 2014, Nicolas DI PRIMA <nicolas@di-prima.fr>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice,
+** this list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+** this list of conditions and the following disclaimer in the documentation
+** and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+** contributors may be used to endorse or promote products derived from this
+** software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "nar.h"
+#include "zstd_readers.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+/* the window log of "long" without a value (as zstd --long) */
+#define ZSTD_LONG_WINDOWLOG 27
+
+typedef struct {
+  FILE* input;
+
+  int eof;
+  int finished;
+  ZSTD_CCtx* cctx;
+  /* what has been read but not consumed by zstd yet */
+  ZSTD_inBuffer in;
+  uint8_t buffer[ZSTD_BUFFER_SIZE];
+  /* the bytes read from the input */
+  uint64_t consumed;
+} zstd_reader_state;
+
+int zstd_configure(struct nar_options* opts, char const* parameters)
+{
+  char const* field;
+  char* end;
+  long value;
+
+  if (*parameters != ':' && *parameters != '\0') {
+    value = strtol(parameters, &end, 10);
+    if (end == parameters || (*end != ':' && *end != '\0')
+        || value < ZSTD_minCLevel() || value > ZSTD_maxCLevel()) {
+      ERROR("the zstd level is from %d to %d: %s",
+            ZSTD_minCLevel(), ZSTD_maxCLevel(), parameters);
+      return -1;
+    }
+    opts->compression_level = value;
+  }
+
+  field = strchr(parameters, ':');
+  if (field == NULL) {
+    return 0;
+  }
+  field++;
+
+  /* long distance matching, with a window of 2^windowlog bytes */
+  if (strncmp(field, "long", 4) || (field[4] != '=' && field[4] != '\0')) {
+    ERROR("unknown zstd parameter: %s", field);
+    return -1;
+  }
+  opts->compression_window = ZSTD_LONG_WINDOWLOG;
+  if (field[4] == '=') {
+    /* the bounds of the library (its macros are for static linking only) */
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+
+    value = strtol(&field[5], &end, 10);
+    if (end == &field[5] || *end != '\0' || ZSTD_isError(bounds.error)
+        || value < bounds.lowerBound || value > bounds.upperBound) {
+      ERROR("the zstd window log is from %d to %d: %s",
+            bounds.lowerBound, bounds.upperBound, &field[5]);
+      return -1;
+    }
+    opts->compression_window = value;
+  }
+
+  return 0;
+}
+
+/*
+** set the level and the window of the options
+*/
+static void zstd_parameters(ZSTD_CCtx* cctx, struct nar_options const* opts)
+{
+  if (opts->compression_level != NAR_DEFAULT_LEVEL) {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           opts->compression_level);
+  }
+  if (opts->compression_window) {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, opts->compression_window);
+  }
+}
+
+void* init_zstd_reader(struct nar_options const* opts)
+{
+  zstd_reader_state* zrs;
+
+  if (opts->input == NULL) {
+    return NULL;
+  }
+
+  zrs = calloc(1, sizeof(zstd_reader_state));
+  if (zrs == NULL) {
+    return NULL;
+  }
+
+  zrs->input = fopen(opts->input, "r");
+  if (zrs->input == NULL) {
+    ERROR("open(%s) errno(%d): %s", opts->input, errno, strerror(errno));
+    free(zrs);
+    return NULL;
+  }
+
+  zrs->cctx = ZSTD_createCCtx();
+  if (zrs->cctx == NULL) {
+    ERROR("unable to initialize zstd");
+    fclose(zrs->input);
+    free(zrs);
+    return NULL;
+  }
+
+  zstd_parameters(zrs->cctx, opts);
+  if (opts->threads > 1
+      && ZSTD_isError(ZSTD_CCtx_setParameter(zrs->cctx, ZSTD_c_nbWorkers,
+                                             opts->threads))) {
+    DPRINTF("zstd is built without threads");
+  }
+
+  zrs->in.src = zrs->buffer;
+  DPRINTF("initialization done");
+  return zrs;
+}
+
+void close_zstd_reader(void* opaque)
+{
+  zstd_reader_state* zrs = opaque;
+
+  if (zrs != NULL) {
+    fclose(zrs->input);
+    ZSTD_freeCCtx(zrs->cctx);
+    free(zrs);
+  }
+}
+
+int zstd_reader(void* opaque, uint8_t* buf, uint32_t const max)
+{
+  zstd_reader_state* zrs = opaque;
+  ZSTD_outBuffer out = { buf, max, 0 };
+  size_t ret;
+
+  if (zrs == NULL) {
+    DPRINTF("opaque(%p)", zrs);
+    return -1;
+  }
+
+  /* fill buf: the output is drained until the end of the frame */
+  while (out.pos < out.size && !zrs->finished) {
+    if (zrs->in.pos == zrs->in.size && !zrs->eof) {
+      zrs->in.size = fread(zrs->buffer, sizeof(uint8_t), sizeof(zrs->buffer),
+                           zrs->input);
+      zrs->in.pos = 0;
+      if (ferror(zrs->input)) {
+        DPRINTF("error on read");
+        return -1;
+      }
+      zrs->eof = feof(zrs->input) || zrs->in.size == 0;
+      zrs->consumed += zrs->in.size;
+    }
+
+    ret = ZSTD_compressStream2(zrs->cctx, &out, &zrs->in,
+                               (zrs->eof) ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(ret)) {
+      ERROR("zstd: %s", ZSTD_getErrorName(ret));
+      return -1;
+    }
+    zrs->finished = (zrs->eof && ret == 0);
+  }
+
+  return out.pos;
+}
+
+int zstd_size(void* opaque, uint64_t* size)
+{
+  zstd_reader_state* zrs = opaque;
+
+  if (zrs == NULL || size == NULL) {
+    DPRINTF("opaque(%p) size(%p)", zrs, size);
+    return -1;
+  }
+
+  fseek(zrs->input, 0, SEEK_END);
+  *size = ftell(zrs->input);
+  fseek(zrs->input, 0, SEEK_SET);
+
+  return 0;
+}
+
+int zstd_consumed(void* opaque, uint64_t* consumed)
+{
+  zstd_reader_state* zrs = opaque;
+
+  if (zrs == NULL || consumed == NULL) {
+    DPRINTF("opaque(%p) consumed(%p)", zrs, consumed);
+    return -1;
+  }
+
+  *consumed = zrs->consumed;
+
+  return 0;
+}
+
+int zstd_compress_block(struct nar_options const* opts,
+                        uint8_t const* in, uint32_t const length,
+                        uint8_t* out, uint32_t* out_length)
+{
+  ZSTD_CCtx* cctx;
+  size_t ret;
+
+  cctx = ZSTD_createCCtx();
+  if (cctx == NULL) {
+    ERROR("unable to initialize zstd");
+    return -1;
+  }
+  zstd_parameters(cctx, opts);
+
+  ret = ZSTD_compress2(cctx, out, *out_length, in, length);
+  ZSTD_freeCCtx(cctx);
+  if (ZSTD_isError(ret)) {
+    ERROR("zstd: %s", ZSTD_getErrorName(ret));
+    return -1;
+  }
+  *out_length = ret;
+
+  return 0;
+}